@@ -2,17 +2,47 @@
 #include <fstream>
 
 #include "ns3/tor-module.h"
+#include "ns3/mpi-interface.h"
 
 using namespace ns3;
 using namespace std;
 NS_LOG_COMPONENT_DEFINE ("TorExample");
 
-void StatsCallback(TorDumbbellHelper*, Time);
-void TtfbCallback(int, double, std::string);
-void TtlbCallback(int, double, std::string);
+/* TTLBs of all circuits, one "circuit seconds" line each (rank 0 only) */
+static ofstream g_ttlbs;
+
+static void RecordTtlb (int id, double seconds, string) {
+    g_ttlbs << id << " " << seconds << endl;
+}
+
+/* Sweep point i, applied in the forked child that runs it. */
+struct Sweep {
+    TorDumbbellHelper *th;
+    TorStatsCollector *stats;
+    TorLatencySummary *latency;
+    string attribute;
+    vector<string> values;
+    Time stop;
+
+    void Apply (uint32_t i) {
+        NS_LOG_INFO("sweep point " << i << ": " << attribute << "=" << values[i]);
+        th->SetTorAppsAttribute(attribute, StringValue(values[i]));
+        latency->Reset();
+        stringstream statsFile;
+        statsFile << "tor-stats-" << i << ".bin";
+        stats->Start(statsFile.str(), MilliSeconds(10), stop);
+    }
+};
 
 int main (int argc, char *argv[]) {
     uint32_t run = 1;
+    uint32_t ranks = 1;
+    string sweepSpec;
+    Time forkAt = Time("30s");
+    uint32_t jobs = 0;
+    bool link = false;
+    bool nsc = true;
+    string ttlbFile;
     Time simTime = Time("90s");
     //string flavor = "vanilla";
     string flavor = "bktap";
@@ -22,8 +52,21 @@ int main (int argc, char *argv[]) {
     cmd.AddValue("run", "run number", run);
     cmd.AddValue("time", "simulation time", simTime);
     cmd.AddValue("flavor", "Tor flavor", flavor);
+    cmd.AddValue("ranks", "number of MPI ranks (run with mpirun -np <ranks>)", ranks);
+    cmd.AddValue("sweep", "fork one run per value after the warm-up, e.g. BandwidthRate=2MB/s,5MB/s,10MB/s", sweepSpec);
+    cmd.AddValue("forkAt", "simulation time of the fork for --sweep", forkAt);
+    cmd.AddValue("jobs", "sweep runs at once (0: all)", jobs);
+    cmd.AddValue("link", "emulate the links between relays instead of simulating IP and TCP/UDP", link);
+    cmd.AddValue("nsc", "use the linux stack (NSC) instead of ns-3's TCP", nsc);
+    cmd.AddValue("ttlbs", "write the TTLB of every download to this file", ttlbFile);
     cmd.Parse(argc, argv);
 
+    if (ranks > 1) {
+        GlobalValue::Bind ("SimulatorImplementationType", StringValue ("ns3::DistributedSimulatorImpl"));
+        MpiInterface::Enable (&argc, &argv);
+    }
+    bool root = MpiInterface::GetSystemId () == 0;
+
     SeedManager::SetSeed (42);
     SeedManager::SetRun (run);
 
@@ -58,8 +101,10 @@ int main (int argc, char *argv[]) {
     else if (flavor == "fair")
         th.SetTorAppType("ns3::TorFairApp");
 
+    th.SetRankCount(ranks);
     th.DisableProxies(true); // make circuits shorter (entry = proxy), thus the simulation faster
-    th.EnableNscStack(true,"cubic"); // enable linux protocol stack and set tcp flavor
+    th.EnableNscStack(nsc,"cubic"); // enable linux protocol stack and set tcp flavor
+    th.EnableLinkEmulation(link); // much faster; cells still go through the Tor apps
 
     Ptr<UniformRandomVariable> m_startTime = CreateObject<UniformRandomVariable> ();
     m_startTime->SetAttribute ("Min", DoubleValue (0.1));
@@ -70,11 +115,18 @@ int main (int argc, char *argv[]) {
     th.ParseFile ("circuits-10000c100r-20150804.dat",100,0.1);
     //th.ParseFile ("circuits-2c4r-20150804.dat",2,0.);
     //th.ParseFile ("circuits-20c22r-20150804.dat",20,0.5);
-    th.PrintCircuits();
+    if (root)
+        th.PrintCircuits();
     th.BuildTopology(); // finally build topology, setup relays and seed circuits
 
-    th.RegisterTtfbCallback (TtfbCallback);
-    th.RegisterTtlbCallback (TtlbCallback);
+    /* ttfb/ttlb quantiles per circuit type and relay, written after the run */
+    TorLatencySummary latency;
+    latency.Add(th);
+    if (!ttlbFile.empty()) {
+        if (root)
+            g_ttlbs.open(ttlbFile.c_str());
+        th.RegisterTtlbCallback(RecordTtlb);
+    }
 
     ApplicationContainer relays = th.GetTorAppsContainer();
 
@@ -82,50 +134,59 @@ int main (int argc, char *argv[]) {
     relays.Stop (simTime);
     Simulator::Stop (simTime);
 
-    Simulator::Schedule(Seconds(0), &StatsCallback, &th, simTime);
+    /* per-circuit i/o stats of all relays, every 10ms (read with e.g. numpy) */
+    TorStatsCollector stats;
+    stats.Add(relays);
+
+    /* with --sweep, the topology and the first forkAt seconds are simulated
+     * once and shared by all sweep points (see TorWarmStart) */
+    Sweep sweep;
+    TorWarmStart warm;
+    if (!sweepSpec.empty()) {
+        size_t eq = sweepSpec.find('=');
+        NS_ABORT_MSG_IF(eq == string::npos, "--sweep expects Attribute=value,value,...");
+        sweep.th = &th;
+        sweep.stats = &stats;
+        sweep.latency = &latency;
+        sweep.attribute = sweepSpec.substr(0, eq);
+        sweep.stop = simTime;
+        stringstream values(sweepSpec.substr(eq + 1));
+        string value;
+        while (getline(values, value, ','))
+            sweep.values.push_back(value);
+        warm.Schedule(forkAt, sweep.values.size(), MakeCallback(&Sweep::Apply, &sweep), jobs);
+    } else {
+        stringstream statsFile;
+        statsFile << "tor-stats";
+        if (ranks > 1)
+            statsFile << "-" << MpiInterface::GetSystemId();
+        statsFile << ".bin";
+        stats.Start(statsFile.str(), MilliSeconds(10), simTime);
+    }
 
     NS_LOG_INFO("start simulation");
     Simulator::Run ();
 
     NS_LOG_INFO("stop simulation");
+    stats.Stop();
+    if (!sweepSpec.empty() && warm.IsParent()) {
+        if (warm.GetFailed())
+            cerr << warm.GetFailed() << " sweep runs failed" << endl;
+        Simulator::Destroy ();
+        return warm.GetFailed() ? 1 : 0;
+    }
+    th.CollectResults(); // gathers the TTLBs of all ranks on rank 0
+    stringstream latencyFile;
+    latencyFile << "tor-latency";
+    if (ranks > 1)
+        latencyFile << "-" << MpiInterface::GetSystemId();
+    if (!sweepSpec.empty())
+        latencyFile << "-" << warm.GetIndex();
+    latencyFile << ".txt";
+    latency.Write(latencyFile.str());
     Simulator::Destroy ();
+    if (ranks > 1)
+        MpiInterface::Disable ();
 
     return 0;
 }
-
-/* example of (cumulative) i/o stats */
-void StatsCallback(TorDumbbellHelper* th, Time simTime) {
-    cout << Simulator::Now().GetSeconds() << " ";
-    vector<int>::iterator id;
-    for (id = th->circuitIds.begin(); id != th->circuitIds.end(); ++id) {
-      Ptr<TorBaseApp> proxyApp = th->GetProxyApp(*id);
-      Ptr<TorBaseApp> middleApp = th->GetMiddleApp(*id);
-      Ptr<TorBaseApp> exitApp = th->GetExitApp(*id);
-      Ptr<BaseCircuit> proxyCirc = proxyApp->baseCircuits[*id];
-      Ptr<BaseCircuit> middleCirc = middleApp->baseCircuits[*id];
-      Ptr<BaseCircuit> exitCirc = exitApp->baseCircuits[*id];
-      //cout <<"INBOUND: " << endl;
-      //cout <<"Exit Node: "<< exitCirc->GetBytesRead(INBOUND) << " " << exitCirc->GetBytesWritten(INBOUND) << endl;
-      //cout <<"Middle Node: "<< middleCirc->GetBytesRead(INBOUND) << " " << middleCirc->GetBytesWritten(INBOUND) << endl;
-      //cout <<"Proxy Node: "<< proxyCirc->GetBytesRead(INBOUND) << " " << proxyCirc->GetBytesWritten(INBOUND) << endl;
-
-      //cout <<"OUTBOUND: " << endl;
-      //cout <<"Proxy Node: "<< proxyCirc->GetBytesRead(OUTBOUND) << " " << proxyCirc->GetBytesWritten(OUTBOUND) << endl;
-      //cout <<"Middle Node: "<< middleCirc->GetBytesRead(OUTBOUND) << " " << middleCirc->GetBytesWritten(OUTBOUND) << endl;
-      //cout <<"Exit Node: "<< exitCirc->GetBytesRead(OUTBOUND) << " " << exitCirc->GetBytesWritten(OUTBOUND) << endl;
-      //proxyCirc->ResetStats(); exitCirc->ResetStats();
-    }
-    cout << endl;
-
-    Time resolution = MilliSeconds(10);
-    if (Simulator::Now()+resolution < simTime)
-        Simulator::Schedule(resolution, &StatsCallback, th, simTime);
-}
-
-void TtfbCallback(int id, double time, std::string desc) {
-    cout << Simulator::Now().GetSeconds() << " " << desc << " ttfb from id " << id << ": " << time << endl;
-}
-
-void TtlbCallback(int id, double time, std::string desc) {
-    cout << Simulator::Now().GetSeconds() << " " << desc << " ttlb from id " << id << ": " << time << endl;
-}
@@ -77,6 +77,48 @@ DropTailQueueTestCase::DoRun (void)
   NS_TEST_EXPECT_MSG_EQ ((p == 0), true, "There are really no packets in there");
 }
 
+class DropTailQueueDrainTestCase : public TestCase
+{
+public:
+  DropTailQueueDrainTestCase ();
+  virtual void DoRun (void);
+private:
+  void Drain (void);
+  uint32_t m_drains;
+};
+
+DropTailQueueDrainTestCase::DropTailQueueDrainTestCase ()
+  : TestCase ("Check that Drain fires when the queue drops to its low watermark"),
+    m_drains (0)
+{
+}
+void
+DropTailQueueDrainTestCase::Drain (void)
+{
+  m_drains++;
+}
+void
+DropTailQueueDrainTestCase::DoRun (void)
+{
+  Ptr<DropTailQueue> queue = CreateObject<DropTailQueue> ();
+  queue->SetAttribute ("MaxPackets", UintegerValue (3));
+  queue->SetAttribute ("LowWatermark", UintegerValue (2));
+  queue->TraceConnectWithoutContext ("Drain", MakeCallback (&DropTailQueueDrainTestCase::Drain, this));
+
+  queue->Enqueue (Create<Packet> ());
+  queue->Enqueue (Create<Packet> ());
+  queue->Enqueue (Create<Packet> ());
+  NS_TEST_EXPECT_MSG_EQ (m_drains, 0, "Enqueueing must not fire Drain");
+  queue->Dequeue ();
+  NS_TEST_EXPECT_MSG_EQ (m_drains, 1, "The queue dropped from 3 to 2 packets");
+  queue->Dequeue ();
+  NS_TEST_EXPECT_MSG_EQ (m_drains, 1, "Drain fires only at the watermark");
+  queue->Enqueue (Create<Packet> ());
+  queue->Enqueue (Create<Packet> ());
+  queue->Dequeue ();
+  NS_TEST_EXPECT_MSG_EQ (m_drains, 2, "Drain fires again after the queue was above the watermark");
+}
+
 static class DropTailQueueTestSuite : public TestSuite
 {
 public:
@@ -84,5 +126,6 @@ public:
     : TestSuite ("drop-tail-queue", UNIT)
   {
     AddTestCase (new DropTailQueueTestCase (), TestCase::QUICK);
+    AddTestCase (new DropTailQueueDrainTestCase (), TestCase::QUICK);
   }
 } g_dropTailQueueTestSuite;
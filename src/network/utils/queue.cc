@@ -18,6 +18,7 @@
 
 #include "ns3/log.h"
 #include "ns3/trace-source-accessor.h"
+#include "ns3/uinteger.h"
 #include "queue.h"
 
 namespace ns3 {
@@ -40,11 +41,20 @@ Queue::GetTypeId (void)
     .AddTraceSource ("Drop", "Drop a packet stored in the queue.",
                      MakeTraceSourceAccessor (&Queue::m_traceDrop),
                      "ns3::Packet::TracedCallback")
+    .AddTraceSource ("Drain", "A dequeue left LowWatermark packets in the queue.",
+                     MakeTraceSourceAccessor (&Queue::m_traceDrain),
+                     "ns3::Queue::DrainTracedCallback")
+    .AddAttribute ("LowWatermark",
+                   "Number of packets at which Drain fires, so that senders held back by a full queue can resume.",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&Queue::m_lowWatermark),
+                   MakeUintegerChecker<uint32_t> ())
   ;
   return tid;
 }
 
 Queue::Queue() : 
+  m_lowWatermark (0),
   m_nBytes (0),
   m_nTotalReceivedBytes (0),
   m_nPackets (0),
@@ -102,6 +112,12 @@ Queue::Dequeue (void)
 
       NS_LOG_LOGIC ("m_traceDequeue (packet)");
       m_traceDequeue (packet);
+
+      if (m_nPackets == m_lowWatermark)
+        {
+          NS_LOG_LOGIC ("m_traceDrain ()");
+          m_traceDrain ();
+        }
     }
   return packet;
 }
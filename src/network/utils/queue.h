@@ -119,6 +119,12 @@ public:
    */
   void ResetStatistics (void);
 
+  /**
+   * TracedCallback signature for the Drain trace source, fired when a
+   * dequeue leaves LowWatermark packets in the queue.
+   */
+  typedef void (* DrainTracedCallback) (void);
+
   /**
    * \brief Enumeration of the modes supported in the class.
    *
@@ -187,6 +193,10 @@ private:
   TracedCallback<Ptr<const Packet> > m_traceDequeue;
   /// Traced callback: fired when a packet is dropped
   TracedCallback<Ptr<const Packet> > m_traceDrop;
+  /// Traced callback: fired when the queue drains to m_lowWatermark packets
+  TracedCallback<> m_traceDrain;
+
+  uint32_t m_lowWatermark;          //!< Number of packets at which Drain fires
 
   uint32_t m_nBytes;                //!< Number of bytes in the queue
   uint32_t m_nTotalReceivedBytes;   //!< Total received bytes
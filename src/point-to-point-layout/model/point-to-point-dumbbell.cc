@@ -31,6 +31,7 @@
 #include "ns3/point-to-point-net-device.h"
 #include "ns3/vector.h"
 #include "ns3/ipv6-address-generator.h"
+#include "ns3/ipv4-static-routing-helper.h"
 
 namespace ns3 {
 
@@ -48,10 +49,32 @@ PointToPointDumbbellHelper::PointToPointDumbbellHelper (uint32_t nLeftLeaf,
   m_leftLeaf.Create (nLeftLeaf);
   m_rightLeaf.Create (nRightLeaf);
 
+  InstallLinks (leftHelper, rightHelper, bottleneckHelper);
+}
+
+PointToPointDumbbellHelper::PointToPointDumbbellHelper (NodeContainer routers,
+                                                        NodeContainer leftLeaf,
+                                                        PointToPointHelper leftHelper,
+                                                        NodeContainer rightLeaf,
+                                                        PointToPointHelper rightHelper,
+                                                        PointToPointHelper bottleneckHelper)
+  : m_leftLeaf (leftLeaf),
+    m_rightLeaf (rightLeaf),
+    m_routers (routers)
+{
+  NS_ASSERT (routers.GetN () == 2);
+  InstallLinks (leftHelper, rightHelper, bottleneckHelper);
+}
+
+void
+PointToPointDumbbellHelper::InstallLinks (PointToPointHelper leftHelper,
+                                          PointToPointHelper rightHelper,
+                                          PointToPointHelper bottleneckHelper)
+{
   // Add the link connecting routers
   m_routerDevices = bottleneckHelper.Install (m_routers);
   // Add the left side links
-  for (uint32_t i = 0; i < nLeftLeaf; ++i)
+  for (uint32_t i = 0; i < m_leftLeaf.GetN (); ++i)
     {
       NetDeviceContainer c = leftHelper.Install (m_routers.Get (0),
                                                  m_leftLeaf.Get (i));
@@ -59,7 +82,7 @@ PointToPointDumbbellHelper::PointToPointDumbbellHelper (uint32_t nLeftLeaf,
       m_leftLeafDevices.Add (c.Get (1));
     }
   // Add the right side links
-  for (uint32_t i = 0; i < nRightLeaf; ++i)
+  for (uint32_t i = 0; i < m_rightLeaf.GetN (); ++i)
     {
       NetDeviceContainer c = rightHelper.Install (m_routers.Get (1),
                                                   m_rightLeaf.Get (i));
@@ -159,6 +182,26 @@ void PointToPointDumbbellHelper::AssignIpv4Addresses (Ipv4AddressHelper leftIp,
     }
 }
 
+void PointToPointDumbbellHelper::InstallIpv4Routes ()
+{
+  Ipv4StaticRoutingHelper routingHelper;
+  for (uint32_t i = 0; i < LeftCount (); ++i)
+    {
+      std::pair<Ptr<Ipv4>, uint32_t> leaf = m_leftLeafInterfaces.Get (i);
+      routingHelper.GetStaticRouting (leaf.first)->SetDefaultRoute (m_leftRouterInterfaces.GetAddress (i), leaf.second);
+    }
+  for (uint32_t i = 0; i < RightCount (); ++i)
+    {
+      std::pair<Ptr<Ipv4>, uint32_t> leaf = m_rightLeafInterfaces.Get (i);
+      routingHelper.GetStaticRouting (leaf.first)->SetDefaultRoute (m_rightRouterInterfaces.GetAddress (i), leaf.second);
+    }
+  for (uint32_t i = 0; i < 2; ++i)
+    {
+      std::pair<Ptr<Ipv4>, uint32_t> router = m_routerInterfaces.Get (i);
+      routingHelper.GetStaticRouting (router.first)->SetDefaultRoute (m_routerInterfaces.GetAddress (1 - i), router.second);
+    }
+}
+
 void PointToPointDumbbellHelper::AssignIpv6Addresses (Ipv6Address addrBase, Ipv6Prefix prefix)
 {
   // Assign the router network
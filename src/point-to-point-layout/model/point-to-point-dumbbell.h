@@ -67,6 +67,30 @@ public:
                               PointToPointHelper rightHelper,
                               PointToPointHelper bottleneckHelper);
 
+  /**
+   * Create a PointToPointDumbbellHelper on nodes created by the caller,
+   * e.g. with the system ids of a distributed simulation
+   *
+   * \param routers the left and the right router, in this order
+   *
+   * \param leftLeaf left side leaf nodes
+   *
+   * \param leftHelper PointToPointHelper used to install the left links
+   *
+   * \param rightLeaf right side leaf nodes
+   *
+   * \param rightHelper PointToPointHelper used to install the right links
+   *
+   * \param bottleneckHelper PointToPointHelper used to install the link
+   *                         between the routers
+   */
+  PointToPointDumbbellHelper (NodeContainer routers,
+                              NodeContainer leftLeaf,
+                              PointToPointHelper leftHelper,
+                              NodeContainer rightLeaf,
+                              PointToPointHelper rightHelper,
+                              PointToPointHelper bottleneckHelper);
+
   ~PointToPointDumbbellHelper ();
 
 public:
@@ -142,6 +166,15 @@ public:
                                  Ipv4AddressHelper rightIp,
                                  Ipv4AddressHelper routerIp);
 
+  /**
+   * Installs static routes for the dumbbell: a default route from each
+   * leaf to its router, and from each router to the other one. Routes to
+   * the leaves are the routers' connected networks. Call after
+   * AssignIpv4Addresses, instead of populating global routing tables;
+   * setup time is linear in the number of leaves.
+   */
+  void      InstallIpv4Routes ();
+
   /**
    * \param network an IPv6 address representing the network portion
    *                of the IPv6 Address
@@ -161,6 +194,10 @@ public:
   void      BoundingBox (double ulx, double uly, double lrx, double lry);
 
 private:
+  void      InstallLinks (PointToPointHelper leftHelper,
+                          PointToPointHelper rightHelper,
+                          PointToPointHelper bottleneckHelper);
+
   NodeContainer          m_leftLeaf;
   NetDeviceContainer     m_leftLeafDevices;
   NodeContainer          m_rightLeaf;
@@ -27,6 +27,7 @@
 #include "ns3/point-to-point-net-device.h"
 #include "ns3/vector.h"
 #include "ns3/ipv6-address-generator.h"
+#include "ns3/ipv4-static-routing-helper.h"
 
 namespace ns3 {
 
@@ -110,6 +111,17 @@ PointToPointStarHelper::AssignIpv4Addresses (Ipv4AddressHelper address)
     }
 }
 
+void
+PointToPointStarHelper::InstallIpv4Routes ()
+{
+  Ipv4StaticRoutingHelper routingHelper;
+  for (uint32_t i = 0; i < m_spokes.GetN (); ++i)
+    {
+      std::pair<Ptr<Ipv4>, uint32_t> spoke = m_spokeInterfaces.Get (i);
+      routingHelper.GetStaticRouting (spoke.first)->SetDefaultRoute (m_hubInterfaces.GetAddress (i), spoke.second);
+    }
+}
+
 void 
 PointToPointStarHelper::AssignIpv6Addresses (Ipv6Address addrBase, Ipv6Prefix prefix)
 {
@@ -120,6 +120,13 @@ public:
    */
   void AssignIpv4Addresses (Ipv4AddressHelper address);
 
+  /**
+   * Installs a static default route from each spoke to the hub, which
+   * reaches every spoke over a connected network. Call after
+   * AssignIpv4Addresses, instead of populating global routing tables.
+   */
+  void InstallIpv4Routes ();
+
   /**
    * \param network an IPv6 address representing the network portion
    *                of the IPv6 Address
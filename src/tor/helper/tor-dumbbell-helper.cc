@@ -1,5 +1,33 @@
 #include "tor-dumbbell-helper.h"
 
+#ifdef NS3_MPI
+#include <mpi.h>
+#endif
+
+struct TimingRecord
+{
+  int32_t id;
+  double seconds;
+};
+
+// Timings of the clients on this rank, until CollectResults
+static vector<TimingRecord> g_ttfbRecords;
+static vector<TimingRecord> g_ttlbRecords;
+
+static void
+RecordTtfb (int id, double seconds, string)
+{
+  TimingRecord r = { id, seconds };
+  g_ttfbRecords.push_back (r);
+}
+
+static void
+RecordTtlb (int id, double seconds, string)
+{
+  TimingRecord r = { id, seconds };
+  g_ttlbRecords.push_back (r);
+}
+
 TorDumbbellHelper::TorDumbbellHelper ()
 {
   // Based on the iPlane data set: latencies 2015-08-04
@@ -56,10 +84,14 @@ TorDumbbellHelper::TorDumbbellHelper ()
   m_p2pRouterHelper.SetDeviceAttribute ("DataRate", StringValue ("10Gb/s"));
 
   m_dumbbellHelper = 0;
+  m_nRanks = 1;
+  m_ttfbCallback = 0;
+  m_ttlbCallback = 0;
   m_nLeftLeaf = 0;
   m_nRightLeaf = 0;
 
   m_disableProxies = false;
+  m_linkEmulation = false;
 
   m_bulkRequest = CreateObject<ConstantRandomVariable> ();
   m_bulkRequest->SetAttribute ("Constant", DoubleValue (5 * 1024 * 1024));
@@ -106,6 +138,7 @@ TorDumbbellHelper::AddCircuit (int id, string entryName, string middleName, stri
                                 CreateObject<PseudoClientSocket> (m_clientRequest, m_clientThink,
                                 Seconds (m_startTimeStream->GetValue ())) );
     }
+  desc.m_clientSocket->SetCircuit (id, typehint);
   m_circuits[id] = desc;
   circuitIds.push_back (id);
 }
@@ -143,6 +176,12 @@ TorDumbbellHelper::SetRelayAttribute (string relayName, string attrName, const A
   GetTorApp (relayName)->SetAttribute (attrName, value);
 }
 
+void
+TorDumbbellHelper::EnableLinkEmulation (bool enable)
+{
+  m_linkEmulation = enable;
+}
+
 void
 TorDumbbellHelper::EnableNscStack (bool enableNscStack, string nscTcpCong)
 {
@@ -168,6 +207,13 @@ TorDumbbellHelper::SetStartTimeStream (Ptr<RandomVariableStream> startTimeStream
   m_startTimeStream = startTimeStream;
 }
 
+void
+TorDumbbellHelper::SetRankCount (uint32_t nRanks)
+{
+  NS_ASSERT (nRanks > 0);
+  m_nRanks = nRanks;
+}
+
 void
 TorDumbbellHelper::DisableProxies (bool disableProxies)
 {
@@ -178,11 +224,12 @@ void
 TorDumbbellHelper::RegisterTtfbCallback (void (*ttfb)(int, double, string))
 {
   NS_ASSERT (m_circuits.size () > 0 );
+  m_ttfbCallback = ttfb;
   map<int,CircuitDescriptor>::iterator i;
   for (i = m_circuits.begin (); i != m_circuits.end (); ++i)
     {
       CircuitDescriptor desc = i->second;
-      desc.m_clientSocket->SetTtfbCallback (ttfb, desc.id, desc.m_typehint);
+      desc.m_clientSocket->SetTtfbCallback (m_nRanks > 1 ? RecordTtfb : ttfb, desc.id, desc.m_typehint);
     }
 }
 
@@ -190,82 +237,96 @@ void
 TorDumbbellHelper::RegisterTtlbCallback (void (*ttlb)(int, double, string))
 {
   NS_ASSERT (m_circuits.size () > 0);
+  m_ttlbCallback = ttlb;
   map<int,CircuitDescriptor>::iterator i;
   for (i = m_circuits.begin (); i != m_circuits.end (); ++i)
     {
       CircuitDescriptor desc = i->second;
-      desc.m_clientSocket->SetTtlbCallback (ttlb, desc.id, desc.m_typehint);
+      desc.m_clientSocket->SetTtlbCallback (m_nRanks > 1 ? RecordTtlb : ttlb, desc.id, desc.m_typehint);
     }
 }
 
 
 void
 TorDumbbellHelper::ParseFile (string filename, uint32_t m, double bulkFraction) {
-  ifstream f (filename.c_str ());
-  NS_ASSERT (f.is_open ());
-
-  set<uint32_t> chosenCircuits;
-  if (m > 0) {
-      string line;
-      uint32_t n;
-      for (n = 0; getline (f, line); ++n) {
-      }
-      NS_ASSERT (m <= n);
-      while (chosenCircuits.size () < m)
-        {
-          chosenCircuits.insert (m_rng->GetInteger (1,n));
-        }
-      f.close ();
-      f.open (filename.c_str ());
-  }
+  TorScenario scenario;
+  scenario.Read (filename, m, m_rng);
+  AddScenario (scenario, bulkFraction);
+}
 
-  uint32_t nBulkclients = ceil (bulkFraction * m);
+void
+TorDumbbellHelper::AddScenario (const TorScenario &scenario, double bulkFraction) {
+  uint32_t nBulkclients = ceil (bulkFraction * scenario.circuits.size ());
 
-  int id;
-  string path[3], continent[3], bw[3], dummy;
-  uint32_t lineno = 0;
-  while (f >> id >> path[0] >> continent[0] >> bw[0] >> path[1] >> continent[1] >> bw[1] >> path[2] >> continent[2] >> bw[2])
+  for (uint32_t c = 0; c < scenario.circuits.size (); ++c)
     {
-      ++lineno;
-      if (m > 0 && chosenCircuits.find (lineno) == chosenCircuits.end ())
+      const TorScenario::Circuit &circ = scenario.circuits[c];
+      const TorScenario::Relay *hop[3];
+      for (int i = 0; i < 3; ++i)
         {
-          continue;
+          hop[i] = &scenario.relays[circ.path[i]];
         }
 
       if (nBulkclients > 0)
         {
-          AddCircuit (id, path[0], path[1], path[2], "bulk");
+          AddCircuit (circ.id, hop[0]->name, hop[1]->name, hop[2]->name, "bulk");
           --nBulkclients;
         }
       else
         {
-          AddCircuit (id, path[0], path[1], path[2], "web");
+          AddCircuit (circ.id, hop[0]->name, hop[1]->name, hop[2]->name, "web");
         }
 
       if (!m_disableProxies)
         {
-          AddRelay (GetProxyName (id));
+          AddRelay (GetProxyName (circ.id));
         }
 
       for (int i = 0; i < 3; ++i)
         {
-          if (continent[i] != "EU" || continent[i] != "NA")
+          // the file's continents are not used; relays are placed at random
+          string continent = m_rng->GetValue () <= 0.68 ? "EU" : "NA";
+          if (m_relays.find (hop[i]->name) == m_relays.end ())
             {
-              continent[i] = m_rng->GetValue () <= 0.68 ? "EU" : "NA";
+              AddRelay (hop[i]->name, continent);
+              SetRelayAttribute (hop[i]->name, "BandwidthRate", DataRateValue (hop[i]->GetDataRate ()));
+              SetRelayAttribute (hop[i]->name, "BandwidthBurst", DataRateValue (hop[i]->GetDataRate ()));
             }
-          AddRelay (path[i],continent[i]);
-          SetRelayAttribute (path[i], "BandwidthRate", DataRateValue (DataRate (bw[i] + "B/s")));
-          SetRelayAttribute (path[i], "BandwidthBurst", DataRateValue (DataRate (bw[i] + "B/s")));
         }
     }
-  f.close ();
 }
 
 
 void
 TorDumbbellHelper::BuildTopology ()
 {
-  m_dumbbellHelper = new PointToPointDumbbellHelper (m_nLeftLeaf, m_p2pLeftHelper, m_nRightLeaf, m_p2pRightHelper, m_p2pRouterHelper);
+  if (m_nRanks > 1)
+    {
+      NS_ABORT_MSG_UNLESS (MpiInterface::IsEnabled () && MpiInterface::GetSize () == m_nRanks,
+                           "Running on " << m_nRanks << " ranks needs MPI with as many processes");
+
+      // Split at the router link, the longest one: NA goes to the first
+      // ranks, EU to the others. With more than two ranks, the leaves of a
+      // side are spread round robin over its ranks, which also splits
+      // leaf links (a few ms of lookahead each).
+      uint32_t nLeftRanks = GetLeftRankCount ();
+      NodeContainer routers, left, right;
+      routers.Create (1, 0);
+      routers.Create (1, nLeftRanks);
+      for (int i = 0; i < m_nLeftLeaf; ++i)
+        {
+          left.Create (1, i % nLeftRanks);
+        }
+      for (int i = 0; i < m_nRightLeaf; ++i)
+        {
+          right.Create (1, nLeftRanks + i % (m_nRanks - nLeftRanks));
+        }
+      m_dumbbellHelper = new PointToPointDumbbellHelper (routers, left, m_p2pLeftHelper, right, m_p2pRightHelper, m_p2pRouterHelper);
+    }
+  else
+    {
+      m_dumbbellHelper = new PointToPointDumbbellHelper (m_nLeftLeaf, m_p2pLeftHelper, m_nRightLeaf, m_p2pRightHelper, m_p2pRouterHelper);
+    }
 
   //install stack
   m_stackHelper.Install (m_dumbbellHelper->GetLeft ());
@@ -302,8 +363,88 @@ TorDumbbellHelper::BuildTopology ()
   m_rightIp.SetBase ("10.128.0.0", "255.255.255.0");
   m_dumbbellHelper->AssignIpv4Addresses (m_leftIp, m_rightIp, m_routerIp);
 
-  Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
+  m_dumbbellHelper->InstallIpv4Routes ();
   InstallCircuits ();
+  if (m_linkEmulation)
+    {
+      InstallLinkChannel ();
+    }
+}
+
+/* Attach all leaves to a TorLinkChannel with the rate and delay of their
+ * access link; the two sides are the channel's groups. The IP topology
+ * stays in place for addressing, but carries no traffic. */
+void
+TorDumbbellHelper::InstallLinkChannel ()
+{
+  NS_ABORT_MSG_IF (m_nRanks > 1, "Link emulation runs on a single rank");
+  m_linkChannel = CreateObject<TorLinkChannel> ();
+  m_linkChannel->SetGroupDelay (MilliSeconds (m_routerDelay));
+  for (int side = 0; side < 2; ++side)
+    {
+      int n = side == 0 ? m_nLeftLeaf : m_nRightLeaf;
+      for (int i = 0; i < n; ++i)
+        {
+          Ptr<Node> node = side == 0 ? m_dumbbellHelper->GetLeft (i) : m_dumbbellHelper->GetRight (i);
+          Ipv4Address ip = side == 0 ? m_dumbbellHelper->GetLeftIpv4Address (i) : m_dumbbellHelper->GetRightIpv4Address (i);
+          Ptr<PointToPointNetDevice> dev = node->GetDevice (0)->GetObject<PointToPointNetDevice> ();
+          DataRateValue rate;
+          TimeValue delay;
+          dev->GetAttribute ("DataRate", rate);
+          dev->GetChannel ()->GetAttribute ("Delay", delay);
+          m_linkChannel->Attach (node, ip, rate.Get (), delay.Get (), side);
+        }
+    }
+}
+
+uint32_t
+TorDumbbellHelper::GetLeftRankCount ()
+{
+  // ranks in proportion to the leaves, at least one per side
+  uint32_t n = round (m_nRanks * m_nLeftLeaf / (double) (m_nLeftLeaf + m_nRightLeaf));
+  return min (max (n, 1u), m_nRanks - 1);
+}
+
+/* Hand the timings of all ranks to the callbacks on rank 0. Call after
+ * Simulator::Run; a no-op unless running on several ranks. */
+void
+TorDumbbellHelper::CollectResults ()
+{
+  if (m_nRanks <= 1)
+    {
+      return;
+    }
+#ifdef NS3_MPI
+  vector<TimingRecord> *records[2] = { &g_ttfbRecords, &g_ttlbRecords };
+  void (*callbacks[2])(int, double, string) = { m_ttfbCallback, m_ttlbCallback };
+  bool root = MpiInterface::GetSystemId () == 0;
+
+  for (int k = 0; k < 2; ++k)
+    {
+      int bytes = records[k]->size () * sizeof (TimingRecord);
+      vector<int> counts (m_nRanks);
+      MPI_Gather (&bytes, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+      vector<int> displs (m_nRanks, 0);
+      for (uint32_t r = 1; r < m_nRanks; ++r)
+        {
+          displs[r] = displs[r - 1] + counts[r - 1];
+        }
+      vector<TimingRecord> all;
+      if (root)
+        {
+          all.resize ((displs[m_nRanks - 1] + counts[m_nRanks - 1]) / sizeof (TimingRecord));
+        }
+      MPI_Gatherv (records[k]->empty () ? 0 : &(*records[k])[0], bytes, MPI_BYTE,
+                   all.empty () ? 0 : &all[0], &counts[0], &displs[0], MPI_BYTE, 0, MPI_COMM_WORLD);
+      records[k]->clear ();
+
+      for (uint32_t i = 0; i < all.size () && callbacks[k]; ++i)
+        {
+          callbacks[k] (all[i].id, all[i].seconds, GetCircuitTypehint (all[i].id));
+        }
+    }
+#endif
 }
 
 
@@ -341,17 +482,31 @@ TorDumbbellHelper::InstallCircuits ()
       Ipv4Address middleAddress = GetIp (desc.middle ());
       Ipv4Address exitAddress   = GetIp (desc.exit ());
       Ipv4Address pseudoServerAddress = ipHelper.NewAddress ();
+      Ipv4Address pseudoClientAddress = ipHelper.NewAddress ();
 
-      exitApp->AddCircuit (desc.id, pseudoServerAddress, SERVEREDGE, middleAddress, RELAYEDGE);
-      middleApp->AddCircuit (desc.id, exitAddress, RELAYEDGE, entryAddress, RELAYEDGE);
+      // with several ranks, each one sets up the hops on its own nodes
+      if (IsLocal (desc.exit ()))
+        {
+          exitApp->AddCircuit (desc.id, pseudoServerAddress, SERVEREDGE, middleAddress, RELAYEDGE);
+        }
+      if (IsLocal (desc.middle ()))
+        {
+          middleApp->AddCircuit (desc.id, exitAddress, RELAYEDGE, entryAddress, RELAYEDGE);
+        }
       if (!m_disableProxies)
         {
-          entryApp->AddCircuit (desc.id, middleAddress, RELAYEDGE, clientAddress, RELAYEDGE);
-          clientApp->AddCircuit (desc.id, entryAddress, RELAYEDGE, ipHelper.NewAddress (), PROXYEDGE, desc.m_clientSocket);
+          if (IsLocal (desc.entry ()))
+            {
+              entryApp->AddCircuit (desc.id, middleAddress, RELAYEDGE, clientAddress, RELAYEDGE);
+            }
+          if (IsLocal (desc.proxy ()))
+            {
+              clientApp->AddCircuit (desc.id, entryAddress, RELAYEDGE, pseudoClientAddress, PROXYEDGE, desc.m_clientSocket);
+            }
         }
-      else
+      else if (IsLocal (desc.entry ()))
         {
-          entryApp->AddCircuit (desc.id, middleAddress, RELAYEDGE, ipHelper.NewAddress (), PROXYEDGE, desc.m_clientSocket);
+          entryApp->AddCircuit (desc.id, middleAddress, RELAYEDGE, pseudoClientAddress, PROXYEDGE, desc.m_clientSocket);
         }
     }
 }
@@ -415,13 +570,19 @@ TorDumbbellHelper::InstallTorApp (string name)
 {
   NS_ASSERT (m_relays.find (name) != m_relays.end ());
   RelayDescriptor desc = m_relays[name];
-  if (GetNode (name)->GetNApplications () == 0 )
+  if (IsLocal (name) && GetNode (name)->GetNApplications () == 0 )
     {
       GetNode (name)->AddApplication (desc.tapp);
     }
   return desc.tapp;
 }
 
+bool
+TorDumbbellHelper::IsLocal (string name)
+{
+  return GetNode (name)->GetSystemId () == MpiInterface::GetSystemId ();
+}
+
 void
 TorDumbbellHelper::SetProxyAccessRate (string name)
 {
@@ -489,7 +650,32 @@ TorDumbbellHelper::GetIp (string name)
 ApplicationContainer
 TorDumbbellHelper::GetTorAppsContainer ()
 {
-  return m_relayApps;
+  if (m_nRanks <= 1)
+    {
+      return m_relayApps;
+    }
+  // only the apps of this rank are installed
+  ApplicationContainer local;
+  for (ApplicationContainer::Iterator i = m_relayApps.Begin (); i != m_relayApps.End (); ++i)
+    {
+      if ((*i)->GetNode ())
+        {
+          local.Add (*i);
+        }
+    }
+  return local;
+}
+
+void
+TorDumbbellHelper::SetTorAppsAttribute (string name, const AttributeValue &value)
+{
+  ApplicationContainer apps = GetTorAppsContainer ();
+  for (ApplicationContainer::Iterator i = apps.Begin (); i != apps.End (); ++i)
+    {
+      Ptr<TorBaseApp> app = DynamicCast<TorBaseApp> (*i);
+      app->SetAttribute (name, value);
+      app->Reconfigure ();
+    }
 }
 
 Ptr<TorBaseApp>
@@ -566,6 +752,13 @@ TorDumbbellHelper::GetCircuitTypehint (int id)
   return desc.m_typehint;
 }
 
+Ptr<PseudoClientSocket>
+TorDumbbellHelper::GetClientSocket (int id)
+{
+  map<int,CircuitDescriptor>::iterator i = m_circuits.find (id);
+  return i == m_circuits.end () ? 0 : i->second.m_clientSocket;
+}
+
 string
 TorDumbbellHelper::GetProxyName (int id)
 {
@@ -8,7 +8,7 @@
 #include "ns3/internet-module.h"
 #include "ns3/point-to-point-module.h"
 #include "ns3/point-to-point-dumbbell.h"
-#include "ns3/global-route-manager.h"
+#include "ns3/mpi-interface.h"
 #include "ns3/tor-module.h"
 
 namespace ns3 {
@@ -21,17 +21,25 @@ public:
 
   void DisableProxies (bool);
   void EnableNscStack (bool,string = "cubic");
+  /* Connect the relays through a TorLinkChannel instead of IP and TCP/UDP. */
+  void EnableLinkEmulation (bool);
   void SetTorAppType (string);
   void ParseFile (string,uint32_t = 0,double = 0.05);
+  void AddScenario (const TorScenario&,double = 0.05);
   void SetStartTimeStream (Ptr<RandomVariableStream>);
+  void SetRankCount (uint32_t);
   void RegisterTtfbCallback (void (*)(int, double, string));
   void RegisterTtlbCallback (void (*)(int, double, string));
 
   void BuildTopology ();
+  void CollectResults ();
   void PrintCircuits ();
   void PrintBaseRtt ();
 
   ApplicationContainer GetTorAppsContainer ();
+  /* Set an attribute of all Tor apps while the simulation runs (e.g. in a
+   * TorWarmStart child) and let the apps pick it up. */
+  void SetTorAppsAttribute (string, const AttributeValue&);
 
   Ptr<Node> GetNode (string,uint32_t);
   Ptr<Node> GetNode (string);
@@ -45,6 +53,7 @@ public:
 
   string GetProxyName (int);
   string GetCircuitTypehint (int);
+  Ptr<PseudoClientSocket> GetClientSocket (int);
 
   vector<int> circuitIds;
 
@@ -119,7 +128,10 @@ public:
   int64_t GetOwd (CircuitDescriptor);
   Ptr<PointToPointChannel> GetP2pChannel (RelayDescriptor);
   void InstallCircuits ();
+  void InstallLinkChannel ();
   Ptr<TorBaseApp> InstallTorApp (string);
+  bool IsLocal (string);
+  uint32_t GetLeftRankCount ();
   void SetProxyAccessRate (string);
   string GetContinent (string);
 
@@ -131,6 +143,8 @@ public:
   ApplicationContainer m_relayApps;
 
   std::string m_nscTcpCong;
+  bool m_linkEmulation;
+  Ptr<TorLinkChannel> m_linkChannel;
   InternetStackHelper m_stackHelper;
 
   std::string m_torAppType;
@@ -145,6 +159,12 @@ public:
 
   PointToPointDumbbellHelper *m_dumbbellHelper;
 
+  // With more than one rank (MPI), NA and EU are simulated by separate
+  // ranks and the timings are reported on rank 0 by CollectResults.
+  uint32_t m_nRanks;
+  void (*m_ttfbCallback)(int, double, string);
+  void (*m_ttlbCallback)(int, double, string);
+
   int m_nLeftLeaf;
   int m_nRightLeaf;
 
@@ -0,0 +1,235 @@
+#include "tor-latency-summary.h"
+#include "tor-dumbbell-helper.h"
+
+#include <fstream>
+#include <cmath>
+
+NS_LOG_COMPONENT_DEFINE ("TorLatencySummary");
+
+namespace ns3 {
+
+const uint32_t TorLatencyHistogram::SUB_BITS;
+
+TorLatencyHistogram::TorLatencyHistogram ()
+{
+  m_count = 0;
+  m_min = 0;
+  m_max = 0;
+  m_sum = 0;
+}
+
+// Below 2^(SUB_BITS+1) the index is the value itself. Above, each doubling
+// of the value gets 2^SUB_BITS buckets.
+uint32_t
+TorLatencyHistogram::GetIndex (uint64_t v)
+{
+  uint32_t exp = 0;
+  while ((v >> exp) >= (2u << SUB_BITS))
+    {
+      ++exp;
+    }
+  return (exp << SUB_BITS) + (v >> exp);
+}
+
+uint64_t
+TorLatencyHistogram::GetLowest (uint32_t index)
+{
+  uint32_t exp = index >> SUB_BITS;
+  if (exp <= 1)
+    {
+      return index;
+    }
+  uint64_t sub = (index & ((1u << SUB_BITS) - 1)) + (1u << SUB_BITS);
+  return sub << (exp - 1);
+}
+
+void
+TorLatencyHistogram::Add (Time t)
+{
+  uint64_t v = max (t.GetMicroSeconds (), (int64_t) 0);
+  uint32_t i = GetIndex (v);
+  if (i >= m_counts.size ())
+    {
+      m_counts.resize (i + 1, 0);
+    }
+  ++m_counts[i];
+  m_min = m_count ? min (m_min, v) : v;
+  m_max = m_count ? max (m_max, v) : v;
+  m_sum += v;
+  ++m_count;
+}
+
+uint64_t
+TorLatencyHistogram::GetCount () const
+{
+  return m_count;
+}
+
+Time
+TorLatencyHistogram::GetMin () const
+{
+  return MicroSeconds (m_min);
+}
+
+Time
+TorLatencyHistogram::GetMax () const
+{
+  return MicroSeconds (m_max);
+}
+
+Time
+TorLatencyHistogram::GetMean () const
+{
+  return MicroSeconds (m_count ? m_sum / m_count : 0);
+}
+
+/* Middle of the bucket holding the q-quantile, within [min,max]. */
+Time
+TorLatencyHistogram::GetQuantile (double q) const
+{
+  if (m_count == 0)
+    {
+      return Time (0);
+    }
+  uint64_t rank = max ((uint64_t) ceil (q * m_count), (uint64_t) 1);
+  uint64_t seen = 0;
+  uint32_t i = 0;
+  for (; i < m_counts.size (); ++i)
+    {
+      seen += m_counts[i];
+      if (seen >= rank)
+        {
+          break;
+        }
+    }
+  uint64_t lo = GetLowest (i);
+  uint64_t v = lo + (GetLowest (i + 1) - lo) / 2;
+  return MicroSeconds (min (max (v, m_min), m_max));
+}
+
+
+TorLatencySummary::TorLatencySummary ()
+{
+}
+
+void
+TorLatencySummary::Reset ()
+{
+  // in place, the groups point into the maps
+  for (map<string,TorLatencyHistogram>::iterator i = m_ttfb.begin (); i != m_ttfb.end (); ++i)
+    {
+      i->second = TorLatencyHistogram ();
+    }
+  for (map<string,TorLatencyHistogram>::iterator i = m_ttlb.begin (); i != m_ttlb.end (); ++i)
+    {
+      i->second = TorLatencyHistogram ();
+    }
+}
+
+void
+TorLatencySummary::Add (Ptr<PseudoClientSocket> socket, vector<string> relays)
+{
+  NS_ASSERT (socket);
+  int id = socket->GetCircuitId ();
+  NS_ASSERT_MSG (m_circuits.find (id) == m_circuits.end (), "Circuit " << id << " added twice");
+
+  vector<string> groups;
+  groups.push_back ("all");
+  groups.push_back (socket->GetTypehint ());
+  for (uint32_t i = 0; i < relays.size (); ++i)
+    {
+      groups.push_back ("relay:" + relays[i]);
+    }
+
+  Groups &g = m_circuits[id];
+  for (uint32_t i = 0; i < groups.size (); ++i)
+    {
+      g.ttfb.push_back (&m_ttfb[groups[i]]);
+      g.ttlb.push_back (&m_ttlb[groups[i]]);
+    }
+
+  socket->TraceConnectWithoutContext ("Ttfb", MakeCallback (&TorLatencySummary::RecordTtfb, this));
+  socket->TraceConnectWithoutContext ("Ttlb", MakeCallback (&TorLatencySummary::RecordTtlb, this));
+  m_sockets.push_back (socket);
+}
+
+void
+TorLatencySummary::Add (TorDumbbellHelper &th)
+{
+  vector<int>::iterator id;
+  for (id = th.circuitIds.begin (); id != th.circuitIds.end (); ++id)
+    {
+      vector<string> relays;
+      relays.push_back (th.GetEntryApp (*id)->GetNodeName ());
+      relays.push_back (th.GetMiddleApp (*id)->GetNodeName ());
+      relays.push_back (th.GetExitApp (*id)->GetNodeName ());
+      Add (th.GetClientSocket (*id), relays);
+    }
+}
+
+void
+TorLatencySummary::RecordTtfb (int id, string, Time t)
+{
+  Groups &g = m_circuits[id];
+  for (uint32_t i = 0; i < g.ttfb.size (); ++i)
+    {
+      g.ttfb[i]->Add (t);
+    }
+}
+
+void
+TorLatencySummary::RecordTtlb (int id, string, Time t)
+{
+  Groups &g = m_circuits[id];
+  for (uint32_t i = 0; i < g.ttlb.size (); ++i)
+    {
+      g.ttlb[i]->Add (t);
+    }
+}
+
+const TorLatencyHistogram&
+TorLatencySummary::GetTtfb (string group)
+{
+  return m_ttfb[group];
+}
+
+const TorLatencyHistogram&
+TorLatencySummary::GetTtlb (string group)
+{
+  return m_ttlb[group];
+}
+
+static void
+WriteHistograms (ostream &os, string metric, const map<string,TorLatencyHistogram> &histograms)
+{
+  map<string,TorLatencyHistogram>::const_iterator i;
+  for (i = histograms.begin (); i != histograms.end (); ++i)
+    {
+      const TorLatencyHistogram &h = i->second;
+      os << metric << " " << i->first << " " << h.GetCount ()
+         << " " << h.GetMean ().GetSeconds ()
+         << " " << h.GetMin ().GetSeconds ()
+         << " " << h.GetQuantile (0.5).GetSeconds ()
+         << " " << h.GetQuantile (0.9).GetSeconds ()
+         << " " << h.GetQuantile (0.99).GetSeconds ()
+         << " " << h.GetMax ().GetSeconds () << endl;
+    }
+}
+
+void
+TorLatencySummary::Write (ostream &os) const
+{
+  os << "# metric group count mean min p50 p90 p99 max (seconds)" << endl;
+  WriteHistograms (os, "ttfb", m_ttfb);
+  WriteHistograms (os, "ttlb", m_ttlb);
+}
+
+void
+TorLatencySummary::Write (string filename) const
+{
+  ofstream f (filename.c_str ());
+  NS_ABORT_MSG_UNLESS (f.is_open (), "Cannot write latency summary to " << filename);
+  Write (f);
+}
+
+} //end namespace ns3
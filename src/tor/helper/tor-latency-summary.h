@@ -0,0 +1,87 @@
+#ifndef TORLATENCYSUMMARY_H
+#define TORLATENCYSUMMARY_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ns3/core-module.h"
+#include "ns3/pseudo-socket.h"
+
+using namespace std;
+
+namespace ns3 {
+
+class TorDumbbellHelper;
+
+/**
+ * Log-linear histogram of durations, in the style of an HDR histogram:
+ * exact below 2^SUB_BITS microseconds, and a relative error of at most
+ * 2^-SUB_BITS above. Memory grows with the log of the largest value.
+ */
+class TorLatencyHistogram
+{
+public:
+  TorLatencyHistogram ();
+
+  void Add (Time);
+  uint64_t GetCount () const;
+  Time GetMin () const;
+  Time GetMax () const;
+  Time GetMean () const;
+  Time GetQuantile (double) const;
+
+private:
+  static const uint32_t SUB_BITS = 7;
+
+  static uint32_t GetIndex (uint64_t);
+  static uint64_t GetLowest (uint32_t);
+
+  vector<uint64_t> m_counts;
+  uint64_t m_count;
+  uint64_t m_min;  // us
+  uint64_t m_max;
+  double m_sum;
+};
+
+/**
+ * TTFB/TTLB histograms of client sockets, split by circuit typehint and by
+ * relay (each relay of the circuit gets the sample). Fed through the
+ * sockets' trace sources; Write prints one line per histogram.
+ */
+class TorLatencySummary
+{
+public:
+  TorLatencySummary ();
+
+  void Add (Ptr<PseudoClientSocket>, vector<string> relays);
+  /* All circuits of the helper, grouped by entry, middle and exit. */
+  void Add (TorDumbbellHelper&);
+  /* Drop the samples recorded so far, e.g. those of a warm-up. */
+  void Reset ();
+
+  void Write (ostream&) const;
+  void Write (string filename) const;
+
+  const TorLatencyHistogram& GetTtfb (string group);
+  const TorLatencyHistogram& GetTtlb (string group);
+
+private:
+  struct Groups
+  {
+    vector<TorLatencyHistogram*> ttfb; // into m_ttfb
+    vector<TorLatencyHistogram*> ttlb;
+  };
+
+  void RecordTtfb (int, string, Time);
+  void RecordTtlb (int, string, Time);
+
+  map<int,Groups> m_circuits;
+  map<string,TorLatencyHistogram> m_ttfb;
+  map<string,TorLatencyHistogram> m_ttlb;
+  vector<Ptr<PseudoClientSocket> > m_sockets;
+};
+
+} //end namespace ns3
+
+#endif
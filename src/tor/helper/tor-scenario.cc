@@ -0,0 +1,285 @@
+#include "tor-scenario.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+NS_LOG_COMPONENT_DEFINE ("TorScenario");
+
+namespace ns3 {
+
+static const char CACHE_MAGIC[8] = { 'T', 'O', 'R', 'S', 'C', 'N', '1', '\0' };
+
+TorScenario::TorScenario ()
+{
+}
+
+void
+TorScenario::Read (string filename, uint32_t m, Ptr<UniformRandomVariable> rng)
+{
+  ifstream f (filename.c_str (), ios::in | ios::binary);
+  NS_ABORT_MSG_UNLESS (f.is_open (), "Cannot open scenario " << filename);
+  NS_ASSERT (m == 0 || rng);
+
+  relays.clear ();
+  circuits.clear ();
+  m_relayIndex.clear ();
+
+  char magic[sizeof (CACHE_MAGIC)];
+  f.read (magic, sizeof (magic));
+  bool cached = f.gcount () == sizeof (magic) && memcmp (magic, CACHE_MAGIC, sizeof (magic)) == 0;
+  f.clear ();
+
+  if (cached)
+    {
+      ReadCache (f, m, rng);
+    }
+  else
+    {
+      f.seekg (0);
+      ReadText (f, m, rng);
+    }
+}
+
+// Reservoir sampling: item k (counted from 0) is kept with probability m/(k+1),
+// replacing a random earlier pick. Returns whether to keep it, and in which slot.
+bool
+TorScenario::Sample (uint32_t k, uint32_t m, Ptr<UniformRandomVariable> rng, uint32_t &slot)
+{
+  if (m == 0 || k < m)
+    {
+      slot = k;
+      return true;
+    }
+  slot = rng->GetInteger (0, k);
+  return slot < m;
+}
+
+bool
+TorScenario::ParseLine (const string &line, Record &r)
+{
+  const char *p = line.c_str ();
+  char *end;
+  r.id = strtol (p, &end, 10);
+  if (end == p)
+    {
+      return false;
+    }
+  p = end;
+
+  for (int i = 0; i < 3; ++i)
+    {
+      string *field[2] = { &r.hop[i].name, &r.hop[i].continent };
+      for (int j = 0; j < 2; ++j)
+        {
+          while (isspace (*p))
+            {
+              ++p;
+            }
+          const char *start = p;
+          while (*p && !isspace (*p))
+            {
+              ++p;
+            }
+          if (p == start)
+            {
+              return false;
+            }
+          field[j]->assign (start, p - start);
+        }
+      r.hop[i].bandwidth = strtoull (p, &end, 10);
+      if (end == p)
+        {
+          return false;
+        }
+      p = end;
+    }
+  return true;
+}
+
+void
+TorScenario::ReadText (ifstream &f, uint32_t m, Ptr<UniformRandomVariable> rng)
+{
+  vector<Record> picked;
+  string line;
+  Record r;
+  uint32_t n = 0;
+  while (getline (f, line))
+    {
+      if (!ParseLine (line, r))
+        {
+          continue;
+        }
+      uint32_t slot;
+      if (Sample (n, m, rng, slot))
+        {
+          r.line = n;
+          if (slot < picked.size ())
+            {
+              picked[slot] = r;
+            }
+          else
+            {
+              picked.push_back (r);
+            }
+        }
+      ++n;
+    }
+  NS_ABORT_MSG_IF (m > n, "Scenario has " << n << " circuits, " << m << " requested");
+
+  sort (picked.begin (), picked.end (), Record::InFileOrder);
+
+  for (uint32_t i = 0; i < picked.size (); ++i)
+    {
+      Circuit c;
+      c.id = picked[i].id;
+      for (int j = 0; j < 3; ++j)
+        {
+          c.path[j] = AddRelay (picked[i].hop[j]);
+        }
+      circuits.push_back (c);
+    }
+}
+
+uint32_t
+TorScenario::AddRelay (const Relay &relay)
+{
+  map<string,uint32_t>::iterator it = m_relayIndex.find (relay.name);
+  if (it != m_relayIndex.end ())
+    {
+      return it->second;
+    }
+  uint32_t index = relays.size ();
+  relays.push_back (relay);
+  m_relayIndex[relay.name] = index;
+  return index;
+}
+
+
+/* Cache layout, in host byte order:
+ *   magic[8] nRelays:u32 { nameLen:u16 name continentLen:u16 continent bandwidth:u64 }*
+ *   nCircuits:u32 { id:i32 path:u32[3] }* */
+
+template <class T>
+static void
+WriteRaw (ofstream &f, T value)
+{
+  f.write ((const char*) &value, sizeof (T));
+}
+
+template <class T>
+static T
+ReadRaw (ifstream &f)
+{
+  T value = T ();
+  f.read ((char*) &value, sizeof (T));
+  return value;
+}
+
+static void
+WriteString (ofstream &f, const string &s)
+{
+  WriteRaw<uint16_t> (f, s.size ());
+  f.write (s.data (), s.size ());
+}
+
+static string
+ReadString (ifstream &f)
+{
+  string s (ReadRaw<uint16_t> (f), '\0');
+  if (!s.empty ())
+    {
+      f.read (&s[0], s.size ());
+    }
+  return s;
+}
+
+void
+TorScenario::Write (string filename)
+{
+  ofstream f (filename.c_str (), ios::out | ios::binary | ios::trunc);
+  NS_ABORT_MSG_UNLESS (f.is_open (), "Cannot write scenario cache " << filename);
+
+  f.write (CACHE_MAGIC, sizeof (CACHE_MAGIC));
+  WriteRaw<uint32_t> (f, relays.size ());
+  for (uint32_t i = 0; i < relays.size (); ++i)
+    {
+      WriteString (f, relays[i].name);
+      WriteString (f, relays[i].continent);
+      WriteRaw<uint64_t> (f, relays[i].bandwidth);
+    }
+  WriteRaw<uint32_t> (f, circuits.size ());
+  for (uint32_t i = 0; i < circuits.size (); ++i)
+    {
+      WriteRaw<int32_t> (f, circuits[i].id);
+      for (int j = 0; j < 3; ++j)
+        {
+          WriteRaw<uint32_t> (f, circuits[i].path[j]);
+        }
+    }
+}
+
+void
+TorScenario::ReadCache (ifstream &f, uint32_t m, Ptr<UniformRandomVariable> rng)
+{
+  vector<Relay> all_relays (ReadRaw<uint32_t> (f));
+  for (uint32_t i = 0; i < all_relays.size (); ++i)
+    {
+      all_relays[i].name = ReadString (f);
+      all_relays[i].continent = ReadString (f);
+      all_relays[i].bandwidth = ReadRaw<uint64_t> (f);
+    }
+  vector<Circuit> all_circuits (ReadRaw<uint32_t> (f));
+  for (uint32_t i = 0; i < all_circuits.size (); ++i)
+    {
+      all_circuits[i].id = ReadRaw<int32_t> (f);
+      for (int j = 0; j < 3; ++j)
+        {
+          all_circuits[i].path[j] = ReadRaw<uint32_t> (f);
+          NS_ABORT_MSG_UNLESS (!f || all_circuits[i].path[j] < all_relays.size (),
+                               "Circuit " << all_circuits[i].id << " names relay " << all_circuits[i].path[j]
+                               << " of " << all_relays.size () << " in scenario cache");
+        }
+    }
+  NS_ABORT_MSG_UNLESS (f, "Truncated scenario cache");
+  NS_ABORT_MSG_IF (m > all_circuits.size (),
+                   "Scenario cache has " << all_circuits.size () << " circuits, " << m << " requested");
+
+  if (m == 0)
+    {
+      relays.swap (all_relays);
+      circuits.swap (all_circuits);
+      return;
+    }
+
+  // same draws as for the text file, so both pick the same circuits
+  vector<uint32_t> picked;
+  for (uint32_t n = 0; n < all_circuits.size (); ++n)
+    {
+      uint32_t slot;
+      if (Sample (n, m, rng, slot))
+        {
+          if (slot < picked.size ())
+            {
+              picked[slot] = n;
+            }
+          else
+            {
+              picked.push_back (n);
+            }
+        }
+    }
+  sort (picked.begin (), picked.end ());
+
+  for (uint32_t i = 0; i < picked.size (); ++i)
+    {
+      Circuit c = all_circuits[picked[i]];
+      for (int j = 0; j < 3; ++j)
+        {
+          c.path[j] = AddRelay (all_relays[c.path[j]]);
+        }
+      circuits.push_back (c);
+    }
+}
+
+} //end namespace ns3
@@ -0,0 +1,78 @@
+#ifndef TORSCENARIO_H
+#define TORSCENARIO_H
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ns3/core-module.h"
+#include "ns3/data-rate.h"
+
+using namespace std;
+
+namespace ns3 {
+
+/**
+ * Circuits and relays of a scenario file. A text file has one circuit per
+ * line: the circuit id, then fingerprint, continent and bandwidth (bytes/s)
+ * of entry, middle and exit. Relays are deduplicated and their bandwidths
+ * parsed once. The result can be written to a binary cache, which Read
+ * recognizes on its own and loads without any parsing.
+ */
+class TorScenario
+{
+public:
+  struct Relay
+  {
+    string name;
+    string continent;
+    uint64_t bandwidth; // bytes/s
+
+    DataRate GetDataRate () const
+    {
+      return DataRate (bandwidth * 8);
+    }
+  };
+
+  struct Circuit
+  {
+    int id;
+    uint32_t path[3]; // indices into relays
+  };
+
+  TorScenario ();
+
+  /* Load m circuits (all if m is 0) chosen uniformly at random in one
+   * pass (reservoir sampling), kept in file order. */
+  void Read (string filename, uint32_t m = 0, Ptr<UniformRandomVariable> rng = 0);
+  void Write (string filename);
+
+  vector<Relay> relays;
+  vector<Circuit> circuits;
+
+private:
+  struct Record
+  {
+    uint32_t line;
+    int id;
+    Relay hop[3];
+
+    static bool InFileOrder (const Record &a, const Record &b)
+    {
+      return a.line < b.line;
+    }
+  };
+
+  static bool ParseLine (const string&, Record&);
+  static bool Sample (uint32_t, uint32_t, Ptr<UniformRandomVariable>, uint32_t&);
+  void ReadText (ifstream&, uint32_t, Ptr<UniformRandomVariable>);
+  void ReadCache (ifstream&, uint32_t, Ptr<UniformRandomVariable>);
+  uint32_t AddRelay (const Relay&);
+
+  map<string,uint32_t> m_relayIndex;
+};
+
+} //end namespace ns3
+
+#endif
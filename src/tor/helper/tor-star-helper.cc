@@ -11,6 +11,7 @@ TorStarHelper::TorStarHelper ()
   m_nSpokes = 1;   // hack: spare one for concurrent traffic simulation
   m_disableProxies = false;
   m_enablePcap = false;
+  m_linkEmulation = false;
   m_factory.SetTypeId ("ns3::TorApp");
 }
 
@@ -95,6 +96,12 @@ TorStarHelper::EnableNscStack (bool enableNscStack, string nscTcpCong)
     }
 }
 
+void
+TorStarHelper::EnableLinkEmulation (bool enable)
+{
+  m_linkEmulation = enable;
+}
+
 void
 TorStarHelper::EnablePcap (bool enablePcap)
 {
@@ -116,46 +123,34 @@ TorStarHelper::DisableProxies (bool disableProxies)
 void
 TorStarHelper::ParseFile (string filename, uint32_t m)
 {
-  ifstream f;
-  f.open (filename.c_str ());
-  NS_ASSERT (f.is_open ());
-
-  set<uint32_t> chosenCircuits;
-  if (m > 0)
-    {
-      string line;
-      uint32_t n;
-      for (n = 0; getline (f, line); ++n)
-        {
-        }
-      NS_ASSERT (m <= n);
-      while (chosenCircuits.size () < m)
-        {
-          chosenCircuits.insert (m_rng->GetInteger (1,n));
-        }
-      f.close ();
-      f.open (filename.c_str ());
-    }
+  TorScenario scenario;
+  scenario.Read (filename, m, m_rng);
+  AddScenario (scenario);
+}
 
-  int id;
-  string path[3], bw[3], dummy;
-  uint32_t lineno = 0;
-  while (f >> id >> path[0] >> dummy >> bw[0] >> path[1] >> dummy >> bw[1] >> path[2] >> dummy >> bw[2])
+void
+TorStarHelper::AddScenario (const TorScenario &scenario)
+{
+  set<string> configured;
+  for (uint32_t c = 0; c < scenario.circuits.size (); ++c)
     {
-      ++lineno;
-      if (m > 0 && chosenCircuits.find (lineno) == chosenCircuits.end ())
+      const TorScenario::Circuit &circ = scenario.circuits[c];
+      const TorScenario::Relay *hop[3];
+      for (int i = 0; i < 3; ++i)
         {
-          continue;
+          hop[i] = &scenario.relays[circ.path[i]];
         }
 
-      AddCircuit (id, path[0], path[1], path[2]);
+      AddCircuit (circ.id, hop[0]->name, hop[1]->name, hop[2]->name);
       for (int i = 0; i < 3; ++i)
         {
-          SetRelayAttribute (path[i], "BandwidthRate", DataRateValue (DataRate (bw[i] + "B/s")));
-          SetRelayAttribute (path[i], "BandwidthBurst", DataRateValue (DataRate (bw[i] + "B/s")));
+          if (configured.insert (hop[i]->name).second)
+            {
+              SetRelayAttribute (hop[i]->name, "BandwidthRate", DataRateValue (hop[i]->GetDataRate ()));
+              SetRelayAttribute (hop[i]->name, "BandwidthBurst", DataRateValue (hop[i]->GetDataRate ()));
+            }
         }
     }
-  f.close ();
 }
 
 
@@ -202,8 +197,30 @@ TorStarHelper::BuildTopology ()
   //     hub->GetDevice(i)->SetAttribute ("ReceiveErrorModel", PointerValue (em));
   // }
 
-  Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
+  m_starHelper->InstallIpv4Routes ();
   InstallCircuits ();
+  if (m_linkEmulation)
+    {
+      InstallLinkChannel ();
+    }
+}
+
+/* Attach all spokes to a TorLinkChannel with the rate and delay of their
+ * link to the hub, as one group. */
+void
+TorStarHelper::InstallLinkChannel ()
+{
+  m_linkChannel = CreateObject<TorLinkChannel> ();
+  for (int i = 0; i < m_nSpokes; ++i)
+    {
+      Ptr<Node> node = m_starHelper->GetSpokeNode (i);
+      Ptr<PointToPointNetDevice> dev = node->GetDevice (0)->GetObject<PointToPointNetDevice> ();
+      DataRateValue rate;
+      TimeValue delay;
+      dev->GetAttribute ("DataRate", rate);
+      dev->GetChannel ()->GetAttribute ("Delay", delay);
+      m_linkChannel->Attach (node, m_starHelper->GetSpokeIpv4Address (i), rate.Get (), delay.Get ());
+    }
 }
 
 
@@ -8,7 +8,6 @@
 #include "ns3/internet-module.h"
 #include "ns3/point-to-point-module.h"
 #include "ns3/point-to-point-star.h"
-#include "ns3/global-route-manager.h"
 #include "ns3/tor-module.h"
 
 namespace ns3 {
@@ -20,6 +19,7 @@ public:
   ~TorStarHelper ();
 
   void ParseFile (string, uint32_t m = 0);
+  void AddScenario (const TorScenario&);
   void AddCircuit (int, string, string, string, Ptr<PseudoClientSocket> clientSocket = 0);
   void SetRelayAttribute (string, string, const AttributeValue &value);
   void SetStartTimeStream (Ptr<RandomVariableStream>);
@@ -27,6 +27,8 @@ public:
   void DisableProxies (bool);
   void EnablePcap (bool);
   void EnableNscStack (bool,string = "cubic");
+  /* Connect the relays through a TorLinkChannel instead of IP and TCP/UDP. */
+  void EnableLinkEmulation (bool);
   void SetTorAppType (string);
   void BuildTopology ();
   void PrintCircuits ();
@@ -117,6 +119,7 @@ public:
   Ptr<TorBaseApp> CreateTorApp ();
   void AddRelay (string);
   void InstallCircuits ();
+  void InstallLinkChannel ();
   Ptr<TorBaseApp> InstallTorApp (string);
 
   map<int,CircuitDescriptor> m_circuits;
@@ -125,6 +128,8 @@ public:
   int m_nSpokes;
   bool m_disableProxies;
   bool m_enablePcap;
+  bool m_linkEmulation;
+  Ptr<TorLinkChannel> m_linkChannel;
   std::string m_nscTcpCong;
   std::string m_torAppType;
   Ptr<RandomVariableStream> m_startTimeStream;
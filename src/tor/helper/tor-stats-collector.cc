@@ -0,0 +1,120 @@
+#include "tor-stats-collector.h"
+
+NS_LOG_COMPONENT_DEFINE ("TorStatsCollector");
+
+namespace ns3 {
+
+static const char STATS_MAGIC[8] = { 'T', 'O', 'R', 'S', 'T', 'A', 'T', '1' };
+
+TorStatsCollector::TorStatsCollector ()
+{
+  m_nRecords = 0;
+}
+
+TorStatsCollector::~TorStatsCollector ()
+{
+  Stop ();
+}
+
+void
+TorStatsCollector::Add (Ptr<BaseCircuit> circ, string name)
+{
+  NS_ASSERT (circ);
+  NS_ASSERT_MSG (!m_file.is_open (), "Circuits must be added before Start");
+  m_circuits.push_back (circ);
+  m_names.push_back (name);
+}
+
+void
+TorStatsCollector::Add (ApplicationContainer apps)
+{
+  for (ApplicationContainer::Iterator i = apps.Begin (); i != apps.End (); ++i)
+    {
+      Ptr<TorBaseApp> app = DynamicCast<TorBaseApp> (*i);
+      NS_ASSERT (app);
+      CircuitTable<BaseCircuit>::Iterator j;
+      for (j = app->baseCircuits.begin (); j != app->baseCircuits.end (); ++j)
+        {
+          Add (*j, app->GetNodeName ());
+        }
+    }
+}
+
+void
+TorStatsCollector::Start (string filename, Time interval, Time stop)
+{
+  NS_ASSERT (interval > Time (0));
+  Stop ();
+  m_file.open (filename.c_str (), ios::out | ios::binary | ios::trunc);
+  NS_ABORT_MSG_UNLESS (m_file.is_open (), "Cannot write stats to " << filename);
+
+  m_file.write (STATS_MAGIC, sizeof (STATS_MAGIC));
+  uint32_t n = m_circuits.size ();
+  m_file.write ((const char*) &n, sizeof (n));
+  for (uint32_t i = 0; i < n; ++i)
+    {
+      uint32_t id = m_circuits[i]->GetId ();
+      uint16_t len = m_names[i].size ();
+      m_file.write ((const char*) &id, sizeof (id));
+      m_file.write ((const char*) &len, sizeof (len));
+      m_file.write (m_names[i].data (), len);
+    }
+
+  m_record.assign (4 * n, 0);
+  m_interval = interval;
+  m_stop = stop;
+  m_nRecords = 0;
+  m_event = Simulator::ScheduleNow (&TorStatsCollector::Sample, this);
+}
+
+void
+TorStatsCollector::Stop ()
+{
+  m_event.Cancel ();
+  if (m_file.is_open ())
+    {
+      m_file.close ();
+    }
+}
+
+void
+TorStatsCollector::Sample ()
+{
+  uint32_t *out = m_record.empty () ? 0 : &m_record[0];
+  for (uint32_t i = 0; i < m_circuits.size (); ++i)
+    {
+      BaseCircuit *circ = PeekPointer (m_circuits[i]);
+      out[0] = circ->stats_p_bytes_read;
+      out[1] = circ->stats_p_bytes_written;
+      out[2] = circ->stats_n_bytes_read;
+      out[3] = circ->stats_n_bytes_written;
+      out += 4;
+    }
+
+  int64_t now = Simulator::Now ().GetNanoSeconds ();
+  m_file.write ((const char*) &now, sizeof (now));
+  if (!m_record.empty ())
+    {
+      m_file.write ((const char*) &m_record[0], m_record.size () * sizeof (uint32_t));
+    }
+  ++m_nRecords;
+
+  if (Simulator::Now () + m_interval < m_stop)
+    {
+      m_event = Simulator::Schedule (m_interval, &TorStatsCollector::Sample, this);
+    }
+}
+
+uint32_t
+TorStatsCollector::GetNCircuits () const
+{
+  return m_circuits.size ();
+}
+
+uint64_t
+TorStatsCollector::GetNRecords () const
+{
+  return m_nRecords;
+}
+
+} //end namespace ns3
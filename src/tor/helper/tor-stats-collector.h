@@ -0,0 +1,61 @@
+#ifndef TORSTATSCOLLECTOR_H
+#define TORSTATSCOLLECTOR_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ns3/core-module.h"
+#include "ns3/network-module.h"
+#include "ns3/tor-base.h"
+
+using namespace std;
+
+namespace ns3 {
+
+/**
+ * Samples the byte counters of many circuits at a fixed interval and
+ * streams them to a binary file. Circuits are registered once; a sample
+ * is one pass over a flat array, with no lookups.
+ *
+ * File layout, in host byte order:
+ *   magic[8] nCircuits:u32 { circId:u32 nameLen:u16 name }*
+ *   { time:i64 (ns) { pRead:u32 pWritten:u32 nRead:u32 nWritten:u32 }* }*
+ * Each record after the header has the same width, 8 + 16 * nCircuits
+ * bytes, so the file can be mapped as a table. Counters are cumulative.
+ */
+class TorStatsCollector
+{
+public:
+  TorStatsCollector ();
+  ~TorStatsCollector ();
+
+  /* Register circ, as seen by the relay called name. */
+  void Add (Ptr<BaseCircuit> circ, string name);
+  /* Register all circuits of the Tor apps in apps. */
+  void Add (ApplicationContainer apps);
+
+  /* Write a record every interval until stop, starting now. */
+  void Start (string filename, Time interval, Time stop);
+  void Stop ();
+
+  uint32_t GetNCircuits () const;
+  uint64_t GetNRecords () const;
+
+private:
+  void Sample ();
+
+  vector<Ptr<BaseCircuit> > m_circuits;
+  vector<string> m_names;
+  vector<uint32_t> m_record; // counters of the current sample
+
+  ofstream m_file;
+  Time m_interval;
+  Time m_stop;
+  EventId m_event;
+  uint64_t m_nRecords;
+};
+
+} //end namespace ns3
+
+#endif
@@ -0,0 +1,105 @@
+#include "tor-warm-start.h"
+#include "ns3/mpi-interface.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+NS_LOG_COMPONENT_DEFINE ("TorWarmStart");
+
+namespace ns3 {
+
+TorWarmStart::TorWarmStart ()
+{
+  m_points = 0;
+  m_jobs = 0;
+  m_parent = true;
+  m_index = 0;
+  m_running = 0;
+  m_failed = 0;
+}
+
+void
+TorWarmStart::Schedule (Time at, uint32_t points, Callback<void,uint32_t> setup, uint32_t jobs)
+{
+  NS_ASSERT (!setup.IsNull ());
+  NS_ABORT_MSG_IF (MpiInterface::IsEnabled (), "TorWarmStart cannot fork a distributed simulation");
+  m_points = points;
+  m_jobs = jobs;
+  m_setup = setup;
+  m_event.Cancel ();
+  m_event = Simulator::Schedule (at - Simulator::Now (), &TorWarmStart::Fork, this);
+}
+
+void
+TorWarmStart::Fork ()
+{
+  NS_LOG_INFO ("forking " << m_points << " children at " << Simulator::Now ().GetSeconds ());
+
+  // buffered output would otherwise be written by every child
+  cout.flush ();
+  cerr.flush ();
+  fflush (0);
+
+  for (uint32_t i = 0; i < m_points; ++i)
+    {
+      while (m_jobs && m_running >= m_jobs)
+        {
+          WaitChild ();
+        }
+      pid_t pid = fork ();
+      NS_ABORT_MSG_IF (pid < 0, "fork failed: " << strerror (errno));
+      if (pid == 0)
+        {
+          m_parent = false;
+          m_index = i;
+          m_running = 0;
+          m_setup (i);
+          return;
+        }
+      ++m_running;
+    }
+
+  while (m_running)
+    {
+      WaitChild ();
+    }
+  Simulator::Stop ();
+}
+
+void
+TorWarmStart::WaitChild ()
+{
+  int status;
+  pid_t pid = waitpid (-1, &status, 0);
+  NS_ABORT_MSG_IF (pid < 0, "waitpid failed: " << strerror (errno));
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      NS_LOG_WARN ("child " << pid << " failed with status " << status);
+      ++m_failed;
+    }
+  --m_running;
+}
+
+bool
+TorWarmStart::IsParent () const
+{
+  return m_parent;
+}
+
+uint32_t
+TorWarmStart::GetIndex () const
+{
+  return m_index;
+}
+
+uint32_t
+TorWarmStart::GetFailed () const
+{
+  return m_failed;
+}
+
+} //end namespace ns3
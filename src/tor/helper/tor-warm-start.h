@@ -0,0 +1,52 @@
+#ifndef TORWARMSTART_H
+#define TORWARMSTART_H
+
+#include "ns3/core-module.h"
+
+using namespace std;
+
+namespace ns3 {
+
+/**
+ * Warm start for parameter sweeps: the shared prefix of a run (topology,
+ * routing, circuit ramp-up) is simulated once, then the process forks one
+ * copy-on-write child per sweep point at a given simulated time. Each child
+ * calls the setup callback with its point index and continues on its own;
+ * the parent waits for all children and stops its simulation.
+ *
+ * After Simulator::Run, IsParent tells the processes apart. Files opened
+ * before the fork are shared, so per-point output should be opened in the
+ * setup callback or after Run. Not usable with MPI.
+ */
+class TorWarmStart
+{
+public:
+  TorWarmStart ();
+
+  /* Fork points children at time at, with at most jobs running at once
+   * (0: no limit). */
+  void Schedule (Time at, uint32_t points, Callback<void,uint32_t> setup, uint32_t jobs = 0);
+
+  bool IsParent () const;
+  uint32_t GetIndex () const;
+  /* Children that did not exit with status 0 (parent only). */
+  uint32_t GetFailed () const;
+
+private:
+  void Fork ();
+  void WaitChild ();
+
+  uint32_t m_points;
+  uint32_t m_jobs;
+  Callback<void,uint32_t> m_setup;
+  EventId m_event;
+
+  bool m_parent;
+  uint32_t m_index;
+  uint32_t m_running;
+  uint32_t m_failed;
+};
+
+} //end namespace ns3
+
+#endif
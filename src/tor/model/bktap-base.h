@@ -5,6 +5,7 @@
 #include "cell-header.h"
 
 #include "ns3/point-to-point-net-device.h"
+#include "ns3/uinteger.h"
 
 #define ACK 1
 #define FWD 2
@@ -216,7 +217,7 @@ public:
   GetSerializedSize () const
   {
     //return  (2 + 1 + 1 + 4 + 4 + 8 + 1);
-    return  (2 + 1 + 1 + 4 + 4 + 8);
+    return  (2 + 1 + 1 + 4 + 4 + 4 + 8);
   }
 
   void
@@ -250,11 +251,238 @@ public:
 };
 
 
+/**
+ * Send timestamps and retransmit marks of an RTT estimator, keyed by sequence
+ * number. Entries live in a circular array spanning the lowest to the highest
+ * sequence number with any state, one timestamp and one flag byte per slot.
+ * The array doubles as the span grows, up to MAX_SPAN slots; beyond that the
+ * oldest entries are dropped, long after any ack could still refer to them.
+ */
+class SentSeqRing
+{
+public:
+  static const uint32_t MAX_SPAN = 1 << 16;
+
+  SentSeqRing ()
+  {
+    m_base = m_first = m_span = m_sentCount = m_lastSent = 0;
+    m_sent.resize (64);
+    m_flags.resize (64, 0);
+  }
+
+  // true if no timestamp is held
+  bool
+  Empty () const
+  {
+    return m_sentCount == 0;
+  }
+
+  // highest sequence number with a timestamp; only meaningful if !Empty ()
+  uint32_t
+  LastSent () const
+  {
+    return m_lastSent;
+  }
+
+  bool
+  HasSent (uint32_t seq) const
+  {
+    return (Flags (seq) & SENT) != 0;
+  }
+
+  bool
+  IsRetx (uint32_t seq) const
+  {
+    return (Flags (seq) & RETX) != 0;
+  }
+
+  Time
+  GetSent (uint32_t seq) const
+  {
+    NS_ASSERT (HasSent (seq));
+    return m_sent[Slot (seq - m_base)];
+  }
+
+  void
+  SetSent (uint32_t seq, Time t)
+  {
+    uint8_t *flags = Touch (seq);
+    if (!flags)
+      {
+        return;
+      }
+    if ((*flags & SENT) == 0)
+      {
+        ++m_sentCount;
+      }
+    if (m_sentCount == 1 || (int32_t) (seq - m_lastSent) > 0)
+      {
+        m_lastSent = seq;
+      }
+    *flags |= SENT;
+    m_sent[Slot (seq - m_base)] = t;
+  }
+
+  void
+  SetRetx (uint32_t seq)
+  {
+    uint8_t *flags = Touch (seq);
+    if (flags)
+      {
+        *flags |= RETX;
+      }
+  }
+
+  // forget timestamp and retransmit mark of seq
+  void
+  Clear (uint32_t seq)
+  {
+    uint8_t f = Flags (seq);
+    if (f == 0)
+      {
+        return;
+      }
+    m_flags[Slot (seq - m_base)] = 0;
+    if (f & SENT)
+      {
+        --m_sentCount;
+        if (m_sentCount > 0 && seq == m_lastSent)
+          {
+            do
+              {
+                --m_lastSent;
+              }
+            while (!HasSent (m_lastSent));
+          }
+      }
+    Trim ();
+  }
+
+private:
+  enum
+  {
+    SENT = 1, RETX = 2
+  };
+
+  uint32_t
+  Slot (uint32_t offset) const
+  {
+    return (m_first + offset) & (m_flags.size () - 1);
+  }
+
+  uint8_t
+  Flags (uint32_t seq) const
+  {
+    uint32_t offset = seq - m_base;
+    return offset < m_span ? m_flags[Slot (offset)] : 0;
+  }
+
+  // returns the flags of seq, making room for it first; 0 if seq is too old
+  uint8_t*
+  Touch (uint32_t seq)
+  {
+    if (m_span == 0)
+      {
+        m_base = seq;
+        m_first = 0;
+        m_span = 1;
+      }
+    else if ((int32_t) (seq - m_base) < 0)
+      {
+        uint32_t below = m_base - seq;
+        if (m_span + below > MAX_SPAN)
+          {
+            return 0;
+          }
+        Reserve (m_span + below);
+        m_first = (m_first - below) & (m_flags.size () - 1);
+        m_base = seq;
+        m_span += below;
+      }
+    else if (seq - m_base >= m_span)
+      {
+        while (m_span > 0 && seq - m_base >= MAX_SPAN)
+          {
+            Drop ();
+          }
+        if (m_span == 0)
+          {
+            return Touch (seq);
+          }
+        Reserve (seq - m_base + 1);
+        m_span = seq - m_base + 1;
+      }
+    return &m_flags[Slot (seq - m_base)];
+  }
+
+  // forget the oldest entry
+  void
+  Drop ()
+  {
+    uint8_t &f = m_flags[m_first];
+    if (f & SENT)
+      {
+        --m_sentCount;
+      }
+    f = 0;
+    Trim ();
+  }
+
+  // keep both ends of the span on slots that hold state
+  void
+  Trim ()
+  {
+    while (m_span > 0 && m_flags[m_first] == 0)
+      {
+        m_first = (m_first + 1) & (m_flags.size () - 1);
+        ++m_base;
+        --m_span;
+      }
+    while (m_span > 0 && m_flags[Slot (m_span - 1)] == 0)
+      {
+        --m_span;
+      }
+  }
+
+  void
+  Reserve (uint32_t span)
+  {
+    uint32_t size = m_flags.size ();
+    if (span <= size)
+      {
+        return;
+      }
+    while (size < span)
+      {
+        size *= 2;
+      }
+
+    vector<Time> sent (size);
+    vector<uint8_t> flags (size, 0);
+    for (uint32_t offset = 0; offset < m_span; ++offset)
+      {
+        sent[offset] = m_sent[Slot (offset)];
+        flags[offset] = m_flags[Slot (offset)];
+      }
+    m_sent.swap (sent);
+    m_flags.swap (flags);
+    m_first = 0;
+  }
+
+  vector<Time> m_sent;
+  vector<uint8_t> m_flags;
+  uint32_t m_base;   // sequence number in slot m_first
+  uint32_t m_first;
+  uint32_t m_span;   // slots from the lowest to the highest entry
+  uint32_t m_sentCount;
+  uint32_t m_lastSent;
+};
+
+
 class SimpleRttEstimator
 {
 public:
-  map< uint32_t,Time > rttHistory;
-  set<uint32_t> retx;
+  SentSeqRing history;
   Time estimatedRtt;
   Time devRtt;
   Time currentRtt;
@@ -273,32 +501,31 @@ public:
 
   void
   SentSeq (uint32_t seq){
-    if (rttHistory.size () == 0 || rttHistory.rbegin ()->first + 1 == seq)
+    if (history.Empty () || history.LastSent () + 1 == seq)
       {
         // next seq, log it.
-        rttHistory[seq] = Simulator::Now ();
+        history.SetSent (seq, Simulator::Now ());
       }
     else
       {
         //remember es retx
-        retx.insert (seq);
+        history.SetRetx (seq);
       }
   }
 
   Time
   EstimateRtt (uint32_t ack) {
     Time rtt = Time (0);
-    if (rttHistory.find (ack - 1) != rttHistory.end ())
+    if (history.HasSent (ack - 1))
       {
-        if (retx.find (ack - 1) == retx.end ())
+        if (!history.IsRetx (ack - 1))
           {
-            rtt = Simulator::Now () - rttHistory[ack - 1];
+            rtt = Simulator::Now () - history.GetSent (ack - 1);
             AddSample (rtt);
             rttMultiplier = 1;
           }
       }
-    retx.erase (ack - 1);
-    rttHistory.erase (ack - 1);
+    history.Clear (ack - 1);
     return rtt;
   }
 
@@ -340,5 +567,238 @@ public:
     return rto;
   }
 };
+
+
+/**
+ * Cells of a sequence queue, keyed by sequence number. Sequence numbers in a
+ * queue are dense, so the cells live in a circular array indexed by their
+ * distance from the lowest sequence number held. A bitmap marks the occupied
+ * slots, which leaves room for holes from out-of-order arrival. The array
+ * doubles when a cell does not fit and is never shrunk.
+ */
+class CellRing
+{
+public:
+  CellRing ()
+  {
+    m_base = m_first = m_span = m_count = 0;
+    m_cells.resize (64);
+    m_present.resize (2, 0);
+  }
+
+  bool
+  Has (uint32_t seq) const
+  {
+    uint32_t offset = seq - m_base;
+    return m_count > 0 && offset < m_span && Test (Slot (offset));
+  }
+
+  Ptr<Packet>
+  Get (uint32_t seq) const
+  {
+    if (!Has (seq))
+      {
+        return 0;
+      }
+    return m_cells[Slot (seq - m_base)];
+  }
+
+  void
+  Insert (uint32_t seq, Ptr<Packet> cell)
+  {
+    if (m_count == 0)
+      {
+        m_base = seq;
+        m_first = 0;
+        m_span = 1;
+      }
+    else if ((int32_t) (seq - m_base) < 0)
+      {
+        uint32_t below = m_base - seq;
+        Reserve (m_span + below);
+        m_first = (m_first - below) & (m_cells.size () - 1);
+        m_base = seq;
+        m_span += below;
+      }
+    else if (seq - m_base >= m_span)
+      {
+        Reserve (seq - m_base + 1);
+        m_span = seq - m_base + 1;
+      }
+
+    uint32_t i = Slot (seq - m_base);
+    if (!Test (i))
+      {
+        m_present[i >> 5] |= (1u << (i & 31));
+        ++m_count;
+      }
+    m_cells[i] = cell;
+  }
+
+  void
+  Erase (uint32_t seq)
+  {
+    if (!Has (seq))
+      {
+        return;
+      }
+
+    uint32_t i = Slot (seq - m_base);
+    m_present[i >> 5] &= ~(1u << (i & 31));
+    CellPool::Release (m_cells[i]);
+    if (--m_count == 0)
+      {
+        m_span = 0;
+        return;
+      }
+
+    // keep both ends of the span on occupied slots
+    while (!Test (m_first))
+      {
+        m_first = (m_first + 1) & (m_cells.size () - 1);
+        ++m_base;
+        --m_span;
+      }
+    while (!Test (Slot (m_span - 1)))
+      {
+        --m_span;
+      }
+  }
+
+  // lowest sequence number held; only meaningful if Size () > 0
+  uint32_t
+  Lowest () const
+  {
+    return m_base;
+  }
+
+  uint32_t
+  Size () const
+  {
+    return m_count;
+  }
+
+private:
+  uint32_t
+  Slot (uint32_t offset) const
+  {
+    return (m_first + offset) & (m_cells.size () - 1);
+  }
+
+  bool
+  Test (uint32_t i) const
+  {
+    return (m_present[i >> 5] >> (i & 31)) & 1;
+  }
+
+  void
+  Reserve (uint32_t span)
+  {
+    uint32_t size = m_cells.size ();
+    if (span <= size)
+      {
+        return;
+      }
+    while (size < span)
+      {
+        size *= 2;
+      }
+
+    vector<Ptr<Packet> > cells (size);
+    vector<uint32_t> present (size / 32, 0);
+    for (uint32_t offset = 0; offset < m_span; ++offset)
+      {
+        uint32_t i = Slot (offset);
+        if (Test (i))
+          {
+            cells[offset] = m_cells[i];
+            present[offset >> 5] |= (1u << (offset & 31));
+          }
+      }
+    m_cells.swap (cells);
+    m_present.swap (present);
+    m_first = 0;
+  }
+
+  vector<Ptr<Packet> > m_cells;
+  vector<uint32_t> m_present;
+  uint32_t m_base;   // sequence number in slot m_first
+  uint32_t m_first;
+  uint32_t m_span;   // slots from the lowest to the highest cell held
+  uint32_t m_count;
+};
+
+
+/**
+ * Cell channels whose flush stopped at a full device queue, oldest first.
+ * Start lowers the queue's watermark to one below its limit and listens for
+ * Drain; each drain flushes the waiting channels again, and those that meet a
+ * full queue once more line up for the next one. Channel needs a public
+ * m_flushBlocked flag and Flush ().
+ */
+template <class Channel>
+class DeviceQueueWaiters
+{
+public:
+  void
+  Start (Ptr<Queue> devQ, uint32_t limit)
+  {
+    m_devQ = devQ;
+    m_devQ->SetAttribute ("LowWatermark", UintegerValue (limit - 1));
+    m_devQ->TraceConnectWithoutContext ("Drain", MakeCallback (&DeviceQueueWaiters::Drained, this));
+  }
+
+  void
+  Stop ()
+  {
+    m_devQ->TraceDisconnectWithoutContext ("Drain", MakeCallback (&DeviceQueueWaiters::Drained, this));
+    m_event.Cancel ();
+  }
+
+  void
+  Add (Ptr<Channel> ch)
+  {
+    if (!ch->m_flushBlocked)
+      {
+        ch->m_flushBlocked = true;
+        m_channels.push_back (ch);
+      }
+  }
+
+  void
+  Clear ()
+  {
+    m_channels.clear ();
+  }
+
+private:
+  /* Fired from within the device queue's dequeue, so the flushes, which
+   * enqueue again, wait for an event of their own. */
+  void
+  Drained ()
+  {
+    if (!m_channels.empty () && m_event.IsExpired ())
+      {
+        m_event = Simulator::ScheduleNow (&DeviceQueueWaiters::FlushAll, this);
+      }
+  }
+
+  void
+  FlushAll ()
+  {
+    vector<Ptr<Channel> > blocked;
+    blocked.swap (m_channels);
+    for (uint32_t i = 0; i < blocked.size (); i++)
+      {
+        blocked[i]->m_flushBlocked = false;
+        blocked[i]->Flush ();
+      }
+  }
+
+  Ptr<Queue> m_devQ;
+  vector<Ptr<Channel> > m_channels;
+  EventId m_event;
+};
+
 } /* end namespace ns3 */
 #endif /* __BKTAP_BASE_H__ */
@@ -0,0 +1,109 @@
+#include "cell-pool.h"
+
+namespace ns3 {
+
+std::vector<Ptr<Packet> > CellPool::m_free;
+std::vector<uint8_t> CellPool::m_gather;
+uint32_t CellPool::m_maxSize = 4096;
+uint64_t CellPool::m_allocated = 0;
+uint64_t CellPool::m_recycled = 0;
+
+Ptr<Packet>
+CellPool::Acquire (uint32_t payload)
+{
+  if (m_free.empty ())
+    {
+      ++m_allocated;
+      return Create<Packet> (payload);
+    }
+
+  Ptr<Packet> cell = m_free.back ();
+  m_free.pop_back ();
+  ++m_recycled;
+
+  // reset buffer, tags and metadata; a fresh packet also gets a fresh uid
+  *cell = Packet (payload);
+  return cell;
+}
+
+/* The slice shares the buffer of p, as with CreateFragment, so taking it
+ * copies no payload. */
+Ptr<Packet>
+CellPool::Fragment (Ptr<const Packet> p, uint32_t start, uint32_t length)
+{
+  if (m_free.empty ())
+    {
+      ++m_allocated;
+      return p->CreateFragment (start, length);
+    }
+
+  Ptr<Packet> cell = m_free.back ();
+  m_free.pop_back ();
+  ++m_recycled;
+
+  *cell = *p;
+  cell->RemoveAtEnd (p->GetSize () - (start + length));
+  cell->RemoveAtStart (start);
+  return cell;
+}
+
+void
+CellPool::Release (Ptr<Packet> &cell)
+{
+  if (cell && cell->GetReferenceCount () == 1 && m_free.size () < m_maxSize)
+    {
+      m_free.push_back (cell);
+    }
+  cell = 0;
+}
+
+/* Pops cells off the front while the datagram stays within maxSize bytes,
+ * but at least one, and releases them. Their bytes are copied into a
+ * scratch area, and the datagram is created as a copy of that area: two
+ * flat copies, where Packet::AddAtEnd would copy the growing datagram on
+ * every append. Tags and metadata of the cells are not carried over. */
+Ptr<Packet>
+CellPool::Gather (std::queue<Ptr<Packet> > &cells, uint32_t maxSize)
+{
+  uint32_t size = 0;
+  while (cells.size () > 0 && (size == 0 || size + cells.front ()->GetSize () <= maxSize))
+    {
+      Ptr<Packet> cell = cells.front ();
+      cells.pop ();
+      if (m_gather.size () < size + cell->GetSize ())
+        {
+          m_gather.resize (size + cell->GetSize ());
+        }
+      size += cell->CopyData (&m_gather[size], cell->GetSize ());
+      Release (cell);
+    }
+  if (size == 0)
+    {
+      return Create<Packet> ();
+    }
+  return Create<Packet> (&m_gather[0], size);
+}
+
+void
+CellPool::SetMaxSize (uint32_t size)
+{
+  m_maxSize = size;
+  if (m_free.size () > m_maxSize)
+    {
+      m_free.resize (m_maxSize);
+    }
+}
+
+uint64_t
+CellPool::GetAllocated ()
+{
+  return m_allocated;
+}
+
+uint64_t
+CellPool::GetRecycled ()
+{
+  return m_recycled;
+}
+
+} //namespace ns3
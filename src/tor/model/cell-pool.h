@@ -0,0 +1,42 @@
+#ifndef __CELL_POOL_H__
+#define __CELL_POOL_H__
+
+#include <queue>
+#include <vector>
+#include "ns3/packet.h"
+
+namespace ns3 {
+
+/**
+ * Recycles the packets that carry cells. Acquire hands out a packet holding
+ * the given amount of zero-filled payload, with header room in front of it.
+ * Fragment hands out a slice of a received packet, like CreateFragment.
+ * Release takes a packet back, but only if the caller holds the last
+ * reference to it; the caller's pointer is cleared either way.
+ *
+ * Gather builds a datagram out of queued cells with two flat copies,
+ * instead of a copy per appended cell.
+ */
+class CellPool
+{
+public:
+  static Ptr<Packet> Acquire (uint32_t payload);
+  static Ptr<Packet> Fragment (Ptr<const Packet> p, uint32_t start, uint32_t length);
+  static void Release (Ptr<Packet> &cell);
+  static Ptr<Packet> Gather (std::queue<Ptr<Packet> > &cells, uint32_t maxSize);
+
+  static void SetMaxSize (uint32_t);
+  static uint64_t GetAllocated ();
+  static uint64_t GetRecycled ();
+
+private:
+  static std::vector<Ptr<Packet> > m_free;
+  static std::vector<uint8_t> m_gather;
+  static uint32_t m_maxSize;
+  static uint64_t m_allocated;
+  static uint64_t m_recycled;
+};
+
+} //namespace ns3
+
+#endif /* __CELL_POOL_H__ */
@@ -1,4 +1,5 @@
 #include "pseudo-socket.h"
+#include "cell-pool.h"
 #include "stdio.h"
 
 NS_LOG_COMPONENT_DEFINE ("PseudoSocket");
@@ -6,6 +7,7 @@ NS_LOG_COMPONENT_DEFINE ("PseudoSocket");
 namespace ns3 {
 
 NS_OBJECT_ENSURE_REGISTERED (PseudoSocket);
+NS_OBJECT_ENSURE_REGISTERED (PseudoClientSocket);
 
 // static TypeId PseudoSocket::GetTypeId (void) {
 //   static TypeId tid = TypeId ("ns3::PseudoSocket")
@@ -197,7 +199,7 @@ Ptr<Packet>
 PseudoBulkSocket::Recv (uint32_t maxSize, uint32_t flags)
 {
   Simulator::ScheduleNow (&PseudoBulkSocket::NotifyDataRecv, this);
-  return Create<Packet> (maxSize);
+  return CellPool::Acquire (maxSize);
 }
 
 
@@ -241,7 +243,7 @@ PseudoServerSocket::Recv (uint32_t maxSize, uint32_t flags)
 
   if (maxSize >= m_leftToSend)
     {
-      Ptr<Packet> p = Create<Packet> (m_leftToSend);
+      Ptr<Packet> p = CellPool::Acquire (m_leftToSend);
       m_leftToSend = 0;
       m_leftToRead = PACKET_PAYLOAD_SIZE;
       Simulator::ScheduleNow (&PseudoServerSocket::NotifySend, this, GetTxAvailable ());
@@ -252,7 +254,7 @@ PseudoServerSocket::Recv (uint32_t maxSize, uint32_t flags)
     {
       m_leftToSend -= maxSize;
       Simulator::ScheduleNow (&PseudoServerSocket::NotifyDataRecv, this);
-      return Create<Packet> (maxSize);
+      return CellPool::Acquire (maxSize);
     }
 }
 
@@ -308,6 +310,24 @@ PseudoServerSocket::Send (Ptr<Packet> p, uint32_t flags)
 
 
 
+TypeId
+PseudoClientSocket::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::PseudoClientSocket")
+    .SetParent<Socket> ()
+    .AddTraceSource ("Ttfb",
+                     "Time to first byte of a download (circuit id, typehint, time).",
+                     MakeTraceSourceAccessor (&PseudoClientSocket::m_ttfbTrace))
+    .AddTraceSource ("Ttlb",
+                     "Time to last byte of a download (circuit id, typehint, time).",
+                     MakeTraceSourceAccessor (&PseudoClientSocket::m_ttlbTrace))
+    .AddTraceSource ("Rx",
+                     "A cell payload of a download was delivered to the client.",
+                     MakeTraceSourceAccessor (&PseudoClientSocket::m_rxTrace))
+  ;
+  return tid;
+}
+
 PseudoClientSocket::PseudoClientSocket (Time startTime)
 {
   //default: bulk sender
@@ -323,8 +343,7 @@ PseudoClientSocket::PseudoClientSocket (Time startTime)
   m_leftToRead = 0;
   ttlbCallback = 0;
   ttfbCallback = 0;
-  m_ttlbId = 0;
-  m_ttfbId = 0;
+  m_circId = 0;
 
   m_startEvent = Simulator::Schedule (startTime, &PseudoClientSocket::RequestPage, this);
 }
@@ -335,6 +354,7 @@ PseudoClientSocket::PseudoClientSocket (Ptr<RandomVariableStream> requestStream,
   m_leftToRead = 0;
   ttlbCallback = 0;
   ttfbCallback = 0;
+  m_circId = 0;
   m_requestSizeStream = requestStream;
   m_thinkTimeStream = thinkStream;
   m_leftToSend = 0;
@@ -433,12 +453,14 @@ PseudoClientSocket::Send (Ptr<Packet> p, uint32_t flags)
       Time ttfb = Time (Simulator::Now () - m_requestSent);
       if (ttfbCallback)
         {
-          ttfbCallback (m_ttfbId, ttfb.GetSeconds (), m_ttfbDesc);
+          ttfbCallback (m_circId, ttfb.GetSeconds (), m_typehint);
         }
+      m_ttfbTrace (m_circId, m_typehint, ttfb);
     }
 
   uint32_t size = p->GetSize ();
   m_leftToRead -= size;
+  m_rxTrace (p);
 
   if (m_leftToRead <= 0)
     {
@@ -446,8 +468,9 @@ PseudoClientSocket::Send (Ptr<Packet> p, uint32_t flags)
       Time ttlb = Time (Simulator::Now () - m_requestSent);
       if (ttlbCallback)
         {
-          ttlbCallback (m_ttlbId, ttlb.GetSeconds (), m_ttlbDesc);
+          ttlbCallback (m_circId, ttlb.GetSeconds (), m_typehint);
         }
+      m_ttlbTrace (m_circId, m_typehint, ttlb);
       Simulator::Schedule (Seconds (m_thinkTimeStream->GetValue ()), &PseudoClientSocket::RequestPage, this);
     }
 
@@ -482,19 +505,36 @@ PseudoClientSocket::RoundUp (uint32_t num, uint32_t multiple)
 
 
 
+void
+PseudoClientSocket::SetCircuit (int id, string typehint)
+{
+  m_circId = id;
+  m_typehint = typehint;
+}
+
+int
+PseudoClientSocket::GetCircuitId () const
+{
+  return m_circId;
+}
+
+string
+PseudoClientSocket::GetTypehint () const
+{
+  return m_typehint;
+}
+
 void
 PseudoClientSocket::SetTtfbCallback (void (*ttfb)(int, double, string), int id, string desc)
 {
-  m_ttfbId = id;
-  m_ttfbDesc = desc;
+  SetCircuit (id, desc);
   ttfbCallback = ttfb;
 }
 
 void
 PseudoClientSocket::SetTtlbCallback (void (*ttlb)(int, double, string), int id, string desc)
 {
-  m_ttlbId = id;
-  m_ttlbDesc = desc;
+  SetCircuit (id, desc);
   ttlbCallback = ttlb;
 }
 
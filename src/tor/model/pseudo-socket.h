@@ -110,6 +110,7 @@ private:
 class PseudoClientSocket : public PseudoSocket
 {
 public:
+  static TypeId GetTypeId (void);
   PseudoClientSocket (Time startTime = Seconds (0.01));
   PseudoClientSocket (Ptr<RandomVariableStream>, Ptr<RandomVariableStream>, Time startTime = Seconds (0.1));
 
@@ -122,6 +123,10 @@ public:
   void SetThinkStream (Ptr<RandomVariableStream>);
   void Start (Time);
 
+  void SetCircuit (int, string);
+  int GetCircuitId () const;
+  string GetTypehint () const;
+
   void SetTtfbCallback (void (*)(int, double, string), int, string);
   void SetTtlbCallback (void (*)(int, double, string), int, string);
 
@@ -135,10 +140,13 @@ private:
   Time m_requestSent;
   void (*ttfbCallback)(int, double, string);
   void (*ttlbCallback)(int, double, string);
-  int m_ttfbId;
-  int m_ttlbId;
-  string m_ttfbDesc;
-  string m_ttlbDesc;
+  int m_circId;
+  string m_typehint;
+
+  // circuit id, typehint, time to first/last byte
+  TracedCallback<int, string, Time> m_ttfbTrace;
+  TracedCallback<int, string, Time> m_ttlbTrace;
+  TracedCallback<Ptr<const Packet> > m_rxTrace;
   EventId m_startEvent;
 
   Ptr<RandomVariableStream> m_thinkTimeStream;
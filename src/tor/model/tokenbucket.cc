@@ -1,4 +1,3 @@
-
 #include "tokenbucket.h"
 #include "ns3/log.h"
 
@@ -10,6 +9,10 @@ NS_LOG_COMPONENT_DEFINE ("TokenBucket");
 TokenBucket::TokenBucket ()
 {
   NS_LOG_FUNCTION (this);
+  m_bucket = 0;
+  m_refills = -1;
+  m_started = false;
+  m_whenEmpty = false;
 }
 
 TokenBucket::TokenBucket (DataRate rate, DataRate burst, Time refilltime)
@@ -18,6 +21,10 @@ TokenBucket::TokenBucket (DataRate rate, DataRate burst, Time refilltime)
   m_rate = rate;
   m_burst = burst;
   m_refilltime = refilltime;
+  m_bucket = 0;
+  m_refills = -1;
+  m_started = false;
+  m_whenEmpty = false;
 }
 
 TokenBucket::~TokenBucket ()
@@ -27,21 +34,56 @@ TokenBucket::~TokenBucket ()
 }
 
 void
-TokenBucket::SetRefilledCallback (Callback<void,int64_t> cb)
+TokenBucket::SetRefilledCallback (Callback<void,int64_t> cb, bool whenEmpty)
 {
   m_refilled = cb;
+  m_whenEmpty = whenEmpty;
+  if (!m_started)
+    {
+      return;
+    }
+
+  Update ();
+  if (m_refilled.IsNull () || (m_whenEmpty && m_bucket > 0))
+    {
+      m_refillevent.Cancel ();
+    }
+  else
+    {
+      ScheduleRefill ();
+    }
 }
 
 void
 TokenBucket::StartBucket (Time offset)
 {
   m_bucket = m_burst.GetBitRate () / 8;
-  m_refillevent = Simulator::Schedule (offset,&TokenBucket::Refill, this);
+  m_start = Simulator::Now () + offset;
+  m_refills = -1;
+  m_started = true;
+  if (!m_refilled.IsNull () && !m_whenEmpty)
+    {
+      ScheduleRefill ();
+    }
+}
+
+void
+TokenBucket::SetRate (DataRate rate, DataRate burst)
+{
+  Update ();
+  m_rate = rate;
+  m_burst = burst;
+  int64_t max = m_burst.GetBitRate () / 8;
+  if (m_bucket > max)
+    {
+      m_bucket = max;
+    }
 }
 
 uint32_t
 TokenBucket::GetSize ()
 {
+  Update ();
   if (m_bucket <= 0)
     {
       return 0;
@@ -52,27 +94,89 @@ TokenBucket::GetSize ()
 void
 TokenBucket::Decrement (uint32_t n)
 {
+  Update ();
   m_bucket -= n;
+  if (m_bucket <= 0 && !m_refilled.IsNull ())
+    {
+      ScheduleRefill ();
+    }
 }
 
+// Applies the refills that happened before now. A refill due right now is
+// left to the refill event (if any), so the callback sees the bucket as it
+// was before that refill.
 void
-TokenBucket::Refill ()
+TokenBucket::Update ()
+{
+  Time now = Simulator::Now ();
+  if (!m_started || now <= m_start)
+    {
+      return;
+    }
+  ApplyRefills (((now - m_start).GetTimeStep () - 1) / m_refilltime.GetTimeStep ());
+}
+
+void
+TokenBucket::ApplyRefills (int64_t last)
 {
-  int64_t prev_bucket = m_bucket;
   int64_t rate = m_rate.GetBitRate () / 8;
   int64_t burst = m_burst.GetBitRate () / 8;
-  m_bucket += rate * m_refilltime.GetSeconds ();
-  if (burst < m_bucket)
+  while (m_refills < last)
+    {
+      if (burst <= m_bucket)
+        {
+          // full, further refills change nothing
+          m_refills = last;
+          break;
+        }
+      ++m_refills;
+      m_bucket += rate * m_refilltime.GetSeconds ();
+      if (burst < m_bucket)
+        {
+          m_bucket = burst;
+        }
+    }
+}
+
+void
+TokenBucket::ScheduleRefill ()
+{
+  if (m_refillevent.IsRunning ())
+    {
+      return;
+    }
+  Time next = m_start;
+  Time now = Simulator::Now ();
+  if (now >= m_start)
     {
-      m_bucket = burst;
+      int64_t k = (now - m_start).GetTimeStep () / m_refilltime.GetTimeStep ();
+      next = m_start + m_refilltime * (k + 1);
+      if (k > m_refills)
+        {
+          // the refill due right now has not been applied yet
+          next = m_start + m_refilltime * k;
+        }
     }
+  m_refillevent = Simulator::Schedule (next - now, &TokenBucket::Refill, this);
+}
 
-  if (!m_refilled.IsNull ())
+void
+TokenBucket::Refill ()
+{
+  int64_t k = (Simulator::Now () - m_start).GetTimeStep () / m_refilltime.GetTimeStep ();
+  ApplyRefills (k - 1);
+  int64_t prev_bucket = m_bucket;
+  ApplyRefills (k);
+
+  if (!m_refilled.IsNull () && (!m_whenEmpty || prev_bucket <= 0))
     {
       m_refilled (prev_bucket);
     }
 
-  m_refillevent = Simulator::Schedule (m_refilltime,&TokenBucket::Refill, this);
+  if (!m_refilled.IsNull () && (!m_whenEmpty || m_bucket <= 0))
+    {
+      ScheduleRefill ();
+    }
 }
 
-} //namespace ns3
\ No newline at end of file
+} //namespace ns3
@@ -1,4 +1,3 @@
-
 #ifndef __TOKENBUCKET_H__
 #define __TOKENBUCKET_H__
 
@@ -8,6 +7,11 @@
 namespace ns3 {
 
 
+/**
+ * Token bucket refilled every refilltime, evaluated lazily: refills that
+ * happened since the last access are applied when the bucket is queried.
+ * Events are only scheduled to run the refilled callback.
+ */
 class TokenBucket
 {
 public:
@@ -16,12 +20,20 @@ public:
   ~TokenBucket ();
 
   void StartBucket (Time = Seconds (0));
-  void SetRefilledCallback (Callback<void,int64_t>);
+  /* Change rate and burst from now on, keeping the refill schedule. */
+  void SetRate (DataRate, DataRate);
+  /* The callback is called with the previous bucket size on every refill.
+   * With whenEmpty set, it is only called on refills that find the bucket
+   * empty, and no events are scheduled while the bucket holds tokens. */
+  void SetRefilledCallback (Callback<void,int64_t>, bool whenEmpty = false);
   uint32_t GetSize ();
   void Decrement (uint32_t);
 
 private:
   void Refill ();
+  void Update ();
+  void ApplyRefills (int64_t);
+  void ScheduleRefill ();
 
   int64_t m_bucket;
   DataRate m_rate;
@@ -29,9 +41,14 @@ private:
   Time m_refilltime;
   EventId m_refillevent;
 
+  Time m_start; // time of the first refill
+  int64_t m_refills; // index of the last refill applied to m_bucket
+  bool m_started;
+
   Callback<void,int64_t> m_refilled;
+  bool m_whenEmpty;
 };
 
 } //namespace ns3
 
-#endif /* __TOKENBUCKET_H__ */
\ No newline at end of file
+#endif /* __TOKENBUCKET_H__ */
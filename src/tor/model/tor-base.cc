@@ -3,6 +3,7 @@
 #include "ns3/random-variable-stream.h"
 
 #include "tor-base.h"
+#include "tor-link-channel.h"
 
 using namespace std;
 namespace ns3 {
@@ -87,6 +88,25 @@ TorBaseApp::AddCircuit (int circ_id, Ipv4Address n_ip, int n_conntype, Ipv4Addre
   NS_ASSERT (p_conntype == RELAYEDGE || p_conntype == PROXYEDGE || p_conntype == SERVEREDGE);
 }
 
+void
+TorBaseApp::Reconfigure (void)
+{
+  NS_LOG_FUNCTION (this);
+  m_readbucket.SetRate (m_rate, m_burst);
+  m_writebucket.SetRate (m_rate, m_burst);
+}
+
+Ptr<Socket>
+TorBaseApp::CreateSocket (TypeId tid)
+{
+  Ptr<TorLinkSocketFactory> link = GetNode ()->GetObject<TorLinkSocketFactory> ();
+  if (link)
+    {
+      return link->CreateSocket (tid);
+    }
+  return Socket::CreateSocket (GetNode (), tid);
+}
+
 void
 TorBaseApp::SetNodeName (string name)
 {
@@ -108,7 +128,7 @@ BaseCircuit::BaseCircuit ()
   NS_LOG_FUNCTION (this);
 }
 
-BaseCircuit::BaseCircuit (uint16_t id)
+BaseCircuit::BaseCircuit (uint32_t id)
 {
   NS_LOG_FUNCTION (this);
   m_id = id;
@@ -120,7 +140,7 @@ BaseCircuit::~BaseCircuit ()
   NS_LOG_FUNCTION (this);
 }
 
-uint16_t
+uint32_t
 BaseCircuit::GetId ()
 {
   return m_id;
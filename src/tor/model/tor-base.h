@@ -1,12 +1,16 @@
 #ifndef __TOR_BASE_H__
 #define __TOR_BASE_H__
 
+#include <algorithm>
+
 #include "ns3/application.h"
 #include "ns3/internet-module.h"
 #include "ns3/data-rate.h"
+#include "ns3/sgi-hashmap.h"
 
 #include "pseudo-socket.h"
 #include "tokenbucket.h"
+#include "cell-pool.h"
 
 #define RELAYEDGE 0 // aka speaks cells
 #define PROXYEDGE 2
@@ -29,6 +33,176 @@ enum CellDirection
   INBOUND, OUTBOUND
 };
 
+/** Hashes sockets by address. Used to map a socket handed to a read/write
+  * callback back to its connection (or channel) in constant time. */
+struct SocketHash
+{
+  size_t operator() (const Ptr<Socket> &socket) const
+  {
+    return (size_t) PeekPointer (socket) >> 3;
+  }
+};
+
+/**
+ * Circuits of an app, keyed by their 32-bit scenario-wide id (cells on the
+ * wire carry 16-bit link-local ids instead). Lookups go through an open
+ * addressing hash table, so ids may be sparse and a lookup is a couple of
+ * loads. Get and operator[] return null for unknown ids and never insert.
+ * Iteration visits circuits in id order; adds only append, and the list is
+ * sorted on the first iteration after them.
+ */
+template <class T>
+class CircuitTable
+{
+public:
+  typedef typename vector<Ptr<T> >::iterator Iterator;
+
+  CircuitTable ()
+  {
+    Clear ();
+  }
+
+  Ptr<T>
+  Get (uint32_t id) const
+  {
+    uint32_t i = Slot (id);
+    return m_keys[i] == id && id != EMPTY ? m_entries[m_index[i]].second : Ptr<T> ();
+  }
+
+  Ptr<T>
+  operator[] (uint32_t id) const
+  {
+    return Get (id);
+  }
+
+  void
+  Add (uint32_t id, Ptr<T> circ)
+  {
+    NS_ASSERT (circ);
+    NS_ABORT_MSG_IF (id == EMPTY, "Circuit id " << id << " is reserved");
+    uint32_t i = Slot (id);
+    if (m_keys[i] == id)
+      {
+        m_entries[m_index[i]].second = circ;
+        m_sorted = false;
+        return;
+      }
+    if ((m_entries.size () + 1) * 2 > m_keys.size ())
+      {
+        Rehash (m_keys.size () * 2);
+        i = Slot (id);
+      }
+    m_keys[i] = id;
+    m_index[i] = m_entries.size ();
+    m_entries.push_back (make_pair (id, circ));
+    m_sorted = false;
+  }
+
+  uint32_t
+  size () const
+  {
+    return m_entries.size ();
+  }
+
+  Iterator
+  begin ()
+  {
+    Sort ();
+    return m_list.begin ();
+  }
+
+  Iterator
+  end ()
+  {
+    Sort ();
+    return m_list.end ();
+  }
+
+  void
+  clear ()
+  {
+    Clear ();
+  }
+
+private:
+  static const uint32_t EMPTY = 0xffffffff;
+
+  // slot holding id, or the empty slot where it would go; the high bits of
+  // the product depend on all bits of the id
+  uint32_t
+  Slot (uint32_t id) const
+  {
+    uint32_t mask = m_keys.size () - 1;
+    uint32_t i = (id * 2654435761u) >> m_shift;
+    while (m_keys[i] != EMPTY && m_keys[i] != id)
+      {
+        i = (i + 1) & mask;
+      }
+    return i;
+  }
+
+  void
+  Rehash (uint32_t capacity)
+  {
+    m_keys.assign (capacity, EMPTY);
+    m_index.resize (capacity);
+    m_shift = 32;
+    while (capacity > 1)
+      {
+        capacity >>= 1;
+        --m_shift;
+      }
+    for (uint32_t j = 0; j < m_entries.size (); ++j)
+      {
+        uint32_t i = Slot (m_entries[j].first);
+        m_keys[i] = m_entries[j].first;
+        m_index[i] = j;
+      }
+  }
+
+  static bool
+  IdLess (const pair<uint32_t,Ptr<T> > &a, const pair<uint32_t,Ptr<T> > &b)
+  {
+    return a.first < b.first;
+  }
+
+  void
+  Sort ()
+  {
+    if (m_sorted)
+      {
+        return;
+      }
+    sort (m_entries.begin (), m_entries.end (), IdLess);
+    m_list.resize (m_entries.size ());
+    for (uint32_t j = 0; j < m_entries.size (); ++j)
+      {
+        m_index[Slot (m_entries[j].first)] = j;
+        m_list[j] = m_entries[j].second;
+      }
+    m_sorted = true;
+  }
+
+  void
+  Clear ()
+  {
+    m_entries.clear ();
+    m_list.clear ();
+    m_sorted = true;
+    Rehash (16);
+  }
+
+  vector<uint32_t> m_keys;
+  vector<uint32_t> m_index;   // of the slot's entry in m_entries
+  uint32_t m_shift;           // 32 - log2 (capacity)
+  vector<pair<uint32_t,Ptr<T> > > m_entries;  // in the order added until sorted
+  vector<Ptr<T> > m_list;   // circuits in id order, once sorted
+  bool m_sorted;
+};
+
+template <class T>
+const uint32_t CircuitTable<T>::EMPTY;
+
 /*
 std::string CellDirectionArray[2] =
 {
@@ -51,6 +225,11 @@ public:
 
   virtual void AddCircuit (int, Ipv4Address, int, Ipv4Address, int,
                            Ptr<PseudoClientSocket> clientSocket = 0);
+  /* Apply attributes changed while the app is running. */
+  virtual void Reconfigure (void);
+  /* A socket of the node's TorLinkChannel if it has one, of the
+   * internet stack otherwise. */
+  Ptr<Socket> CreateSocket (TypeId);
 
   virtual void SetNodeName (std::string);
   virtual std::string GetNodeName (void);
@@ -64,7 +243,7 @@ public:
   Time m_refilltime;
   TokenBucket m_writebucket;
   TokenBucket m_readbucket;
-  map<uint16_t,Ptr<BaseCircuit> > baseCircuits;
+  CircuitTable<BaseCircuit> baseCircuits;
 
 };
 
@@ -72,10 +251,10 @@ class BaseCircuit : public SimpleRefCount<BaseCircuit>
 {
 public:
   BaseCircuit ();
-  BaseCircuit (uint16_t);
+  BaseCircuit (uint32_t);
   virtual ~BaseCircuit ();
 
-  uint16_t GetId ();
+  uint32_t GetId ();
   CellDirection GetOppositeDirection (CellDirection direction);
 
   uint32_t GetBytesRead (CellDirection);
@@ -84,7 +263,9 @@ public:
   void ResetStats ();
 
 protected:
-  uint16_t m_id;
+  friend class TorStatsCollector;
+
+  uint32_t m_id;
 
   uint32_t stats_p_bytes_read;
   uint32_t stats_p_bytes_written;
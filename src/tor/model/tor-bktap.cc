@@ -15,6 +15,9 @@ UdpChannel::UdpChannel ()
 {
   NS_LOG_FUNCTION (this);
   this->m_socket = 0;
+  this->m_readStarved = false;
+  this->m_flushBlocked = false;
+  this->m_drainWaiters = 0;
 }
 
 UdpChannel::UdpChannel (Address remote, int conntype)
@@ -22,6 +25,9 @@ UdpChannel::UdpChannel (Address remote, int conntype)
   m_remote = remote;
   m_conntype = conntype;
   this->m_socket = 0;
+  this->m_readStarved = false;
+  this->m_flushBlocked = false;
+  this->m_drainWaiters = 0;
 }
 
 void
@@ -42,22 +48,37 @@ UdpChannel::SpeaksCells ()
   return m_conntype == RELAYEDGE;
 }
 
+// Both ends of a link add its circuits in the same order, so they agree on
+// the ids without any handshake.
+uint16_t
+UdpChannel::AddCircuit (Ptr<BktapCircuit> circ)
+{
+  NS_ABORT_MSG_IF (circuits.size () > 0xffff, "More than 65536 circuits on channel");
+  circuits.push_back (circ);
+  return circuits.size () - 1;
+}
+
+Ptr<BktapCircuit>
+UdpChannel::GetCircuit (uint16_t id)
+{
+  return id < circuits.size () ? circuits[id] : 0;
+}
+
 void
 UdpChannel::Flush ()
 {
+  if (m_feedbackCircuits.size () > 0)
+    {
+      PushFeedback ();
+    }
   while (m_flushQueue.size () > 0)
     {
       if (SpeaksCells () && m_devQlimit <= m_devQ->GetNPackets ())
         {
-          m_flushEvent = Simulator::Schedule (MilliSeconds (1), &UdpChannel::Flush, this);
+          m_drainWaiters->Add (this);
           return;
         }
-      Ptr<Packet> data = Create<Packet> ();
-      while (m_flushQueue.size () > 0 && data->GetSize () + m_flushQueue.front ()->GetSize () <= 1400)
-        {
-          data->AddAtEnd (m_flushQueue.front ());
-          m_flushQueue.pop ();
-        }
+      Ptr<Packet> data = CellPool::Gather (m_flushQueue, 1400);
       m_socket->SendTo (data,0,m_remote);
     }
 }
@@ -89,7 +110,79 @@ UdpChannel::ScheduleFlush (bool delay)
     }
 }
 
-BktapCircuit::BktapCircuit (uint16_t id) : BaseCircuit (id)
+/* The feedback of circ goes out with the next flush of this channel. */
+void
+UdpChannel::AddFeedback (Ptr<BktapCircuit> circ)
+{
+  Ptr<SeqQueue> queue = circ->GetQueue (circ->GetDirection (this));
+  if (!queue->feedbackPending)
+    {
+      queue->feedbackPending = true;
+      m_feedbackCircuits.push_back (circ);
+    }
+}
+
+/* Queue the feedback of all circuits as blocks of FdbkCellHeaders, each
+ * at most the size of a cell. */
+void
+UdpChannel::PushFeedback ()
+{
+  m_feedbackTimer.Cancel ();
+  vector<FdbkCellHeader> block;
+  uint32_t maxEntries = (CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE) / FdbkCellHeader ().GetSerializedSize ();
+  for (uint32_t i = 0; i < m_feedbackCircuits.size (); i++)
+    {
+      Ptr<BktapCircuit> circ = m_feedbackCircuits[i];
+      CellDirection direction = circ->GetDirection (this);
+      Ptr<SeqQueue> queue = circ->GetQueue (direction);
+      queue->feedbackPending = false;
+      while (queue->ackq.size () > 0 || queue->fwdq.size () > 0)
+        {
+          FdbkCellHeader header;
+          header.circId = circ->GetLinkId (direction);
+          if (queue->ackq.size () > 0)
+            {
+              header.flags |= ACK;
+              while (queue->ackq.size () > 0 && header.ack < queue->ackq.front ())
+                {
+                  header.ack = queue->ackq.front ();
+                  queue->ackq.pop ();
+                }
+            }
+          if (queue->fwdq.size () > 0)
+            {
+              header.flags |= FWD;
+              header.fwd = queue->fwdq.front ();
+              queue->fwdq.pop ();
+            }
+          block.push_back (header);
+          if (block.size () == maxEntries)
+            {
+              QueueFeedbackBlock (block);
+            }
+        }
+    }
+  QueueFeedbackBlock (block);
+  m_feedbackCircuits.clear ();
+}
+
+void
+UdpChannel::QueueFeedbackBlock (vector<FdbkCellHeader> &block)
+{
+  if (block.size () == 0)
+    {
+      return;
+    }
+  Ptr<Packet> cell = CellPool::Acquire (0);
+  for (uint32_t i = block.size (); i > 0; i--)
+    {
+      cell->AddHeader (block[i - 1]);
+    }
+  m_flushQueue.push (cell);
+  block.clear ();
+}
+
+BktapCircuit::BktapCircuit (uint32_t id) : BaseCircuit (id)
 {
   inboundQueue = Create<SeqQueue> ();
   outboundQueue = Create<SeqQueue> ();
@@ -121,6 +214,12 @@ BktapCircuit::GetChannel (CellDirection direction)
     }
 }
 
+uint16_t
+BktapCircuit::GetLinkId (CellDirection direction)
+{
+  return direction == OUTBOUND ? outboundId : inboundId;
+}
+
 Ptr<SeqQueue>
 BktapCircuit::GetQueue (CellDirection direction)
 {
@@ -153,6 +252,10 @@ TorBktapApp::GetTypeId (void)
     .AddAttribute ("Nagle", "Enable the Nagle Algorithm for BackTap.",
                    BooleanValue (false),
                    MakeBooleanAccessor (&TorBktapApp::m_nagle),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Pacing", "Spread the new cells of each circuit at cwnd/RTT instead of sending whole windows back-to-back.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&TorBktapApp::m_pacing),
                    MakeBooleanChecker ());
   return tid;
 }
@@ -164,18 +267,22 @@ TorBktapApp::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p
   TorBaseApp::AddCircuit (id, n_ip, n_conntype, p_ip, p_conntype);
 
   // ensure unique circ_id
-  NS_ASSERT (circuits[id] == 0);
+  NS_ASSERT (!circuits.Get (id));
 
   Ptr<BktapCircuit> circ = Create<BktapCircuit> (id);
-  circuits[id] = circ;
-  baseCircuits[id] = circ;
+  circuits.Add (id, circ);
+  baseCircuits.Add (id, circ);
+  circ->inboundQueue->retxTimer.SetFunction (&TorBktapApp::Rto, this, PeekPointer (circ), INBOUND);
+  circ->outboundQueue->retxTimer.SetFunction (&TorBktapApp::Rto, this, PeekPointer (circ), OUTBOUND);
+  circ->inboundQueue->paceTimer.SetFunction (&TorBktapApp::PaceTimeout, this, PeekPointer (circ), INBOUND);
+  circ->outboundQueue->paceTimer.SetFunction (&TorBktapApp::PaceTimeout, this, PeekPointer (circ), OUTBOUND);
 
   circ->inbound = AddChannel (InetSocketAddress (p_ip,9001),p_conntype);
-  circ->inbound->circuits.push_back (circ);
+  circ->inboundId = circ->inbound->AddCircuit (circ);
   circ->inbound->SetSocket (clientSocket);
 
   circ->outbound = AddChannel (InetSocketAddress (n_ip,9001),n_conntype);
-  circ->outbound->circuits.push_back (circ);
+  circ->outboundId = circ->outbound->AddCircuit (circ);
 
 }
 
@@ -187,6 +294,7 @@ TorBktapApp::AddChannel (Address remote, int conntype)
   if (!ch)
     {
       ch = Create<UdpChannel> (remote, conntype);
+      ch->m_feedbackTimer.SetFunction (&UdpChannel::Flush, PeekPointer (ch));
       channels[remote] = ch;
     }
   return ch;
@@ -198,19 +306,18 @@ TorBktapApp::StartApplication (void)
   //tor proposal #183: smooth bursts & get queued data out earlier
   m_refilltime = MilliSeconds (10);
   TorBaseApp::StartApplication ();
-  m_readbucket.SetRefilledCallback (MakeCallback (&TorBktapApp::RefillReadCallback, this));
-  m_writebucket.SetRefilledCallback (MakeCallback (&TorBktapApp::RefillWriteCallback, this));
-
-  circit = circuits.begin ();
+  m_readbucket.SetRefilledCallback (MakeCallback (&TorBktapApp::RefillReadCallback, this), true);
+  m_writebucket.SetRefilledCallback (MakeCallback (&TorBktapApp::RefillWriteCallback, this), true);
 
   m_devQ = GetNode ()->GetDevice (0)->GetObject<PointToPointNetDevice> ()->GetQueue ();
   UintegerValue limit;
   m_devQ->GetAttribute ("MaxPackets", limit);
   m_devQlimit = limit.Get ();
+  m_drainWaiters.Start (m_devQ, m_devQlimit);
 
   if (m_socket == 0)
     {
-      m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+      m_socket = CreateSocket (UdpSocketFactory::GetTypeId ());
       m_socket->Bind (m_local);
     }
 
@@ -231,6 +338,7 @@ TorBktapApp::StartApplication (void)
           ch->SetSocket (m_socket);
           ch->m_devQ = m_devQ;
           ch->m_devQlimit = m_devQlimit;
+          ch->m_drainWaiters = &m_drainWaiters;
         }
 
       // PseudoSockets only
@@ -253,6 +361,8 @@ TorBktapApp::StartApplication (void)
             }
         }
     }
+
+  IndexChannels ();
 }
 
 void
@@ -261,21 +371,19 @@ TorBktapApp::StopApplication (void)
   m_socket->Close ();
   m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
   m_socket->SetDataSentCallback (MakeNullCallback<void, Ptr<Socket>, uint32_t > ());
+  m_drainWaiters.Stop ();
+  m_timers.Clear ();
 }
 
 void
 TorBktapApp::RefillReadCallback (int64_t prev_read_bucket)
 {
-  vector<Ptr<Socket> > v;
-  map<Address,Ptr<UdpChannel> >::iterator it;
-  for ( it = channels.begin (); it != channels.end (); it++ )
+  vector<Ptr<UdpChannel> > starved;
+  starved.swap (m_starvedReads);
+  for (uint32_t i = 0; i < starved.size (); i++)
     {
-      Ptr<Socket> socket = it->second->m_socket;
-      if (std::find (v.begin (), v.end (),socket) == v.end ())
-        {
-          Simulator::Schedule (Seconds (0), &TorBktapApp::ReadCallback, this, it->second->m_socket);
-          v.push_back (socket);
-        }
+      starved[i]->m_readStarved = false;
+      Simulator::Schedule (Seconds (0), &TorBktapApp::ReadCallback, this, starved[i]->m_socket);
     }
 }
 
@@ -325,7 +433,7 @@ TorBktapApp::ReadFromRelay (Ptr<Socket> socket)
             {
               BaseCellHeader header;
               data->PeekHeader (header);
-              Ptr<BktapCircuit> circ = circuits[header.circId];
+              Ptr<BktapCircuit> circ = ch->GetCircuit (header.circId);
               NS_ASSERT (circ);
               CellDirection direction = circ->GetDirection (ch);
               CellDirection oppdir = circ->GetOppositeDirection (direction);
@@ -345,7 +453,7 @@ TorBktapApp::ReadFromRelay (Ptr<Socket> socket)
                 }
               else
                 {
-                  Ptr<Packet> cell = data->CreateFragment (0,CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
+                  Ptr<Packet> cell = CellPool::Fragment (data, 0, CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
                   data->RemoveAtStart (CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
                   circ->IncrementStats (oppdir,cell->GetSize (),0);
                   ReceivedRelayCell (circ,oppdir,cell);
@@ -362,10 +470,18 @@ TorBktapApp::ReceivedRelayCell (Ptr<BktapCircuit> circ, CellDirection direction,
   Ptr<SeqQueue> queue = circ->GetQueue (direction);
   UdpCellHeader header;
   cell->PeekHeader (header);
+  // switch to the id the circuit has on the next link
+  if (circ->GetChannel (direction)->SpeaksCells () && header.circId != circ->GetLinkId (direction))
+    {
+      cell->RemoveHeader (header);
+      header.circId = circ->GetLinkId (direction);
+      cell->AddHeader (header);
+    }
   bool newseq = queue->Add (cell, header.seq);
   if (newseq) {
     m_readbucket.Decrement(cell->GetSize());
   }
+  AddReady (circ, direction);
   CellDirection oppdir = circ->GetOppositeDirection (direction);
   SendFeedbackCell (circ, oppdir, ACK, queue->tailSeq + 1);
 }
@@ -390,6 +506,7 @@ TorBktapApp::ReceivedAck (Ptr<BktapCircuit> circ, CellDirection direction, FdbkC
       //NewAck
       queue->dupackcnt = 0;
       queue->DiscardUpTo (header.ack);
+      AddReady (circ, direction);
       Time rtt = queue->actRtt.EstimateRtt (header.ack);
       ScheduleRto (circ,direction,true);
       if (!queue->PackageInflight ())
@@ -468,6 +585,7 @@ TorBktapApp::ReceivedFwd (Ptr<BktapCircuit> circ, CellDirection direction, FdbkC
     {
       //TODO test different slow start schemes
     }
+  AddReady (circ, direction);
 
   CellDirection oppdir = circ->GetOppositeDirection (direction);
   ch = circ->GetChannel (oppdir);
@@ -505,6 +623,13 @@ TorBktapApp::ReadFromEdge (Ptr<Socket> socket)
       PackageRelayCell (circ, oppdir, data);
     }
 
+  // ReceivedFwd reopens a full window; the refill wakes reads that emptied the bucket
+  if (socket->GetRxAvailable () >= CELL_PAYLOAD_SIZE && m_readbucket.GetSize () == 0 && !ch->m_readStarved)
+    {
+      ch->m_readStarved = true;
+      m_starvedReads.push_back (ch);
+    }
+
   return read_bytes;
 }
 
@@ -512,7 +637,7 @@ void
 TorBktapApp::PackageRelayCell (Ptr<BktapCircuit> circ, CellDirection direction, Ptr<Packet> cell)
 {
   UdpCellHeader header;
-  header.circId = circ->GetId ();
+  header.circId = circ->GetLinkId (direction);
   Ptr<SeqQueue> queue = circ->GetQueue (direction);
   NS_ASSERT (queue);
   header.seq = queue->tailSeq + 1;
@@ -520,6 +645,7 @@ TorBktapApp::PackageRelayCell (Ptr<BktapCircuit> circ, CellDirection direction,
   queue->virtRtt.SentSeq (header.seq);
   queue->actRtt.SentSeq (header.seq);
   queue->Add (cell, header.seq);
+  AddReady (circ, direction);
 }
 
 void
@@ -531,21 +657,39 @@ TorBktapApp::SocketWriteCallback (Ptr<Socket> s, uint32_t i)
     }
 }
 
+/* Serves the ready queues in deficit round robin, with a quantum of one
+ * relay cell. Queues that are no longer sendable, or held back by the
+ * pacer, leave the list and lose their deficit. */
 void
 TorBktapApp::WriteCallback ()
 {
   uint32_t bytes_written = 0;
 
-  if (m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE)
+  while (bytes_written == 0 && m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE && m_readyQueues.size () > 0)
     {
-      Ptr<BktapCircuit> start = circit->second;
-      Ptr<BktapCircuit> circ;
+      Ptr<BktapCircuit> circ = m_readyQueues.front ().first;
+      CellDirection direction = m_readyQueues.front ().second;
+      m_readyQueues.pop_front ();
+      Ptr<SeqQueue> queue = circ->GetQueue (direction);
+      queue->ready = false;
 
-      while (bytes_written == 0 && start != circ)
+      queue->deficit += CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE;
+      while (queue->deficit > 0 && queue->Sendable () && !Paced (circ, direction)
+             && m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE)
         {
-          circ = GetNextCircuit ();
-          bytes_written += FlushPendingCell (circ,INBOUND);
-          bytes_written += FlushPendingCell (circ,OUTBOUND);
+          uint32_t bytes = FlushPendingCell (circ, direction);
+          queue->deficit -= bytes;
+          bytes_written += bytes;
+        }
+
+      if (queue->Sendable () && !Paced (circ, direction))
+        {
+          queue->ready = true;
+          m_readyQueues.push_back (make_pair (circ, direction));
+        }
+      else
+        {
+          queue->deficit = 0;
         }
     }
 
@@ -561,6 +705,44 @@ TorBktapApp::WriteCallback ()
 
 
 
+void
+TorBktapApp::AddReady (Ptr<BktapCircuit> circ, CellDirection direction)
+{
+  Ptr<SeqQueue> queue = circ->GetQueue (direction);
+  if (!queue->ready && queue->Sendable () && !Paced (circ, direction))
+    {
+      queue->ready = true;
+      m_readyQueues.push_back (make_pair (circ, direction));
+    }
+}
+
+/* With pacing, whether the queue has to wait before its next new cell.
+ * The pace timer then lists it again. */
+bool
+TorBktapApp::Paced (Ptr<BktapCircuit> circ, CellDirection direction)
+{
+  Ptr<SeqQueue> queue = circ->GetQueue (direction);
+  if (!m_pacing || queue->nextPaced <= Simulator::Now ())
+    {
+      return false;
+    }
+  if (queue->paceTimer.IsExpired ())
+    {
+      m_timers.Schedule (queue->paceTimer, queue->nextPaced - Simulator::Now ());
+    }
+  return true;
+}
+
+void
+TorBktapApp::PaceTimeout (Ptr<BktapCircuit> circ, CellDirection direction)
+{
+  AddReady (circ, direction);
+  if (writeevent.IsExpired ())
+    {
+      writeevent = Simulator::ScheduleNow (&TorBktapApp::WriteCallback, this);
+    }
+}
+
 uint32_t
 TorBktapApp::FlushPendingCell (Ptr<BktapCircuit> circ, CellDirection direction, bool retx)
 {
@@ -603,6 +785,13 @@ TorBktapApp::FlushPendingCell (Ptr<BktapCircuit> circ, CellDirection direction,
       int bytes_written = cell->GetSize ();
       ch->ScheduleFlush (m_nagle && queue->PackageInflight ());
 
+      // a window over 4/5 of the RTT, so that the pacer does not hold the
+      // circuit below cwnd/RTT
+      if (m_pacing && !retx && ch->SpeaksCells () && queue->virtRtt.estimatedRtt > 0)
+        {
+          queue->nextPaced = Simulator::Now () + queue->virtRtt.estimatedRtt * 4 / (int64_t) (5 * max (queue->cwnd, 1u));
+        }
+
       if (ch->SpeaksCells ())
         {
           ScheduleRto (circ,direction,true);
@@ -644,66 +833,35 @@ TorBktapApp::SendFeedbackCell (Ptr<BktapCircuit> circ, CellDirection direction,
         {
           queue->fwdq.push (ack);
         }
+      ch->AddFeedback (circ);
       if (queue->ackq.size () > 0 && queue->fwdq.size () > 0)
         {
-          queue->delFeedbackEvent.Cancel ();
-          PushFeedbackCell (circ, direction);
+          ch->PushFeedback ();
+          ch->ScheduleFlush ();
         }
-      else
+      else if (ch->m_feedbackTimer.IsExpired ())
         {
-          queue->delFeedbackEvent = Simulator::Schedule (MilliSeconds (1), &TorBktapApp::PushFeedbackCell, this, circ, direction);
+          // unless data leaves earlier and takes it along
+          m_timers.Schedule (ch->m_feedbackTimer, MilliSeconds (1));
         }
     }
 }
 
-void
-TorBktapApp::PushFeedbackCell (Ptr<BktapCircuit> circ, CellDirection direction)
-{
-  Ptr<UdpChannel> ch = circ->GetChannel (direction);
-  Ptr<SeqQueue> queue = circ->GetQueue (direction);
-  NS_ASSERT (ch);
-
-  while (queue->ackq.size () > 0 || queue->fwdq.size () > 0)
-    {
-      Ptr<Packet> cell = Create<Packet> ();
-      FdbkCellHeader header;
-      header.circId = circ->GetId ();
-      if (queue->ackq.size () > 0)
-        {
-          header.flags |= ACK;
-          while (queue->ackq.size () > 0 && header.ack < queue->ackq.front ())
-            {
-              header.ack = queue->ackq.front ();
-              queue->ackq.pop ();
-            }
-        }
-      if (queue->fwdq.size () > 0)
-        {
-          header.flags |= FWD;
-          header.fwd = queue->fwdq.front ();
-          queue->fwdq.pop ();
-        }
-      cell->AddHeader (header);
-      ch->m_flushQueue.push (cell);
-      ch->ScheduleFlush ();
-    }
-}
-
 void
 TorBktapApp::ScheduleRto (Ptr<BktapCircuit> circ, CellDirection direction, bool force)
 {
   Ptr<SeqQueue> queue = circ->GetQueue (direction);
   if (force)
     {
-      queue->retxEvent.Cancel ();
+      queue->retxTimer.Cancel ();
     }
   if (queue->Inflight () <= 0)
     {
       return;
     }
-  if (queue->retxEvent.IsExpired ())
+  if (queue->retxTimer.IsExpired ())
     {
-      queue->retxEvent = Simulator::Schedule (queue->actRtt.Rto (), &TorBktapApp::Rto, this, circ, direction);
+      m_timers.Schedule (queue->retxTimer, queue->actRtt.Rto ());
     }
 }
 
@@ -713,38 +871,44 @@ TorBktapApp::Rto (Ptr<BktapCircuit> circ, CellDirection direction)
   Ptr<SeqQueue> queue = circ->GetQueue (direction);
   queue->nextTxSeq = queue->headSeq;
   FlushPendingCell (circ,direction);
+  AddReady (circ, direction);
 }
 
 Ptr<BktapCircuit>
-TorBktapApp::GetCircuit (uint16_t id)
+TorBktapApp::GetCircuit (uint32_t id)
 {
-  return circuits[id];
+  return circuits.Get (id);
 }
 
-Ptr<BktapCircuit>
-TorBktapApp::GetNextCircuit ()
+Ptr<UdpChannel>
+TorBktapApp::LookupChannel (Ptr<Socket> socket)
 {
-  ++circit;
-  if (circit == circuits.end ())
+  sgi::hash_map<Ptr<Socket>,Ptr<UdpChannel>,SocketHash>::iterator it;
+  it = m_socketChannels.find (socket);
+  if (it != m_socketChannels.end ())
     {
-      circit = circuits.begin ();
+      return it->second;
     }
-  return circit->second;
+  return NULL;
 }
 
-Ptr<UdpChannel>
-TorBktapApp::LookupChannel (Ptr<Socket> socket)
+// Sockets are handed out in StartApplication and do not change afterwards.
+// Relay channels share m_socket; like the old linear scan, that socket maps
+// to the first channel in address order.
+void
+TorBktapApp::IndexChannels ()
 {
+  m_socketChannels.clear ();
   map<Address,Ptr<UdpChannel> >::iterator it;
   for ( it = channels.begin (); it != channels.end (); it++ )
     {
       NS_ASSERT (it->second);
-      if (it->second->m_socket == socket)
+      Ptr<Socket> socket = it->second->m_socket;
+      if (socket && m_socketChannels.find (socket) == m_socketChannels.end ())
         {
-          return it->second;
+          m_socketChannels[socket] = it->second;
         }
     }
-  return NULL;
 }
 
 void
@@ -752,18 +916,22 @@ TorBktapApp::DoDispose (void)
 {
   NS_LOG_FUNCTION (this);
 
-  map<uint16_t,Ptr<BktapCircuit> >::iterator i;
+  CircuitTable<BktapCircuit>::Iterator i;
   for (i = circuits.begin (); i != circuits.end (); ++i)
     {
-      i->second->inbound = 0;
-      i->second->outbound = 0;
-      i->second->inboundQueue = 0;
-      i->second->outboundQueue = 0;
+      (*i)->inbound = 0;
+      (*i)->outbound = 0;
+      (*i)->inboundQueue = 0;
+      (*i)->outboundQueue = 0;
 
     }
   circuits.clear ();
   baseCircuits.clear ();
   channels.clear ();
+  m_socketChannels.clear ();
+  m_starvedReads.clear ();
+  m_drainWaiters.Clear ();
+  m_timers.Clear ();
   Application::DoDispose ();
 }
 
@@ -4,6 +4,7 @@
 #include "tor-base.h"
 #include "cell-header.h"
 #include "bktap-base.h"
+#include "tor-timer-wheel.h"
 
 #include "ns3/point-to-point-net-device.h"
 
@@ -353,17 +354,21 @@ public:
   uint32_t virtHeadSeq;
   uint32_t begRttSeq;
   uint32_t dupackcnt;
-  map< uint32_t, Ptr<Packet> > cellMap;
+  CellRing cells;
 
   bool wasRetransmit;
 
   queue<uint32_t> ackq;
   queue<uint32_t> fwdq;
-  EventId delFeedbackEvent;
+  bool feedbackPending; // listed in the channel's m_feedbackCircuits
+  bool ready;           // listed in the app's m_readyQueues
+  int32_t deficit;      // bytes this queue may still write in its DRR turn
 
   SimpleRttEstimator virtRtt;
   SimpleRttEstimator actRtt;
-  EventId retxEvent;
+  TorTimer retxTimer;
+  TorTimer paceTimer;
+  Time nextPaced;       // no new cell before then, with pacing
 
   SeqQueue ()
   {
@@ -376,6 +381,9 @@ public:
     begRttSeq = 1;
     ssthresh = pow (2,10);
     dupackcnt = 0;
+    feedbackPending = false;
+    ready = false;
+    deficit = 0;
   }
 
   // IMPORTANT: return value is now true if the cell is new, else false
@@ -383,17 +391,17 @@ public:
   bool
   Add ( Ptr<Packet> cell, uint32_t seq )
   {
-    if (tailSeq < seq && cellMap.find(seq) == cellMap.end())
+    if (tailSeq < seq && !cells.Has (seq))
       {
-        cellMap[seq] = cell;
-        while (cellMap.find (tailSeq + 1) != cellMap.end ())
+        cells.Insert (seq, cell);
+        while (cells.Has (tailSeq + 1))
           {
             ++tailSeq;
           }
 
         if (headSeq == 0)
           {
-            headSeq = virtHeadSeq = cellMap.begin ()->first;
+            headSeq = virtHeadSeq = cells.Lowest ();
           }
 
         return true;
@@ -405,9 +413,9 @@ public:
   GetCell (uint32_t seq)
   {
     Ptr<Packet> cell;
-    if (cellMap.find (seq) != cellMap.end ())
+    if (cells.Has (seq))
       {
-        cell = cellMap[seq];
+        cell = cells.Get (seq);
       }
     wasRetransmit = true; //implicitely assume that it is a retransmit
     return cell;
@@ -417,9 +425,9 @@ public:
   GetNextCell ()
   {
     Ptr<Packet> cell;
-    if (cellMap.find (nextTxSeq) != cellMap.end ())
+    if (cells.Has (nextTxSeq))
       {
-        cell = cellMap[nextTxSeq];
+        cell = cells.Get (nextTxSeq);
         ++nextTxSeq;
       }
 
@@ -445,9 +453,9 @@ public:
   void
   DiscardUpTo (uint32_t seq)
   {
-    while (cellMap.find (seq - 1) != cellMap.end ())
+    while (cells.Has (seq - 1))
       {
-        cellMap.erase (seq - 1);
+        cells.Erase (seq - 1);
         ++headSeq;
         --seq;
       }
@@ -490,6 +498,13 @@ public:
     return headSeq != highestTxSeq;
   }
 
+  // a cell that FlushPendingCell would write now
+  bool
+  Sendable ()
+  {
+    return Window () > 0 && cells.Has (nextTxSeq);
+  }
+
 };
 
 
@@ -502,18 +517,29 @@ public:
   void SetSocket (Ptr<Socket>);
   uint8_t GetType ();
   bool SpeaksCells ();
+  uint16_t AddCircuit (Ptr<BktapCircuit>);
+  Ptr<BktapCircuit> GetCircuit (uint16_t);
 
   void ScheduleFlush (bool=false);
   void Flush ();
+  void AddFeedback (Ptr<BktapCircuit>);
+  void PushFeedback ();
+  void QueueFeedbackBlock (vector<FdbkCellHeader>&);
   EventId m_flushEvent;
+  TorTimer m_feedbackTimer;
   queue<Ptr<Packet> > m_flushQueue;
+  // Circuits with ACK/FWD numbers for the other end, oldest first
+  vector<Ptr<BktapCircuit> > m_feedbackCircuits;
   Ptr<Queue> m_devQ;
   uint32_t m_devQlimit;
+  bool m_flushBlocked;
+  DeviceQueueWaiters<UdpChannel> *m_drainWaiters;
 
   Ptr<Socket> m_socket;
   Address m_remote;
   uint8_t m_conntype;
-  list<Ptr<BktapCircuit> > circuits;
+  bool m_readStarved;
+  vector<Ptr<BktapCircuit> > circuits; // indexed by link-local circuit id
   SimpleRttEstimator rttEstimator;
 };
 
@@ -521,11 +547,13 @@ public:
 class BktapCircuit : public BaseCircuit
 {
 public:
-  BktapCircuit (uint16_t);
+  BktapCircuit (uint32_t);
   // ~BktapCircuit();
 
   Ptr<UdpChannel> inbound;
   Ptr<UdpChannel> outbound;
+  uint16_t inboundId; // link-local ids
+  uint16_t outboundId;
 
   Ptr<SeqQueue> inboundQueue;
   Ptr<SeqQueue> outboundQueue;
@@ -533,6 +561,7 @@ public:
   CellDirection GetDirection (Ptr<UdpChannel>);
   Ptr<SeqQueue> GetQueue (CellDirection);
   Ptr<UdpChannel> GetChannel (CellDirection direction);
+  uint16_t GetLinkId (CellDirection);
 };
 
 
@@ -550,16 +579,19 @@ public:
   void RefillWriteCallback (int64_t);
 
   Ptr<UdpChannel> AddChannel (Address, int);
-  Ptr<BktapCircuit> GetCircuit (uint16_t);
-  Ptr<BktapCircuit> GetNextCircuit ();
+  Ptr<BktapCircuit> GetCircuit (uint32_t);
   virtual void AddCircuit (int, Ipv4Address, int, Ipv4Address, int,
                            Ptr<PseudoClientSocket> clientSocket = 0);
 
   Ptr<Socket> m_socket;
 
   map<Address,Ptr<UdpChannel> > channels;
-  map<uint16_t,Ptr<BktapCircuit> > circuits;
-  map<uint16_t,Ptr<BktapCircuit> >::iterator circit;
+  sgi::hash_map<Ptr<Socket>,Ptr<UdpChannel>,SocketHash> m_socketChannels;
+  // Edge channels whose reading stopped at an empty read bucket, oldest first
+  vector<Ptr<UdpChannel> > m_starvedReads;
+  CircuitTable<BktapCircuit> circuits;
+  // Circuit queues with a sendable cell, in DRR order
+  deque<pair<Ptr<BktapCircuit>,CellDirection> > m_readyQueues;
 
   void ReadCallback (Ptr<Socket>);
   uint32_t ReadFromEdge (Ptr<Socket>);
@@ -570,21 +602,27 @@ public:
   void ReceivedFwd (Ptr<BktapCircuit>, CellDirection, FdbkCellHeader);
   void CongestionAvoidance (Ptr<SeqQueue>, Time);
   Ptr<UdpChannel> LookupChannel (Ptr<Socket>);
+  void IndexChannels ();
 
   void SocketWriteCallback (Ptr<Socket>, uint32_t);
   void WriteCallback ();
+  void AddReady (Ptr<BktapCircuit>, CellDirection);
   uint32_t FlushPendingCell (Ptr<BktapCircuit>, CellDirection,bool = false);
   void SendFeedbackCell (Ptr<BktapCircuit>, CellDirection, uint8_t, uint32_t);
-  void PushFeedbackCell (Ptr<BktapCircuit>, CellDirection);
   void ScheduleRto (Ptr<BktapCircuit>, CellDirection, bool = false);
   void Rto (Ptr<BktapCircuit>, CellDirection);
+  bool Paced (Ptr<BktapCircuit>, CellDirection);
+  void PaceTimeout (Ptr<BktapCircuit>, CellDirection);
 
   bool m_nagle;
+  bool m_pacing;
 
   EventId writeevent;
   EventId readevent;
   Ptr<Queue> m_devQ;
   uint32_t m_devQlimit;
+  DeviceQueueWaiters<UdpChannel> m_drainWaiters;
+  TorTimerWheel m_timers;
 };
 
 
@@ -15,6 +15,9 @@ E2eUdpChannel::E2eUdpChannel ()
 {
   NS_LOG_FUNCTION (this);
   this->m_socket = 0;
+  this->m_readStarved = false;
+  this->m_flushBlocked = false;
+  this->m_drainWaiters = 0;
 }
 
 E2eUdpChannel::E2eUdpChannel (Address remote, int conntype)
@@ -22,6 +25,9 @@ E2eUdpChannel::E2eUdpChannel (Address remote, int conntype)
   m_remote = remote;
   m_conntype = conntype;
   this->m_socket = 0;
+  this->m_readStarved = false;
+  this->m_flushBlocked = false;
+  this->m_drainWaiters = 0;
 }
 
 void
@@ -42,17 +48,30 @@ E2eUdpChannel::SpeaksCells ()
   return m_conntype == RELAYEDGE;
 }
 
+uint16_t
+E2eUdpChannel::AddCircuit (Ptr<E2eCircuit> circ)
+{
+  NS_ABORT_MSG_IF (circuits.size () > 0xffff, "More than 65536 circuits on channel");
+  circuits.push_back (circ);
+  return circuits.size () - 1;
+}
+
+Ptr<E2eCircuit>
+E2eUdpChannel::GetCircuit (uint16_t id)
+{
+  return id < circuits.size () ? circuits[id] : 0;
+}
+
 void E2eUdpChannel::Flush () {
+  if (m_feedbackCircuits.size () > 0) {
+      PushFeedback ();
+  }
   while (m_flushQueue.size () > 0) {
       if (SpeaksCells () && m_devQlimit <= m_devQ->GetNPackets ()) {
-          m_flushEvent = Simulator::Schedule (MilliSeconds (1), &E2eUdpChannel::Flush, this);
+          m_drainWaiters->Add (this);
           return;
       }
-      Ptr<Packet> data = Create<Packet> ();
-      while (m_flushQueue.size () > 0 && data->GetSize () + m_flushQueue.front ()->GetSize () <= 1400) {
-          data->AddAtEnd (m_flushQueue.front ());
-          m_flushQueue.pop ();
-      }
+      Ptr<Packet> data = CellPool::Gather (m_flushQueue, 1400);
       m_socket->SendTo (data,0,m_remote);
   }
 }
@@ -86,7 +105,76 @@ E2eUdpChannel::ScheduleFlush (bool delay)
 
 
 
-E2eCircuit::E2eCircuit (uint16_t id) : BaseCircuit (id)
+/* The feedback of circ goes out with the next flush of this channel. */
+void
+E2eUdpChannel::AddFeedback (Ptr<E2eCircuit> circ)
+{
+  Ptr<E2eSeqQueue> queue = circ->GetQueue (circ->GetDirection (this));
+  if (!queue->feedbackPending) {
+      queue->feedbackPending = true;
+      m_feedbackCircuits.push_back (circ);
+  }
+}
+
+/* Queue the feedback of all circuits as blocks of E2eFdbkCellHeaders,
+ * each at most the size of a cell. */
+void
+E2eUdpChannel::PushFeedback ()
+{
+  m_feedbackTimer.Cancel ();
+  vector<E2eFdbkCellHeader> block;
+  uint32_t maxEntries = (CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE) / E2eFdbkCellHeader ().GetSerializedSize ();
+  for (uint32_t i = 0; i < m_feedbackCircuits.size (); i++) {
+      Ptr<E2eCircuit> circ = m_feedbackCircuits[i];
+      CellDirection direction = circ->GetDirection (this);
+      Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
+      queue->feedbackPending = false;
+      while (queue->ackq.size () > 0 || queue->fwdq.size () > 0) {
+          E2eFdbkCellHeader header;
+          header.circId = circ->GetLinkId (direction);
+          if (queue->ackq.size () > 0)
+            {
+              header.flags |= ACK;
+              while (queue->ackq.size () > 0 && header.ack < queue->ackq.front ())
+                {
+                  header.ack = queue->ackq.front ();
+                  queue->ackq.pop ();
+                }
+            }
+          if (queue->fwdq.size () > 0) {
+              header.flags |= FWD;
+              header.fwd = queue->fwdq.front ();
+              if (queue->fwdCE.front ()) {
+                  header.CE = 1;
+              }
+              queue->fwdq.pop ();
+              queue->fwdCE.pop ();
+          }
+          block.push_back (header);
+          if (block.size () == maxEntries) {
+              QueueFeedbackBlock (block);
+          }
+      }
+  }
+  QueueFeedbackBlock (block);
+  m_feedbackCircuits.clear ();
+}
+
+void
+E2eUdpChannel::QueueFeedbackBlock (vector<E2eFdbkCellHeader> &block)
+{
+  if (block.size () == 0) {
+      return;
+  }
+  Ptr<Packet> cell = CellPool::Acquire (0);
+  for (uint32_t i = block.size (); i > 0; i--) {
+      cell->AddHeader (block[i - 1]);
+  }
+  m_flushQueue.push (cell);
+  block.clear ();
+}
+
+E2eCircuit::E2eCircuit (uint32_t id) : BaseCircuit (id)
 {
   inboundQueue = Create<E2eSeqQueue> ();
   outboundQueue = Create<E2eSeqQueue> ();
@@ -118,6 +206,12 @@ E2eCircuit::GetChannel (CellDirection direction)
     }
 }
 
+uint16_t
+E2eCircuit::GetLinkId (CellDirection direction)
+{
+  return direction == OUTBOUND ? outboundId : inboundId;
+}
+
 Ptr<E2eSeqQueue>
 E2eCircuit::GetQueue (CellDirection direction)
 {
@@ -150,6 +244,10 @@ TorE2eApp::GetTypeId (void)
     .AddAttribute ("Nagle", "Enable the Nagle Algorithm for BackTap.",
                    BooleanValue (false),
                    MakeBooleanAccessor (&TorE2eApp::m_nagle),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Pacing", "Spread the new cells of each circuit at cwnd/RTT instead of sending whole windows back-to-back.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&TorE2eApp::m_pacing),
                    MakeBooleanChecker ());
   return tid;
 }
@@ -160,18 +258,22 @@ TorE2eApp::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p_i
   TorBaseApp::AddCircuit (id, n_ip, n_conntype, p_ip, p_conntype);
 
   // ensure unique circ_id
-  NS_ASSERT (circuits[id] == 0);
+  NS_ASSERT (!circuits.Get (id));
 
   Ptr<E2eCircuit> circ = Create<E2eCircuit> (id);
-  circuits[id] = circ;
-  baseCircuits[id] = circ;
+  circuits.Add (id, circ);
+  baseCircuits.Add (id, circ);
+  circ->inboundQueue->retxTimer.SetFunction (&TorE2eApp::Rto, this, PeekPointer (circ), INBOUND);
+  circ->outboundQueue->retxTimer.SetFunction (&TorE2eApp::Rto, this, PeekPointer (circ), OUTBOUND);
+  circ->inboundQueue->paceTimer.SetFunction (&TorE2eApp::PaceTimeout, this, PeekPointer (circ), INBOUND);
+  circ->outboundQueue->paceTimer.SetFunction (&TorE2eApp::PaceTimeout, this, PeekPointer (circ), OUTBOUND);
 
   circ->inbound = AddChannel (InetSocketAddress (p_ip,9001),p_conntype);
-  circ->inbound->circuits.push_back (circ);
+  circ->inboundId = circ->inbound->AddCircuit (circ);
   circ->inbound->SetSocket (clientSocket);
 
   circ->outbound = AddChannel (InetSocketAddress (n_ip,9001),n_conntype);
-  circ->outbound->circuits.push_back (circ);
+  circ->outboundId = circ->outbound->AddCircuit (circ);
 }
 
 Ptr<E2eUdpChannel>
@@ -182,6 +284,7 @@ TorE2eApp::AddChannel (Address remote, int conntype)
   if (!ch)
     {
       ch = Create<E2eUdpChannel> (remote, conntype);
+      ch->m_feedbackTimer.SetFunction (&E2eUdpChannel::Flush, PeekPointer (ch));
       channels[remote] = ch;
     }
   return ch;
@@ -191,18 +294,17 @@ void TorE2eApp::StartApplication (void) {
   //tor proposal #183: smooth bursts & get queued data out earlier
   m_refilltime = MilliSeconds (10);
   TorBaseApp::StartApplication ();
-  m_readbucket.SetRefilledCallback (MakeCallback (&TorE2eApp::RefillReadCallback, this));
-  m_writebucket.SetRefilledCallback (MakeCallback (&TorE2eApp::RefillWriteCallback, this));
-
-  circit = circuits.begin ();
+  m_readbucket.SetRefilledCallback (MakeCallback (&TorE2eApp::RefillReadCallback, this), true);
+  m_writebucket.SetRefilledCallback (MakeCallback (&TorE2eApp::RefillWriteCallback, this), true);
 
   m_devQ = GetNode ()->GetDevice (0)->GetObject<PointToPointNetDevice> ()->GetQueue ();
   UintegerValue limit;
   m_devQ->GetAttribute ("MaxPackets", limit);
   m_devQlimit = limit.Get ();
+  m_drainWaiters.Start (m_devQ, m_devQlimit);
 
   if (m_socket == 0) {
-      m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+      m_socket = CreateSocket (UdpSocketFactory::GetTypeId ());
       m_socket->Bind (m_local);
   }
 
@@ -221,6 +323,7 @@ void TorE2eApp::StartApplication (void) {
           ch->SetSocket (m_socket);
           ch->m_devQ = m_devQ;
           ch->m_devQlimit = m_devQlimit;
+          ch->m_drainWaiters = &m_drainWaiters;
       }
 
       // PseudoSockets only
@@ -239,6 +342,8 @@ void TorE2eApp::StartApplication (void) {
           }
       }
   }
+
+  IndexChannels ();
 }
 
 void
@@ -247,21 +352,19 @@ TorE2eApp::StopApplication (void)
   m_socket->Close ();
   m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
   m_socket->SetDataSentCallback (MakeNullCallback<void, Ptr<Socket>, uint32_t > ());
+  m_drainWaiters.Stop ();
+  m_timers.Clear ();
 }
 
 void
 TorE2eApp::RefillReadCallback (int64_t prev_read_bucket)
 {
-  vector<Ptr<Socket> > v;
-  map<Address,Ptr<E2eUdpChannel> >::iterator it;
-  for ( it = channels.begin (); it != channels.end (); it++ )
+  vector<Ptr<E2eUdpChannel> > starved;
+  starved.swap (m_starvedReads);
+  for (uint32_t i = 0; i < starved.size (); i++)
     {
-      Ptr<Socket> socket = it->second->m_socket;
-      if (std::find (v.begin (), v.end (),socket) == v.end ())
-        {
-          Simulator::Schedule (Seconds (0), &TorE2eApp::ReadCallback, this, it->second->m_socket);
-          v.push_back (socket);
-        }
+      starved[i]->m_readStarved = false;
+      Simulator::Schedule (Seconds (0), &TorE2eApp::ReadCallback, this, starved[i]->m_socket);
     }
 }
 
@@ -307,7 +410,7 @@ TorE2eApp::ReadFromRelay (Ptr<Socket> socket) {
           while (data->GetSize () > 0) {
               E2eBaseCellHeader header;
               data->PeekHeader (header);
-              Ptr<E2eCircuit> circ = circuits[header.circId];
+              Ptr<E2eCircuit> circ = ch->GetCircuit (header.circId);
               NS_ASSERT (circ);
               CellDirection direction = circ->GetDirection (ch);
               CellDirection oppdir = circ->GetOppositeDirection (direction);
@@ -327,7 +430,7 @@ TorE2eApp::ReadFromRelay (Ptr<Socket> socket) {
                   }
               }
               else {
-                  Ptr<Packet> cell = data->CreateFragment (0,CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
+                  Ptr<Packet> cell = CellPool::Fragment (data, 0, CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
                   data->RemoveAtStart (CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
                   circ->IncrementStats (oppdir,cell->GetSize (),0);
                   ReceivedRelayCell (circ,oppdir,cell);
@@ -344,15 +447,20 @@ TorE2eApp::ReceivedRelayCell (Ptr<E2eCircuit> circ, CellDirection direction, Ptr
   Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
   E2eUdpCellHeader header;
   cell->PeekHeader (header);
-  if (queue->IsCongested()){
+  bool relink = circ->GetChannel (direction)->SpeaksCells () && header.circId != circ->GetLinkId (direction);
+  if (queue->IsCongested() || relink){
     cell->RemoveHeader(header);
-    header.ECN = 1;
+    header.circId = circ->GetLinkId (direction);
+    if (queue->IsCongested()) {
+      header.ECN = 1;
+    }
     cell->AddHeader(header);
   }
   bool newseq = queue->Add (cell, header.seq);
   if (newseq) {
     m_readbucket.Decrement(cell->GetSize());
   }
+  AddReady (circ, direction);
   CellDirection oppdir = circ->GetOppositeDirection (direction);
   SendFeedbackCell (circ, oppdir, ACK, queue->tailSeq + 1, false);
 }
@@ -374,6 +482,7 @@ TorE2eApp::ReceivedAck (Ptr<E2eCircuit> circ, CellDirection direction, E2eFdbkCe
       //NewAck
       queue->dupackcnt = 0;
       queue->DiscardUpTo (header.ack);
+      AddReady (circ, direction);
       Time rtt = queue->actRtt.EstimateRtt (header.ack);
       ScheduleRto (circ,direction,true);
       if (!queue->PackageInflight ()) {
@@ -483,6 +592,7 @@ TorE2eApp::ReceivedFwd (Ptr<E2eCircuit> circ, CellDirection direction, E2eFdbkCe
     //cout << GetNodeName () << " dupackcnt:" << queue->dupackcnt << endl;
 	  //cout << "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%" << endl;
 	}
+  AddReady (circ, direction);
 
 //	ch = circ->GetChannel (oppdir);
   Simulator::Schedule (Seconds (0), &TorE2eApp::ReadCallback, this, oppch->m_socket);
@@ -515,6 +625,11 @@ TorE2eApp::ReadFromEdge (Ptr<Socket> socket) {
       circ->IncrementStats (oppdir,data->GetSize (),0);
       PackageRelayCell (circ, oppdir, data);
   }
+  // ReceivedFwd reopens a full window; the refill wakes reads that emptied the bucket
+  if (socket->GetRxAvailable () >= CELL_PAYLOAD_SIZE && m_readbucket.GetSize () == 0 && !ch->m_readStarved) {
+      ch->m_readStarved = true;
+      m_starvedReads.push_back (ch);
+  }
   return read_bytes;
 }
 
@@ -522,7 +637,7 @@ void
 TorE2eApp::PackageRelayCell (Ptr<E2eCircuit> circ, CellDirection direction, Ptr<Packet> cell)
 {
   E2eUdpCellHeader header;
-  header.circId = circ->GetId ();
+  header.circId = circ->GetLinkId (direction);
   Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
   NS_ASSERT (queue);
   header.seq = queue->tailSeq + 1;
@@ -530,6 +645,7 @@ TorE2eApp::PackageRelayCell (Ptr<E2eCircuit> circ, CellDirection direction, Ptr<
   queue->virtRtt.SentSeq (header.seq);
   queue->actRtt.SentSeq (header.seq);
   queue->Add (cell, header.seq);
+  AddReady (circ, direction);
 }
 
 void
@@ -541,21 +657,38 @@ TorE2eApp::SocketWriteCallback (Ptr<Socket> s, uint32_t i)
     }
 }
 
+/* Serves the ready queues in deficit round robin, one relay cell per
+ * turn, like TorBktapApp. */
 void
 TorE2eApp::WriteCallback ()
 {
   uint32_t bytes_written = 0;
 
-  if (m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE)
+  while (bytes_written == 0 && m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE && m_readyQueues.size () > 0)
     {
-      Ptr<E2eCircuit> start = circit->second;
-      Ptr<E2eCircuit> circ;
+      Ptr<E2eCircuit> circ = m_readyQueues.front ().first;
+      CellDirection direction = m_readyQueues.front ().second;
+      m_readyQueues.pop_front ();
+      Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
+      queue->ready = false;
+
+      queue->deficit += CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE;
+      while (queue->deficit > 0 && Sendable (circ, direction) && !Paced (circ, direction)
+             && m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE)
+        {
+          uint32_t bytes = FlushPendingCell (circ, direction);
+          queue->deficit -= bytes;
+          bytes_written += bytes;
+        }
 
-      while (bytes_written == 0 && start != circ)
+      if (Sendable (circ, direction) && !Paced (circ, direction))
+        {
+          queue->ready = true;
+          m_readyQueues.push_back (make_pair (circ, direction));
+        }
+      else
         {
-          circ = GetNextCircuit ();
-          bytes_written += FlushPendingCell (circ,INBOUND);
-          bytes_written += FlushPendingCell (circ,OUTBOUND);
+          queue->deficit = 0;
         }
     }
 
@@ -570,6 +703,55 @@ TorE2eApp::WriteCallback ()
 }
 
 
+void
+TorE2eApp::AddReady (Ptr<E2eCircuit> circ, CellDirection direction)
+{
+  Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
+  if (!queue->ready && Sendable (circ, direction) && !Paced (circ, direction))
+    {
+      queue->ready = true;
+      m_readyQueues.push_back (make_pair (circ, direction));
+    }
+}
+
+/* Whether FlushPendingCell would write a cell of this queue now. Middle
+ * relays do not check the window. */
+bool
+TorE2eApp::Sendable (Ptr<E2eCircuit> circ, CellDirection direction)
+{
+  Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
+  bool middle = circ->GetChannel (direction)->SpeaksCells ()
+    && circ->GetChannel (circ->GetOppositeDirection (direction))->SpeaksCells ();
+  return (middle || queue->Window () > 0) && queue->cells.Has (queue->nextTxSeq);
+}
+
+/* With pacing, whether the queue has to wait before its next new cell.
+ * The pace timer then lists it again. */
+bool
+TorE2eApp::Paced (Ptr<E2eCircuit> circ, CellDirection direction)
+{
+  Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
+  if (!m_pacing || queue->nextPaced <= Simulator::Now ())
+    {
+      return false;
+    }
+  if (queue->paceTimer.IsExpired ())
+    {
+      m_timers.Schedule (queue->paceTimer, queue->nextPaced - Simulator::Now ());
+    }
+  return true;
+}
+
+void
+TorE2eApp::PaceTimeout (Ptr<E2eCircuit> circ, CellDirection direction)
+{
+  AddReady (circ, direction);
+  if (writeevent.IsExpired ())
+    {
+      writeevent = Simulator::ScheduleNow (&TorE2eApp::WriteCallback, this);
+    }
+}
+
 uint32_t TorE2eApp::FlushPendingCell (Ptr<E2eCircuit> circ, CellDirection direction, bool retx) {
   Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
   CellDirection oppdir = circ->GetOppositeDirection (direction);
@@ -607,6 +789,11 @@ uint32_t TorE2eApp::FlushPendingCell (Ptr<E2eCircuit> circ, CellDirection direct
       int bytes_written = cell->GetSize ();
       ch->ScheduleFlush (m_nagle && queue->PackageInflight ());
 
+      // only the edges have a window to spread, as in TorBktapApp
+      if (m_pacing && !retx && ch->SpeaksCells () && !oppch->SpeaksCells () && queue->virtRtt.estimatedRtt > 0) {
+          queue->nextPaced = Simulator::Now () + queue->virtRtt.estimatedRtt * 4 / (int64_t) (5 * max (queue->cwnd, 1u));
+      }
+
       if (ch->SpeaksCells ()) {
           ScheduleRto (circ,direction,true);
       }
@@ -648,63 +835,32 @@ TorE2eApp::SendFeedbackCell (Ptr<E2eCircuit> circ, CellDirection direction, uint
         {
           //cout << GetNodeName () << " Sending Feedback Cell" << endl;
           queue->fwdq.push (ack);
+          queue->fwdCE.push (isECN);
         }
+      ch->AddFeedback (circ);
       if (queue->ackq.size () > 0 && queue->fwdq.size () > 0)
         {
-          queue->delFeedbackEvent.Cancel ();
-          PushFeedbackCell (circ, direction,isECN);
+          ch->PushFeedback ();
+          ch->ScheduleFlush ();
         }
-      else
+      else if (ch->m_feedbackTimer.IsExpired ())
         {
-          queue->delFeedbackEvent = Simulator::Schedule (MilliSeconds (1), &TorE2eApp::PushFeedbackCell, this, circ, direction, isECN);
+          m_timers.Schedule (ch->m_feedbackTimer, MilliSeconds (1));
         }
     }
 }
 
-void
-TorE2eApp::PushFeedbackCell (Ptr<E2eCircuit> circ, CellDirection direction, bool isECN) {
-  Ptr<E2eUdpChannel> ch = circ->GetChannel (direction);
-  Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
-  NS_ASSERT (ch);
-
-  while (queue->ackq.size () > 0 || queue->fwdq.size () > 0) {
-      Ptr<Packet> cell = Create<Packet> ();
-      E2eFdbkCellHeader header;
-      header.circId = circ->GetId ();
-      if (queue->ackq.size () > 0)
-        {
-          header.flags |= ACK;
-          while (queue->ackq.size () > 0 && header.ack < queue->ackq.front ())
-            {
-              header.ack = queue->ackq.front ();
-              queue->ackq.pop ();
-            }
-        }
-      if (queue->fwdq.size () > 0) {
-          header.flags |= FWD;
-          header.fwd = queue->fwdq.front ();
-    	    if (isECN) {
-	          header.CE = 1;
-    	    }
-          queue->fwdq.pop ();
-      }
-      cell->AddHeader (header);
-      ch->m_flushQueue.push (cell);
-      ch->ScheduleFlush ();
-  }
-}
-
 void
 TorE2eApp::ScheduleRto (Ptr<E2eCircuit> circ, CellDirection direction, bool force) {
   Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
   if (force) {
-      queue->retxEvent.Cancel ();
+      queue->retxTimer.Cancel ();
   }
   if (queue->Inflight () <= 0) {
       return;
   }
-  if (queue->retxEvent.IsExpired ()) {
-      queue->retxEvent = Simulator::Schedule (queue->actRtt.Rto (), &TorE2eApp::Rto, this, circ, direction);
+  if (queue->retxTimer.IsExpired ()) {
+      m_timers.Schedule (queue->retxTimer, queue->actRtt.Rto ());
   }
 }
 
@@ -713,38 +869,44 @@ TorE2eApp::Rto (Ptr<E2eCircuit> circ, CellDirection direction) {
   Ptr<E2eSeqQueue> queue = circ->GetQueue (direction);
   queue->nextTxSeq = queue->headSeq;
   FlushPendingCell (circ,direction);
+  AddReady (circ, direction);
 }
 
 Ptr<E2eCircuit>
-TorE2eApp::GetCircuit (uint16_t id)
+TorE2eApp::GetCircuit (uint32_t id)
 {
-  return circuits[id];
+  return circuits.Get (id);
 }
 
-Ptr<E2eCircuit>
-TorE2eApp::GetNextCircuit ()
+Ptr<E2eUdpChannel>
+TorE2eApp::LookupChannel (Ptr<Socket> socket)
 {
-  ++circit;
-  if (circit == circuits.end ())
+  sgi::hash_map<Ptr<Socket>,Ptr<E2eUdpChannel>,SocketHash>::iterator it;
+  it = m_socketChannels.find (socket);
+  if (it != m_socketChannels.end ())
     {
-      circit = circuits.begin ();
+      return it->second;
     }
-  return circit->second;
+  return NULL;
 }
 
-Ptr<E2eUdpChannel>
-TorE2eApp::LookupChannel (Ptr<Socket> socket)
+// Sockets are handed out in StartApplication and do not change afterwards.
+// Relay channels share m_socket; like the old linear scan, that socket maps
+// to the first channel in address order.
+void
+TorE2eApp::IndexChannels ()
 {
+  m_socketChannels.clear ();
   map<Address,Ptr<E2eUdpChannel> >::iterator it;
   for ( it = channels.begin (); it != channels.end (); it++ )
     {
       NS_ASSERT (it->second);
-      if (it->second->m_socket == socket)
+      Ptr<Socket> socket = it->second->m_socket;
+      if (socket && m_socketChannels.find (socket) == m_socketChannels.end ())
         {
-          return it->second;
+          m_socketChannels[socket] = it->second;
         }
     }
-  return NULL;
 }
 
 void
@@ -752,18 +914,22 @@ TorE2eApp::DoDispose (void)
 {
   NS_LOG_FUNCTION (this);
 
-  map<uint16_t,Ptr<E2eCircuit> >::iterator i;
+  CircuitTable<E2eCircuit>::Iterator i;
   for (i = circuits.begin (); i != circuits.end (); ++i)
     {
-      i->second->inbound = 0;
-      i->second->outbound = 0;
-      i->second->inboundQueue = 0;
-      i->second->outboundQueue = 0;
+      (*i)->inbound = 0;
+      (*i)->outbound = 0;
+      (*i)->inboundQueue = 0;
+      (*i)->outboundQueue = 0;
 
     }
   circuits.clear ();
   baseCircuits.clear ();
   channels.clear ();
+  m_socketChannels.clear ();
+  m_starvedReads.clear ();
+  m_drainWaiters.Clear ();
+  m_timers.Clear ();
   Application::DoDispose ();
 }
 
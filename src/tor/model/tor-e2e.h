@@ -3,6 +3,8 @@
 
 #include "tor-base.h"
 #include "cell-header.h"
+#include "bktap-base.h"
+#include "tor-timer-wheel.h"
 
 #include "ns3/point-to-point-net-device.h"
 
@@ -253,8 +255,7 @@ public:
 class E2eSimpleRttEstimator
 {
 public:
-  map< uint32_t,Time > rttHistory;
-  set<uint32_t> retx;
+  SentSeqRing history;
   Time estimatedRtt;
   Time devRtt;
   Time currentRtt;
@@ -274,29 +275,28 @@ public:
   void
   SentSeq (uint32_t seq)
   {
-    if (rttHistory.size () == 0 || rttHistory.rbegin ()->first + 1 == seq)
+    if (history.Empty () || history.LastSent () + 1 == seq)
       {
         // next seq, log it.
-        rttHistory[seq] = Simulator::Now ();
+        history.SetSent (seq, Simulator::Now ());
       }
     else
       {
         //remember as retx
-        retx.insert (seq);
+        history.SetRetx (seq);
       }
   }
 
   Time EstimateRtt (uint32_t ack) {
     Time rtt = Time (0);
-    if (rttHistory.find (ack - 1) != rttHistory.end ()) {
-        if (retx.find (ack - 1) == retx.end ()) {
-            rtt = Simulator::Now () - rttHistory[ack - 1];
+    if (history.HasSent (ack - 1)) {
+        if (!history.IsRetx (ack - 1)) {
+            rtt = Simulator::Now () - history.GetSent (ack - 1);
             AddSample (rtt);
             rttMultiplier = 1;
         }
     }
-    retx.erase (ack - 1);
-    rttHistory.erase (ack - 1);
+    history.Clear (ack - 1);
 //cout << "Estimated rttt for ack "<<ack<<" = "<<rtt<<endl;    
 return rtt;
   }
@@ -358,16 +358,21 @@ public:
   uint32_t virtHeadSeq;
   uint32_t begRttSeq;
   uint32_t dupackcnt;
-  map< uint32_t, Ptr<Packet> > cellMap;
+  CellRing cells;
   bool wasRetransmit;
 
   queue<uint32_t> ackq;
   queue<uint32_t> fwdq;
-  EventId delFeedbackEvent;
+  queue<bool> fwdCE;    // congestion experienced, one per fwdq entry
+  bool feedbackPending; // listed in the channel's m_feedbackCircuits
+  bool ready;           // listed in the app's m_readyQueues
+  int32_t deficit;      // bytes this queue may still write in its DRR turn
 
   E2eSimpleRttEstimator virtRtt;
   E2eSimpleRttEstimator actRtt;
-  EventId retxEvent;
+  TorTimer retxTimer;
+  TorTimer paceTimer;
+  Time nextPaced;       // no new cell before then, with pacing
 
   E2eSeqQueue () {
     cwnd = 6;
@@ -379,21 +384,24 @@ public:
     begRttSeq = 1;
     ssthresh = pow (2,10);
     dupackcnt = 0;
+    feedbackPending = false;
+    ready = false;
+    deficit = 0;
   }
 
   // IMPORTANT: return value is now true if the cell is new, else false
   // previous behavior was: true if tailSeq increases
   bool
   Add ( Ptr<Packet> cell, uint32_t seq ) {
-    if (tailSeq < seq && cellMap.find(seq) == cellMap.end()) {
-	cellMap[seq] = cell;
-        while (cellMap.find (tailSeq + 1) != cellMap.end ()) {
+    if (tailSeq < seq && !cells.Has (seq)) {
+	cells.Insert (seq, cell);
+        while (cells.Has (tailSeq + 1)) {
             ++tailSeq;
         }
 
         if (headSeq == 0)
           {
-            headSeq = virtHeadSeq = cellMap.begin ()->first;
+            headSeq = virtHeadSeq = cells.Lowest ();
           }
 
         return true;
@@ -405,9 +413,9 @@ public:
   GetCell (uint32_t seq)
   {
     Ptr<Packet> cell;
-    if (cellMap.find (seq) != cellMap.end ())
+    if (cells.Has (seq))
       {
-        cell = cellMap[seq];
+        cell = cells.Get (seq);
       }
     wasRetransmit = true; //implicitely assume that it is a retransmit
     return cell;
@@ -415,8 +423,8 @@ public:
 
   Ptr<Packet> GetNextCell () {
     Ptr<Packet> cell;
-    if (cellMap.find (nextTxSeq) != cellMap.end ()) {
-        cell = cellMap[nextTxSeq];
+    if (cells.Has (nextTxSeq)) {
+        cell = cells.Get (nextTxSeq);
         ++nextTxSeq;
     }
     if (highestTxSeq < nextTxSeq - 1) {
@@ -435,8 +443,8 @@ public:
 
   void
   DiscardUpTo (uint32_t seq) {
-    while (cellMap.find (seq - 1) != cellMap.end ()) {
-        cellMap.erase (seq - 1);
+    while (cells.Has (seq - 1)) {
+        cells.Erase (seq - 1);
         ++headSeq;
         --seq;
     }
@@ -488,18 +496,29 @@ public:
   void SetSocket (Ptr<Socket>);
   uint8_t GetType ();
   bool SpeaksCells ();
+  uint16_t AddCircuit (Ptr<E2eCircuit>);
+  Ptr<E2eCircuit> GetCircuit (uint16_t);
 
   void ScheduleFlush (bool=false);
   void Flush ();
+  void AddFeedback (Ptr<E2eCircuit>);
+  void PushFeedback ();
+  void QueueFeedbackBlock (vector<E2eFdbkCellHeader>&);
   EventId m_flushEvent;
+  TorTimer m_feedbackTimer;
   queue<Ptr<Packet> > m_flushQueue;
+  // Circuits with ACK/FWD numbers for the other end, oldest first
+  vector<Ptr<E2eCircuit> > m_feedbackCircuits;
   Ptr<Queue> m_devQ;
   uint32_t m_devQlimit;
+  bool m_flushBlocked;
+  DeviceQueueWaiters<E2eUdpChannel> *m_drainWaiters;
 
   Ptr<Socket> m_socket;
   Address m_remote;
   uint8_t m_conntype;
-  list<Ptr<E2eCircuit> > circuits;
+  bool m_readStarved;
+  vector<Ptr<E2eCircuit> > circuits; // indexed by link-local circuit id
   E2eSimpleRttEstimator rttEstimator;
 };
 
@@ -507,11 +526,13 @@ public:
 class E2eCircuit : public BaseCircuit
 {
 public:
-  E2eCircuit (uint16_t);
+  E2eCircuit (uint32_t);
   // ~E2eCircuit();
 
   Ptr<E2eUdpChannel> inbound;
   Ptr<E2eUdpChannel> outbound;
+  uint16_t inboundId; // link-local ids
+  uint16_t outboundId;
 
   Ptr<E2eSeqQueue> inboundQueue;
   Ptr<E2eSeqQueue> outboundQueue;
@@ -519,6 +540,7 @@ public:
   CellDirection GetDirection (Ptr<E2eUdpChannel>);
   Ptr<E2eSeqQueue> GetQueue (CellDirection);
   Ptr<E2eUdpChannel> GetChannel (CellDirection direction);
+  uint16_t GetLinkId (CellDirection);
 };
 
 
@@ -536,16 +558,19 @@ public:
   void RefillWriteCallback (int64_t);
 
   Ptr<E2eUdpChannel> AddChannel (Address, int);
-  Ptr<E2eCircuit> GetCircuit (uint16_t);
-  Ptr<E2eCircuit> GetNextCircuit ();
+  Ptr<E2eCircuit> GetCircuit (uint32_t);
   virtual void AddCircuit (int, Ipv4Address, int, Ipv4Address, int,
                            Ptr<PseudoClientSocket> clientSocket = 0);
 
   Ptr<Socket> m_socket;
 
   map<Address,Ptr<E2eUdpChannel> > channels;
-  map<uint16_t,Ptr<E2eCircuit> > circuits;
-  map<uint16_t,Ptr<E2eCircuit> >::iterator circit;
+  sgi::hash_map<Ptr<Socket>,Ptr<E2eUdpChannel>,SocketHash> m_socketChannels;
+  // Edge channels whose reading stopped at an empty read bucket, oldest first
+  vector<Ptr<E2eUdpChannel> > m_starvedReads;
+  CircuitTable<E2eCircuit> circuits;
+  // Circuit queues with a sendable cell, in DRR order
+  deque<pair<Ptr<E2eCircuit>,CellDirection> > m_readyQueues;
 
   void ReadCallback (Ptr<Socket>);
   uint32_t ReadFromEdge (Ptr<Socket>);
@@ -557,23 +582,29 @@ public:
   //void CongestionAvoidance (Ptr<E2eSeqQueue>, Time);
   void CongestionAvoidance (Ptr<E2eSeqQueue>, uint8_t); //changes here
   Ptr<E2eUdpChannel> LookupChannel (Ptr<Socket>);
+  void IndexChannels ();
 
   void SocketWriteCallback (Ptr<Socket>, uint32_t);
   void WriteCallback ();
+  void AddReady (Ptr<E2eCircuit>, CellDirection);
+  bool Sendable (Ptr<E2eCircuit>, CellDirection);
   uint32_t FlushPendingCell (Ptr<E2eCircuit>, CellDirection,bool = false);
   //void SendFeedbackCell (Ptr<E2eCircuit>, CellDirection, uint8_t, uint32_t);
   void SendFeedbackCell (Ptr<E2eCircuit>, CellDirection, uint8_t, uint32_t, bool=false);
-  //void PushFeedbackCell (Ptr<E2eCircuit>, CellDirection);
-  void PushFeedbackCell (Ptr<E2eCircuit>, CellDirection, bool=false);
   void ScheduleRto (Ptr<E2eCircuit>, CellDirection, bool = false);
   void Rto (Ptr<E2eCircuit>, CellDirection);
+  bool Paced (Ptr<E2eCircuit>, CellDirection);
+  void PaceTimeout (Ptr<E2eCircuit>, CellDirection);
 
   bool m_nagle;
+  bool m_pacing;
 
   EventId writeevent;
   EventId readevent;
   Ptr<Queue> m_devQ;
   uint32_t m_devQlimit;
+  DeviceQueueWaiters<E2eUdpChannel> m_drainWaiters;
+  TorTimerWheel m_timers;
 };
 
 
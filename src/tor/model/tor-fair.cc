@@ -24,7 +24,7 @@ TorFairApp::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p_
   TorBaseApp::AddCircuit (id, n_ip, n_conntype, p_ip, p_conntype);
 
   // ensure unique id
-  NS_ASSERT (circuits[id] == 0);
+  NS_ASSERT (!circuits.Get (id));
 
   // allocate and init new circuit
   Ptr<Connection> p_conn = AddConnection (p_ip, p_conntype);
@@ -40,8 +40,8 @@ TorFairApp::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p_
   m_circuitRing.AddCircuit(circ);
 
   // add to the global list of circuits
-  circuits[id] = circ;
-  baseCircuits[id] = circ;
+  circuits.Add (id, circ);
+  baseCircuits.Add (id, circ);
 }
 
 
@@ -53,6 +53,12 @@ TorFairApp::ConnWriteCallback (Ptr<Socket> socket, uint32_t tx)
   Ptr<Connection> conn = LookupConn (socket);
   NS_ASSERT (conn);
 
+  if (m_kist)
+    {
+      KistAddPending (conn);
+      return;
+    }
+
   int written_bytes = 0;
   uint32_t max_write = m_writebucket.GetSize();
 
@@ -60,6 +66,11 @@ TorFairApp::ConnWriteCallback (Ptr<Socket> socket, uint32_t tx)
 
   if (max_write <= 0)
     {
+      if (!conn->IsWriteStarved ())
+        {
+          conn->SetWriteStarved (true);
+          m_starvedWrites.push_back (conn);
+        }
       return;
     }
 
@@ -0,0 +1,649 @@
+#include "tor-link-channel.h"
+#include "ns3/log.h"
+
+NS_LOG_COMPONENT_DEFINE ("TorLinkChannel");
+
+namespace ns3 {
+
+NS_OBJECT_ENSURE_REGISTERED (TorLinkChannel);
+NS_OBJECT_ENSURE_REGISTERED (TorLinkSocketFactory);
+NS_OBJECT_ENSURE_REGISTERED (TorLinkSocket);
+
+// PPP, IP and TCP (with timestamps) or UDP headers, counted on the links
+#define STREAM_OVERHEAD 54
+#define DATAGRAM_OVERHEAD 30
+#define MAX_DATAGRAM_SIZE 65507
+
+TypeId
+TorLinkChannel::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::TorLinkChannel")
+    .SetParent<Object> ()
+    .AddConstructor<TorLinkChannel> ()
+    .AddAttribute ("SegmentSize", "Largest payload a stream sends at once.",
+                   UintegerValue (1448),
+                   MakeUintegerAccessor (&TorLinkChannel::m_segmentSize),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("Window", "Bytes a stream may have sent but not yet read by the peer.",
+                   UintegerValue (65536),
+                   MakeUintegerAccessor (&TorLinkChannel::m_window),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("SndBufSize", "Send buffer of a stream, including the window.",
+                   UintegerValue (131072),
+                   MakeUintegerAccessor (&TorLinkChannel::m_sndBufSize),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("QueueSize", "Bytes queued on an uplink or downlink before datagrams are dropped.",
+                   UintegerValue (100 * 1500),
+                   MakeUintegerAccessor (&TorLinkChannel::m_queueSize),
+                   MakeUintegerChecker<uint32_t> ());
+  return tid;
+}
+
+TorLinkChannel::TorLinkChannel ()
+{
+  m_groupDelay = Time (0);
+  // nodes are disposed in Simulator::Destroy too, but nothing disposes a helper's channel
+  Simulator::ScheduleDestroy (&TorLinkChannel::Dispose, Ptr<TorLinkChannel> (this));
+}
+
+void
+TorLinkChannel::DoDispose (void)
+{
+  // break the cycles between peers and with the channel
+  for (uint32_t i = 0; i < m_sockets.size (); ++i)
+    {
+      m_sockets[i]->Dispose ();
+    }
+  m_sockets.clear ();
+  m_endpoints.clear ();
+  m_index.clear ();
+  Object::DoDispose ();
+}
+
+Ptr<TorLinkSocket>
+TorLinkChannel::CreateSocket (Ptr<Node> node, uint32_t endpoint, Socket::SocketType type)
+{
+  Ptr<TorLinkSocket> socket = CreateObject<TorLinkSocket> ();
+  socket->SetChannel (node, this, endpoint, type);
+  m_sockets.push_back (socket);
+  return socket;
+}
+
+void
+TorLinkChannel::Attach (Ptr<Node> node, Ipv4Address ip, DataRate rate, Time delay, uint32_t group)
+{
+  NS_ASSERT_MSG (m_index.find (ip) == m_index.end (), ip << " attached twice");
+  Endpoint e;
+  e.ip = ip;
+  e.rate = rate;
+  e.delay = delay;
+  e.group = group;
+  e.upBusy = Time (0);
+  e.downBusy = Time (0);
+  e.nextPort = 49152;
+  m_index[ip] = m_endpoints.size ();
+  m_endpoints.push_back (e);
+
+  Ptr<TorLinkSocketFactory> factory = CreateObject<TorLinkSocketFactory> ();
+  factory->SetChannel (this, m_endpoints.size () - 1);
+  node->AggregateObject (factory);
+}
+
+void
+TorLinkChannel::SetGroupDelay (Time delay)
+{
+  m_groupDelay = delay;
+}
+
+int32_t
+TorLinkChannel::Lookup (Ipv4Address ip) const
+{
+  map<Ipv4Address,uint32_t>::const_iterator it = m_index.find (ip);
+  return it == m_index.end () ? -1 : (int32_t) it->second;
+}
+
+Time
+TorLinkChannel::GetOwd (uint32_t src, uint32_t dst) const
+{
+  const Endpoint &s = m_endpoints[src];
+  const Endpoint &d = m_endpoints[dst];
+  Time owd = s.delay + d.delay;
+  if (s.group != d.group)
+    {
+      owd += m_groupDelay;
+    }
+  return owd;
+}
+
+/* Bytes waiting on a link of the given rate that is busy until busy. */
+static double
+GetBacklog (Time busy, DataRate rate)
+{
+  return max (busy - Simulator::Now (), Time (0)).GetSeconds () * rate.GetBitRate () / 8;
+}
+
+/* Queue size bytes on the uplink of src. Returns the time from now until
+ * the packet reaches the router of dst, or a negative time if it was
+ * dropped. */
+Time
+TorLinkChannel::Transmit (uint32_t src, uint32_t dst, uint32_t size, bool dropIfFull)
+{
+  Endpoint &s = m_endpoints[src];
+  Time now = Simulator::Now ();
+
+  if (dropIfFull && GetBacklog (s.upBusy, s.rate) > m_queueSize)
+    {
+      return Time (-1);
+    }
+  s.upBusy = max (now, s.upBusy) + Seconds (s.rate.CalculateTxTime (size));
+
+  Time atRouter = s.upBusy + s.delay - now;
+  if (s.group != m_endpoints[dst].group)
+    {
+      atRouter += m_groupDelay;
+    }
+  return atRouter;
+}
+
+/* Queue a packet that reached the router on the downlink of to's endpoint.
+ * Done on arrival, so that the downlink serves packets in arrival order.
+ * A full downlink drops datagrams; stream segments are never dropped, as
+ * the window already bounds what a stream has in flight. */
+void
+TorLinkChannel::Forward (Ptr<TorLinkSocket> to, uint32_t size, Ptr<Packet> p, Address from)
+{
+  Endpoint &d = m_endpoints[to->m_endpoint];
+  if (to->m_type == Socket::NS3_SOCK_DGRAM && GetBacklog (d.downBusy, d.rate) > m_queueSize)
+    {
+      NS_LOG_LOGIC ("downlink of " << d.ip << " full, dropped datagram");
+      return;
+    }
+  d.downBusy = max (Simulator::Now (), d.downBusy) + Seconds (d.rate.CalculateTxTime (size));
+  Time delay = d.downBusy + d.delay - Simulator::Now ();
+  if (to->m_type == Socket::NS3_SOCK_DGRAM)
+    {
+      Simulator::Schedule (delay, &TorLinkSocket::DeliverDatagram, to, p, from);
+    }
+  else
+    {
+      Simulator::Schedule (delay, &TorLinkSocket::Deliver, to, p);
+    }
+}
+
+void
+TorLinkChannel::ForwardDatagram (uint32_t dst, uint16_t port, uint32_t size, Ptr<Packet> p, Address from)
+{
+  map<uint16_t,Ptr<TorLinkSocket> >::iterator it = m_endpoints[dst].datagrams.find (port);
+  if (it != m_endpoints[dst].datagrams.end ())
+    {
+      Forward (it->second, size, p, from);
+    }
+}
+
+/* A connection request of client arrives at dst. */
+void
+TorLinkChannel::ConnectionRequest (Ptr<TorLinkSocket> client, uint32_t dst, uint16_t port)
+{
+  Time owd = GetOwd (client->m_endpoint, dst);
+  map<uint16_t,Ptr<TorLinkSocket> >::iterator it = m_endpoints[dst].listeners.find (port);
+  if (it == m_endpoints[dst].listeners.end ()
+      || !it->second->NotifyConnectionRequest (client->GetAddress ()))
+    {
+      Simulator::Schedule (owd, &TorLinkSocket::Connected, client, false);
+      return;
+    }
+
+  Ptr<TorLinkSocket> listener = it->second;
+  Ptr<TorLinkSocket> server = CreateSocket (listener->m_node, dst, Socket::NS3_SOCK_STREAM);
+  server->m_port = port;
+  server->m_connected = true;
+  server->m_peer = client;
+  server->m_peerEndpoint = client->m_endpoint;
+  client->m_peer = server;
+
+  listener->NotifyNewConnectionCreated (server, client->GetAddress ());
+  Simulator::Schedule (owd, &TorLinkSocket::Connected, client, true);
+}
+
+
+TypeId
+TorLinkSocketFactory::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::TorLinkSocketFactory")
+    .SetParent<SocketFactory> ();
+  return tid;
+}
+
+TorLinkSocketFactory::TorLinkSocketFactory ()
+{
+  m_endpoint = 0;
+}
+
+void
+TorLinkSocketFactory::DoDispose (void)
+{
+  m_channel = 0;
+  SocketFactory::DoDispose ();
+}
+
+void
+TorLinkSocketFactory::SetChannel (Ptr<TorLinkChannel> channel, uint32_t endpoint)
+{
+  m_channel = channel;
+  m_endpoint = endpoint;
+}
+
+Ptr<Socket>
+TorLinkSocketFactory::CreateSocket (void)
+{
+  return CreateSocket (TcpSocketFactory::GetTypeId ());
+}
+
+Ptr<Socket>
+TorLinkSocketFactory::CreateSocket (TypeId tid)
+{
+  Socket::SocketType type = tid == UdpSocketFactory::GetTypeId () ? Socket::NS3_SOCK_DGRAM : Socket::NS3_SOCK_STREAM;
+  return m_channel->CreateSocket (GetObject<Node> (), m_endpoint, type);
+}
+
+
+TypeId
+TorLinkSocket::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::TorLinkSocket")
+    .SetParent<Socket> ();
+  return tid;
+}
+
+TorLinkSocket::TorLinkSocket ()
+{
+  m_endpoint = 0;
+  m_type = NS3_SOCK_STREAM;
+  m_errno = ERROR_NOTERROR;
+  m_port = 0;
+  m_listening = false;
+  m_connected = false;
+  m_closed = false;
+  m_peerEndpoint = 0;
+  m_txBuffer = Create<Packet> ();
+  m_inflight = 0;
+  m_rxBuffer = Create<Packet> ();
+  m_rxBytes = 0;
+}
+
+void
+TorLinkSocket::DoDispose (void)
+{
+  if (m_channel)
+    {
+      Close ();
+    }
+  m_channel = 0;
+  m_node = 0;
+  Socket::DoDispose ();
+}
+
+void
+TorLinkSocket::SetChannel (Ptr<Node> node, Ptr<TorLinkChannel> channel, uint32_t endpoint, SocketType type)
+{
+  m_node = node;
+  m_channel = channel;
+  m_endpoint = endpoint;
+  m_type = type;
+}
+
+Address
+TorLinkSocket::GetAddress () const
+{
+  return InetSocketAddress (m_channel->m_endpoints[m_endpoint].ip, m_port);
+}
+
+enum Socket::SocketErrno
+TorLinkSocket::GetErrno (void) const
+{
+  return m_errno;
+}
+
+enum Socket::SocketType
+TorLinkSocket::GetSocketType (void) const
+{
+  return m_type;
+}
+
+Ptr<Node>
+TorLinkSocket::GetNode (void) const
+{
+  return m_node;
+}
+
+int
+TorLinkSocket::Bind (void)
+{
+  return Bind (InetSocketAddress (Ipv4Address::GetAny (), 0));
+}
+
+int
+TorLinkSocket::Bind6 (void)
+{
+  m_errno = ERROR_AFNOSUPPORT;
+  return -1;
+}
+
+int
+TorLinkSocket::Bind (const Address &address)
+{
+  if (!InetSocketAddress::IsMatchingType (address))
+    {
+      m_errno = ERROR_INVAL;
+      return -1;
+    }
+  TorLinkChannel::Endpoint &e = m_channel->m_endpoints[m_endpoint];
+  m_port = InetSocketAddress::ConvertFrom (address).GetPort ();
+  if (m_port == 0)
+    {
+      m_port = e.nextPort++;
+    }
+  if (m_type == NS3_SOCK_DGRAM)
+    {
+      if (e.datagrams.find (m_port) != e.datagrams.end ())
+        {
+          m_errno = ERROR_ADDRINUSE;
+          return -1;
+        }
+      e.datagrams[m_port] = this;
+    }
+  return 0;
+}
+
+int
+TorLinkSocket::Close (void)
+{
+  if (m_closed)
+    {
+      return 0;
+    }
+  m_closed = true;
+  TorLinkChannel::Endpoint &e = m_channel->m_endpoints[m_endpoint];
+  if (m_listening)
+    {
+      e.listeners.erase (m_port);
+    }
+  if (m_type == NS3_SOCK_DGRAM && m_port)
+    {
+      e.datagrams.erase (m_port);
+    }
+  m_peer = 0;
+  return 0;
+}
+
+int
+TorLinkSocket::ShutdownSend (void)
+{
+  return 0;
+}
+
+int
+TorLinkSocket::ShutdownRecv (void)
+{
+  return 0;
+}
+
+int
+TorLinkSocket::Connect (const Address &address)
+{
+  if (m_type == NS3_SOCK_DGRAM)
+    {
+      m_errno = ERROR_OPNOTSUPP;
+      return -1;
+    }
+  InetSocketAddress to = InetSocketAddress::ConvertFrom (address);
+  int32_t dst = m_channel->Lookup (to.GetIpv4 ());
+  if (dst < 0)
+    {
+      m_errno = ERROR_NOROUTETOHOST;
+      return -1;
+    }
+  if (m_port == 0)
+    {
+      Bind ();
+    }
+  m_peerEndpoint = dst;
+  Simulator::Schedule (m_channel->GetOwd (m_endpoint, dst), &TorLinkChannel::ConnectionRequest,
+                       m_channel, Ptr<TorLinkSocket> (this), (uint32_t) dst, to.GetPort ());
+  return 0;
+}
+
+int
+TorLinkSocket::Listen (void)
+{
+  if (m_type == NS3_SOCK_DGRAM)
+    {
+      m_errno = ERROR_OPNOTSUPP;
+      return -1;
+    }
+  TorLinkChannel::Endpoint &e = m_channel->m_endpoints[m_endpoint];
+  if (e.listeners.find (m_port) != e.listeners.end ())
+    {
+      m_errno = ERROR_ADDRINUSE;
+      return -1;
+    }
+  e.listeners[m_port] = this;
+  m_listening = true;
+  return 0;
+}
+
+void
+TorLinkSocket::Connected (bool success)
+{
+  if (m_closed)
+    {
+      return;
+    }
+  if (!success)
+    {
+      m_peer = 0;
+      NotifyConnectionFailed ();
+      return;
+    }
+  m_connected = true;
+  NotifyConnectionSucceeded ();
+  SendPending ();
+}
+
+uint32_t
+TorLinkSocket::GetTxAvailable (void) const
+{
+  if (m_type == NS3_SOCK_DGRAM)
+    {
+      return MAX_DATAGRAM_SIZE;
+    }
+  uint32_t used = m_txBuffer->GetSize () + m_inflight;
+  return used < m_channel->m_sndBufSize ? m_channel->m_sndBufSize - used : 0;
+}
+
+int
+TorLinkSocket::Send (Ptr<Packet> p, uint32_t flags)
+{
+  if (m_type == NS3_SOCK_DGRAM)
+    {
+      m_errno = ERROR_NOTCONN;
+      return -1;
+    }
+  if (m_closed)
+    {
+      m_errno = ERROR_SHUTDOWN;
+      return -1;
+    }
+  uint32_t n = min (p->GetSize (), GetTxAvailable ());
+  if (n == 0)
+    {
+      m_errno = ERROR_MSGSIZE;
+      return -1;
+    }
+  m_txBuffer->AddAtEnd (n == p->GetSize () ? p : p->CreateFragment (0, n));
+  SendPending ();
+  return n;
+}
+
+/* Put as much of the send buffer on the link as the window allows. */
+void
+TorLinkSocket::SendPending ()
+{
+  if (!m_connected || !m_peer)
+    {
+      return;
+    }
+  uint32_t window = m_channel->m_window;
+  while (m_txBuffer->GetSize () > 0 && m_inflight < window)
+    {
+      uint32_t size = min (min (m_channel->m_segmentSize, m_txBuffer->GetSize ()), window - m_inflight);
+      Ptr<Packet> segment = m_txBuffer->CreateFragment (0, size);
+      m_txBuffer->RemoveAtStart (size);
+      m_inflight += size;
+      Time atRouter = m_channel->Transmit (m_endpoint, m_peerEndpoint, size + STREAM_OVERHEAD, false);
+      Simulator::Schedule (atRouter, &TorLinkChannel::Forward, m_channel, m_peer, size + STREAM_OVERHEAD, segment, Address ());
+    }
+}
+
+void
+TorLinkSocket::Deliver (Ptr<Packet> p)
+{
+  if (m_closed)
+    {
+      return;
+    }
+  m_rxBuffer->AddAtEnd (p);
+  NotifyDataRecv ();
+}
+
+void
+TorLinkSocket::Acked (uint32_t size)
+{
+  if (m_closed)
+    {
+      return;
+    }
+  NS_ASSERT (size <= m_inflight);
+  m_inflight -= size;
+  SendPending ();
+  NotifyDataSent (size);
+  NotifySend (GetTxAvailable ());
+}
+
+int
+TorLinkSocket::SendTo (Ptr<Packet> p, uint32_t flags, const Address &address)
+{
+  if (m_type == NS3_SOCK_STREAM)
+    {
+      return Send (p, flags);
+    }
+  if (m_port == 0)
+    {
+      Bind ();
+    }
+  InetSocketAddress to = InetSocketAddress::ConvertFrom (address);
+  int32_t dst = m_channel->Lookup (to.GetIpv4 ());
+  if (dst < 0)
+    {
+      m_errno = ERROR_NOROUTETOHOST;
+      return -1;
+    }
+  if (p->GetSize () > MAX_DATAGRAM_SIZE)
+    {
+      m_errno = ERROR_MSGSIZE;
+      return -1;
+    }
+
+  uint32_t size = p->GetSize () + DATAGRAM_OVERHEAD;
+  Time atRouter = m_channel->Transmit (m_endpoint, dst, size, true);
+  if (atRouter >= Time (0))
+    {
+      Simulator::Schedule (atRouter, &TorLinkChannel::ForwardDatagram, m_channel,
+                           (uint32_t) dst, to.GetPort (), size, p->Copy (), GetAddress ());
+    }
+  else
+    {
+      NS_LOG_LOGIC ("uplink of " << m_channel->m_endpoints[m_endpoint].ip << " full, dropped datagram");
+    }
+  NotifyDataSent (p->GetSize ());
+  NotifySend (GetTxAvailable ());
+  return p->GetSize ();
+}
+
+void
+TorLinkSocket::DeliverDatagram (Ptr<Packet> p, Address from)
+{
+  if (m_closed)
+    {
+      return;
+    }
+  m_rxQueue.push_back (make_pair (p, from));
+  m_rxBytes += p->GetSize ();
+  NotifyDataRecv ();
+}
+
+uint32_t
+TorLinkSocket::GetRxAvailable (void) const
+{
+  return m_type == NS3_SOCK_DGRAM ? m_rxBytes : m_rxBuffer->GetSize ();
+}
+
+Ptr<Packet>
+TorLinkSocket::Recv (uint32_t maxSize, uint32_t flags)
+{
+  Address from;
+  return RecvFrom (maxSize, flags, from);
+}
+
+Ptr<Packet>
+TorLinkSocket::RecvFrom (uint32_t maxSize, uint32_t flags, Address &fromAddress)
+{
+  if (m_type == NS3_SOCK_DGRAM)
+    {
+      if (m_rxQueue.empty () || m_rxQueue.front ().first->GetSize () > maxSize)
+        {
+          return 0;
+        }
+      Ptr<Packet> p = m_rxQueue.front ().first;
+      fromAddress = m_rxQueue.front ().second;
+      m_rxQueue.pop_front ();
+      m_rxBytes -= p->GetSize ();
+      return p;
+    }
+
+  uint32_t size = min (maxSize, m_rxBuffer->GetSize ());
+  if (size == 0)
+    {
+      return 0;
+    }
+  Ptr<Packet> p = m_rxBuffer->CreateFragment (0, size);
+  m_rxBuffer->RemoveAtStart (size);
+  if (m_peer)
+    {
+      fromAddress = m_peer->GetAddress ();
+      // the window opens once the data left the receive buffer
+      Simulator::Schedule (m_channel->GetOwd (m_endpoint, m_peerEndpoint), &TorLinkSocket::Acked, m_peer, size);
+    }
+  return p;
+}
+
+int
+TorLinkSocket::GetSockName (Address &address) const
+{
+  address = GetAddress ();
+  return 0;
+}
+
+bool
+TorLinkSocket::SetAllowBroadcast (bool allowBroadcast)
+{
+  return !allowBroadcast;
+}
+
+bool
+TorLinkSocket::GetAllowBroadcast () const
+{
+  return false;
+}
+
+} // namespace ns3
@@ -0,0 +1,174 @@
+#ifndef TOR_LINK_CHANNEL_H
+#define TOR_LINK_CHANNEL_H
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "ns3/core-module.h"
+#include "ns3/network-module.h"
+#include "ns3/internet-module.h"
+
+using namespace std;
+
+namespace ns3 {
+
+class TorLinkSocket;
+
+/**
+ * Emulates the network between Tor relays at the level of whole segments,
+ * without IP, TCP or net devices. Every attached node has an access link
+ * (rate and one-way delay to its router) and belongs to a group; paths
+ * between groups add the group delay. Access links are FIFO queues whose
+ * waiting times are computed rather than simulated: a packet costs one
+ * event at the receiver's router and one on delivery. Router links only
+ * add delay.
+ *
+ * The channel holds on to the sockets it creates and disposes of them
+ * with itself, in Simulator::Destroy.
+ */
+class TorLinkChannel : public Object
+{
+public:
+  static TypeId GetTypeId (void);
+  TorLinkChannel ();
+
+  /* Make node reachable at ip, and aggregate a TorLinkSocketFactory to it. */
+  void Attach (Ptr<Node> node, Ipv4Address ip, DataRate rate, Time delay, uint32_t group = 0);
+  void SetGroupDelay (Time);
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  friend class TorLinkSocket;
+  friend class TorLinkSocketFactory;
+
+  struct Endpoint
+  {
+    Ipv4Address ip;
+    DataRate rate;
+    Time delay;
+    uint32_t group;
+    Time upBusy;    // the uplink is busy sending until then
+    Time downBusy;
+    uint16_t nextPort;
+    map<uint16_t,Ptr<TorLinkSocket> > listeners;
+    map<uint16_t,Ptr<TorLinkSocket> > datagrams;
+  };
+
+  Ptr<TorLinkSocket> CreateSocket (Ptr<Node>, uint32_t endpoint, Socket::SocketType);
+  int32_t Lookup (Ipv4Address) const;
+  Time GetOwd (uint32_t src, uint32_t dst) const;
+  Time Transmit (uint32_t src, uint32_t dst, uint32_t size, bool dropIfFull);
+  void Forward (Ptr<TorLinkSocket> to, uint32_t size, Ptr<Packet>, Address from);
+  void ForwardDatagram (uint32_t dst, uint16_t port, uint32_t size, Ptr<Packet>, Address from);
+  void ConnectionRequest (Ptr<TorLinkSocket> client, uint32_t dst, uint16_t port);
+
+  vector<Endpoint> m_endpoints;
+  map<Ipv4Address,uint32_t> m_index;
+  vector<Ptr<TorLinkSocket> > m_sockets;
+  Time m_groupDelay;
+  uint32_t m_segmentSize;
+  uint32_t m_window;
+  uint32_t m_sndBufSize;
+  uint32_t m_queueSize;
+};
+
+
+class TorLinkSocketFactory : public SocketFactory
+{
+public:
+  static TypeId GetTypeId (void);
+  TorLinkSocketFactory ();
+
+  void SetChannel (Ptr<TorLinkChannel>, uint32_t endpoint);
+
+  /* A stream socket */
+  virtual Ptr<Socket> CreateSocket (void);
+  /* A datagram socket for UdpSocketFactory, a stream socket otherwise. */
+  Ptr<Socket> CreateSocket (TypeId);
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  Ptr<TorLinkChannel> m_channel;
+  uint32_t m_endpoint;
+};
+
+
+/**
+ * Socket of a TorLinkChannel. Streams deliver in order, with at most
+ * Window bytes sent but not yet read by the peer: the window is credited
+ * back one delay after the peer reads, which models both congestion and
+ * receive windows. Datagrams are dropped when the sender's uplink or
+ * the receiver's downlink holds more than QueueSize bytes.
+ */
+class TorLinkSocket : public Socket
+{
+public:
+  static TypeId GetTypeId (void);
+  TorLinkSocket ();
+
+  void SetChannel (Ptr<Node>, Ptr<TorLinkChannel>, uint32_t endpoint, SocketType);
+
+  enum SocketErrno GetErrno (void) const;
+  enum SocketType GetSocketType (void) const;
+  Ptr<Node> GetNode (void) const;
+  int Bind (void);
+  int Bind6 (void);
+  int Bind (const Address &address);
+  int Close (void);
+  int ShutdownSend (void);
+  int ShutdownRecv (void);
+  int Connect (const Address &address);
+  int Listen (void);
+  uint32_t GetTxAvailable (void) const;
+  int Send (Ptr<Packet> p, uint32_t flags);
+  int SendTo (Ptr<Packet> p, uint32_t flags, const Address &address);
+  uint32_t GetRxAvailable (void) const;
+  Ptr<Packet> Recv (uint32_t maxSize, uint32_t flags);
+  Ptr<Packet> RecvFrom (uint32_t maxSize, uint32_t flags, Address &fromAddress);
+  int GetSockName (Address &address) const;
+  bool SetAllowBroadcast (bool allowBroadcast);
+  bool GetAllowBroadcast () const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  friend class TorLinkChannel;
+
+  Address GetAddress () const;
+  void SendPending ();
+  void Connected (bool);
+  void Deliver (Ptr<Packet>);
+  void DeliverDatagram (Ptr<Packet>, Address from);
+  void Acked (uint32_t);
+
+  Ptr<Node> m_node;
+  Ptr<TorLinkChannel> m_channel;
+  uint32_t m_endpoint;
+  SocketType m_type;
+  enum SocketErrno m_errno;
+  uint16_t m_port;
+  bool m_listening;
+  bool m_connected;
+  bool m_closed;
+
+  // streams
+  Ptr<TorLinkSocket> m_peer;
+  uint32_t m_peerEndpoint;
+  Ptr<Packet> m_txBuffer;   // not sent yet
+  uint32_t m_inflight;      // sent, not yet read by the peer
+  Ptr<Packet> m_rxBuffer;
+
+  // datagrams
+  deque<pair<Ptr<Packet>,Address> > m_rxQueue;
+  uint32_t m_rxBytes;
+};
+
+} // namespace ns3
+
+#endif /* TOR_LINK_CHANNEL_H */
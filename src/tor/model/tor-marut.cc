@@ -20,6 +20,9 @@ MarutUdpChannel::MarutUdpChannel ()
 {
   NS_LOG_FUNCTION (this);
   this->m_socket = 0;
+  this->m_readStarved = false;
+  this->m_flushBlocked = false;
+  this->m_drainWaiters = 0;
 }
 
 MarutUdpChannel::MarutUdpChannel (Address remote, int conntype)
@@ -27,6 +30,9 @@ MarutUdpChannel::MarutUdpChannel (Address remote, int conntype)
   m_remote = remote;
   m_conntype = conntype;
   this->m_socket = 0;
+  this->m_readStarved = false;
+  this->m_flushBlocked = false;
+  this->m_drainWaiters = 0;
 }
 
 void
@@ -47,22 +53,35 @@ MarutUdpChannel::SpeaksCells ()
   return m_conntype == RELAYEDGE;
 }
 
+uint16_t
+MarutUdpChannel::AddCircuit (Ptr<MarutBktapCircuit> circ)
+{
+  NS_ABORT_MSG_IF (circuits.size () > 0xffff, "More than 65536 circuits on channel");
+  circuits.push_back (circ);
+  return circuits.size () - 1;
+}
+
+Ptr<MarutBktapCircuit>
+MarutUdpChannel::GetCircuit (uint16_t id)
+{
+  return id < circuits.size () ? circuits[id] : 0;
+}
+
 void
 MarutUdpChannel::Flush ()
 {
+  if (m_feedbackCircuits.size () > 0)
+    {
+      PushFeedback ();
+    }
   while (m_flushQueue.size () > 0)
     {
       if (SpeaksCells () && m_devQlimit <= m_devQ->GetNPackets ())
         {
-          m_flushEvent = Simulator::Schedule (MilliSeconds (1), &MarutUdpChannel::Flush, this);
+          m_drainWaiters->Add (this);
           return;
         }
-      Ptr<Packet> data = Create<Packet> ();
-      while (m_flushQueue.size () > 0 && data->GetSize () + m_flushQueue.front ()->GetSize () <= 1400)
-        {
-          data->AddAtEnd (m_flushQueue.front ());
-          m_flushQueue.pop ();
-        }
+      Ptr<Packet> data = CellPool::Gather (m_flushQueue, 1400);
       m_socket->SendTo (data,0,m_remote);
     }
 }
@@ -94,7 +113,74 @@ MarutUdpChannel::ScheduleFlush (bool delay)
     }
 }
 
-MarutBktapCircuit::MarutBktapCircuit (uint16_t id) : BaseCircuit (id)
+/* The feedback of circ goes out with the next flush of this channel. */
+void
+MarutUdpChannel::AddFeedback (Ptr<MarutBktapCircuit> circ)
+{
+  Ptr<MarutSeqQueue> queue = circ->GetQueue (circ->GetDirection (this));
+  if (!queue->feedbackPending)
+    {
+      queue->feedbackPending = true;
+      m_feedbackCircuits.push_back (circ);
+    }
+}
+
+/* Queue the feedback of all circuits as blocks of FdbkCellHeaders, each
+ * at most the size of a cell. Every entry carries the circuit's current
+ * diff of the opposite direction. */
+void
+MarutUdpChannel::PushFeedback ()
+{
+  m_feedbackTimer.Cancel ();
+  vector<FdbkCellHeader> block;
+  uint32_t maxEntries = (CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE) / FdbkCellHeader ().GetSerializedSize ();
+  for (uint32_t i = 0; i < m_feedbackCircuits.size (); i++) {
+      Ptr<MarutBktapCircuit> circ = m_feedbackCircuits[i];
+      CellDirection direction = circ->GetDirection (this);
+      Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
+      Ptr<MarutSeqQueue> oppqueue = circ->GetQueue (circ->GetOppositeDirection (direction));
+      queue->feedbackPending = false;
+      while (queue->ackq.size () > 0 || queue->fwdq.size () > 0) {
+          FdbkCellHeader header;
+          header.circId = circ->GetLinkId (direction);
+          if (queue->ackq.size () > 0) {
+              header.flags |= ACK;
+              while (queue->ackq.size () > 0 && header.ack < queue->ackq.front ()) {
+                  header.ack = queue->ackq.front ();
+                  queue->ackq.pop ();
+              }
+          }
+          if (queue->fwdq.size () > 0) {
+              header.flags |= FWD;
+              header.fwd = queue->fwdq.front ();
+              queue->fwdq.pop ();
+          }
+          header.diff = oppqueue->circ_diff;
+          block.push_back (header);
+          if (block.size () == maxEntries) {
+              QueueFeedbackBlock (block);
+          }
+      }
+  }
+  QueueFeedbackBlock (block);
+  m_feedbackCircuits.clear ();
+}
+
+void
+MarutUdpChannel::QueueFeedbackBlock (vector<FdbkCellHeader> &block)
+{
+  if (block.size () == 0) {
+      return;
+  }
+  Ptr<Packet> cell = CellPool::Acquire (0);
+  for (uint32_t i = block.size (); i > 0; i--) {
+      cell->AddHeader (block[i - 1]);
+  }
+  m_flushQueue.push (cell);
+  block.clear ();
+}
+
+MarutBktapCircuit::MarutBktapCircuit (uint32_t id) : BaseCircuit (id)
 {
   inboundQueue = Create<MarutSeqQueue> ();
   outboundQueue = Create<MarutSeqQueue> ();
@@ -126,6 +212,12 @@ MarutBktapCircuit::GetChannel (CellDirection direction)
     }
 }
 
+uint16_t
+MarutBktapCircuit::GetLinkId (CellDirection direction)
+{
+  return direction == OUTBOUND ? outboundId : inboundId;
+}
+
 Ptr<MarutSeqQueue>
 MarutBktapCircuit::GetQueue (CellDirection direction)
 {
@@ -169,18 +261,20 @@ MarutTorBktapApp::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Addr
   TorBaseApp::AddCircuit (id, n_ip, n_conntype, p_ip, p_conntype);
 
   // ensure unique circ_id
-  NS_ASSERT (circuits[id] == 0);
+  NS_ASSERT (!circuits.Get (id));
 
   Ptr<MarutBktapCircuit> circ = Create<MarutBktapCircuit> (id);
-  circuits[id] = circ;
-  baseCircuits[id] = circ;
+  circuits.Add (id, circ);
+  baseCircuits.Add (id, circ);
+  circ->inboundQueue->retxTimer.SetFunction (&MarutTorBktapApp::Rto, this, PeekPointer (circ), INBOUND);
+  circ->outboundQueue->retxTimer.SetFunction (&MarutTorBktapApp::Rto, this, PeekPointer (circ), OUTBOUND);
 
   circ->inbound = AddChannel (InetSocketAddress (p_ip,9001),p_conntype);
-  circ->inbound->circuits.push_back (circ);
+  circ->inboundId = circ->inbound->AddCircuit (circ);
   circ->inbound->SetSocket (clientSocket);
 
   circ->outbound = AddChannel (InetSocketAddress (n_ip,9001),n_conntype);
-  circ->outbound->circuits.push_back (circ);
+  circ->outboundId = circ->outbound->AddCircuit (circ);
 
 }
 
@@ -192,6 +286,7 @@ MarutTorBktapApp::AddChannel (Address remote, int conntype)
   if (!ch)
     {
       ch = Create<MarutUdpChannel> (remote, conntype);
+      ch->m_feedbackTimer.SetFunction (&MarutUdpChannel::Flush, PeekPointer (ch));
       channels[remote] = ch;
     }
   return ch;
@@ -203,19 +298,18 @@ MarutTorBktapApp::StartApplication (void)
   //tor proposal #183: smooth bursts & get queued data out earlier
   m_refilltime = MilliSeconds (10);
   TorBaseApp::StartApplication ();
-  m_readbucket.SetRefilledCallback (MakeCallback (&MarutTorBktapApp::RefillReadCallback, this));
-  m_writebucket.SetRefilledCallback (MakeCallback (&MarutTorBktapApp::RefillWriteCallback, this));
-
-  circit = circuits.begin ();
+  m_readbucket.SetRefilledCallback (MakeCallback (&MarutTorBktapApp::RefillReadCallback, this), true);
+  m_writebucket.SetRefilledCallback (MakeCallback (&MarutTorBktapApp::RefillWriteCallback, this), true);
 
   m_devQ = GetNode ()->GetDevice (0)->GetObject<PointToPointNetDevice> ()->GetQueue ();
   UintegerValue limit;
   m_devQ->GetAttribute ("MaxPackets", limit);
   m_devQlimit = limit.Get ();
+  m_drainWaiters.Start (m_devQ, m_devQlimit);
 
   if (m_socket == 0)
     {
-      m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+      m_socket = CreateSocket (UdpSocketFactory::GetTypeId ());
       m_socket->Bind (m_local);
     }
 
@@ -236,6 +330,7 @@ MarutTorBktapApp::StartApplication (void)
           ch->SetSocket (m_socket);
           ch->m_devQ = m_devQ;
           ch->m_devQlimit = m_devQlimit;
+          ch->m_drainWaiters = &m_drainWaiters;
         }
 
       // PseudoSockets only
@@ -258,6 +353,8 @@ MarutTorBktapApp::StartApplication (void)
             }
         }
     }
+
+  IndexChannels ();
 }
 
 void
@@ -266,21 +363,19 @@ MarutTorBktapApp::StopApplication (void)
   m_socket->Close ();
   m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
   m_socket->SetDataSentCallback (MakeNullCallback<void, Ptr<Socket>, uint32_t > ());
+  m_drainWaiters.Stop ();
+  m_timers.Clear ();
 }
 
 void
 MarutTorBktapApp::RefillReadCallback (int64_t prev_read_bucket)
 {
-  vector<Ptr<Socket> > v;
-  map<Address,Ptr<MarutUdpChannel> >::iterator it;
-  for ( it = channels.begin (); it != channels.end (); it++ )
+  vector<Ptr<MarutUdpChannel> > starved;
+  starved.swap (m_starvedReads);
+  for (uint32_t i = 0; i < starved.size (); i++)
     {
-      Ptr<Socket> socket = it->second->m_socket;
-      if (std::find (v.begin (), v.end (),socket) == v.end ())
-        {
-          Simulator::Schedule (Seconds (0), &MarutTorBktapApp::ReadCallback, this, it->second->m_socket);
-          v.push_back (socket);
-        }
+      starved[i]->m_readStarved = false;
+      Simulator::Schedule (Seconds (0), &MarutTorBktapApp::ReadCallback, this, starved[i]->m_socket);
     }
 }
 
@@ -326,7 +421,7 @@ MarutTorBktapApp::ReadFromRelay (Ptr<Socket> socket) {
           while (data->GetSize () > 0) {
               BaseCellHeader header;
               data->PeekHeader (header);
-              Ptr<MarutBktapCircuit> circ = circuits[header.circId];
+              Ptr<MarutBktapCircuit> circ = ch->GetCircuit (header.circId);
               NS_ASSERT (circ);
               CellDirection direction = circ->GetDirection (ch);
               CellDirection oppdir = circ->GetOppositeDirection (direction);
@@ -343,7 +438,7 @@ MarutTorBktapApp::ReadFromRelay (Ptr<Socket> socket) {
               }
               else
                 {
-                  Ptr<Packet> cell = data->CreateFragment (0,CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
+                  Ptr<Packet> cell = CellPool::Fragment (data, 0, CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
                   data->RemoveAtStart (CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE);
                   circ->IncrementStats (oppdir,cell->GetSize (),0);
                   ReceivedRelayCell (circ,oppdir,cell);
@@ -361,10 +456,16 @@ MarutTorBktapApp::ReceivedRelayCell (Ptr<MarutBktapCircuit> circ, CellDirection
  //cout << "Node: " << GetNodeName() << " Received Relay Cell " << endl;
  UdpCellHeader header;
   cell->PeekHeader (header);
+  if (circ->GetChannel (direction)->SpeaksCells () && header.circId != circ->GetLinkId (direction)) {
+    cell->RemoveHeader (header);
+    header.circId = circ->GetLinkId (direction);
+    cell->AddHeader (header);
+  }
   bool newseq = queue->Add (cell, header.seq);
   if (newseq) {
     m_readbucket.Decrement(cell->GetSize());
   }
+  AddReady (circ, direction);
   CellDirection oppdir = circ->GetOppositeDirection (direction);
   SendFeedbackCell (circ, oppdir, ACK, queue->tailSeq + 1);
 }
@@ -390,6 +491,7 @@ MarutTorBktapApp::ReceivedAck (Ptr<MarutBktapCircuit> circ, CellDirection direct
       //NewAck
       queue->dupackcnt = 0;
       queue->DiscardUpTo (header.ack);
+      AddReady (circ, direction);
       Time rtt = queue->actRtt.EstimateRtt (header.ack);
       ScheduleRto (circ,direction,true);
       if (!queue->PackageInflight ())
@@ -406,7 +508,7 @@ MarutTorBktapApp::ReceivedAck (Ptr<MarutBktapCircuit> circ, CellDirection direct
 
 //UPDATE cwnd for endhost (proxy node or server node)
 void
-MarutTorBktapApp::WindowUpdate (Ptr<MarutSeqQueue> queue, Time baseRtt, uint16_t circ_id, CellDirection direction) {
+MarutTorBktapApp::WindowUpdate (Ptr<MarutSeqQueue> queue, Time baseRtt, uint32_t circ_id, CellDirection direction) {
 //   if (queue->virtRtt.cntRtt > 2) {
 //  cout << "Node: " << GetNodeName() <<", CircuitId: "<< circ_id <<", Direction: "<<CellDirectionArray[static_cast<int>(direction)] <<", Updating Window, cwnd=" << queue->cwnd << ", Circuit Diff:"  << queue->circ_diff << ", " <<  queue->circ_diff / 10000. << endl;
   double c_diff = queue->circ_diff / 10000.;
@@ -430,7 +532,7 @@ MarutTorBktapApp::WindowUpdate (Ptr<MarutSeqQueue> queue, Time baseRtt, uint16_t
 }
 
 void
-MarutTorBktapApp::CongestionAvoidance (Ptr<MarutSeqQueue> queue, uint64_t packet_diff, Time baseRtt, uint16_t circ_id, CellDirection direction) {
+MarutTorBktapApp::CongestionAvoidance (Ptr<MarutSeqQueue> queue, uint64_t packet_diff, Time baseRtt, uint32_t circ_id, CellDirection direction) {
  //Do the Vegas-thing every RTT
 //  cout << "Node: " << GetNodeName() <<", CircuitId: "<< circ_id <<", Direction: "<<CellDirectionArray[static_cast<int>(direction)] << ", Updating congestion, circ_diff=" << queue->circ_diff << endl;
 //  if (queue->virtRtt.cntRtt > 2) {
@@ -491,6 +593,7 @@ MarutTorBktapApp::ReceivedFwd (Ptr<MarutBktapCircuit> circ, CellDirection direct
   else if (queue->cwnd <= queue->ssthresh) {
       //TODO test different slow start schemes
   }
+  AddReady (circ, direction);
 
   Simulator::Schedule (Seconds (0), &MarutTorBktapApp::ReadCallback, this, oppch->m_socket);
 
@@ -525,6 +628,13 @@ MarutTorBktapApp::ReadFromEdge (Ptr<Socket> socket)
       PackageRelayCell (circ, oppdir, data);
     }
 
+  // ReceivedFwd reopens a full window; the refill wakes reads that emptied the bucket
+  if (socket->GetRxAvailable () >= CELL_PAYLOAD_SIZE && m_readbucket.GetSize () == 0 && !ch->m_readStarved)
+    {
+      ch->m_readStarved = true;
+      m_starvedReads.push_back (ch);
+    }
+
   return read_bytes;
 }
 
@@ -533,7 +643,7 @@ MarutTorBktapApp::PackageRelayCell (Ptr<MarutBktapCircuit> circ, CellDirection d
 {
 //  cout << "Node: " << GetNodeName() << " Relay Cell Packaged " << endl;
   UdpCellHeader header;
-  header.circId = circ->GetId ();
+  header.circId = circ->GetLinkId (direction);
   Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
   NS_ASSERT (queue);
   header.seq = queue->tailSeq + 1;
@@ -541,6 +651,7 @@ MarutTorBktapApp::PackageRelayCell (Ptr<MarutBktapCircuit> circ, CellDirection d
   queue->virtRtt.SentSeq (header.seq);
   queue->actRtt.SentSeq (header.seq);
   queue->Add (cell, header.seq);
+  AddReady (circ, direction);
 }
 
 void
@@ -552,21 +663,37 @@ MarutTorBktapApp::SocketWriteCallback (Ptr<Socket> s, uint32_t i)
     }
 }
 
+/* Serves the ready queues in deficit round robin, one relay cell per
+ * turn, like TorBktapApp. */
 void
 MarutTorBktapApp::WriteCallback ()
 {
   uint32_t bytes_written = 0;
 
-  if (m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE)
+  while (bytes_written == 0 && m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE && m_readyQueues.size () > 0)
     {
-      Ptr<MarutBktapCircuit> start = circit->second;
-      Ptr<MarutBktapCircuit> circ;
+      Ptr<MarutBktapCircuit> circ = m_readyQueues.front ().first;
+      CellDirection direction = m_readyQueues.front ().second;
+      m_readyQueues.pop_front ();
+      Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
+      queue->ready = false;
+
+      queue->deficit += CELL_PAYLOAD_SIZE + UDP_CELL_HEADER_SIZE;
+      while (queue->deficit > 0 && Sendable (circ, direction) && m_writebucket.GetSize () >= CELL_PAYLOAD_SIZE)
+        {
+          uint32_t bytes = FlushPendingCell (circ, direction);
+          queue->deficit -= bytes;
+          bytes_written += bytes;
+        }
 
-      while (bytes_written == 0 && start != circ)
+      if (Sendable (circ, direction))
+        {
+          queue->ready = true;
+          m_readyQueues.push_back (make_pair (circ, direction));
+        }
+      else
         {
-          circ = GetNextCircuit ();
-          bytes_written += FlushPendingCell (circ,INBOUND);
-          bytes_written += FlushPendingCell (circ,OUTBOUND);
+          queue->deficit = 0;
         }
     }
 
@@ -582,6 +709,28 @@ MarutTorBktapApp::WriteCallback ()
 
 
 
+void
+MarutTorBktapApp::AddReady (Ptr<MarutBktapCircuit> circ, CellDirection direction)
+{
+  Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
+  if (!queue->ready && Sendable (circ, direction))
+    {
+      queue->ready = true;
+      m_readyQueues.push_back (make_pair (circ, direction));
+    }
+}
+
+/* Whether FlushPendingCell would write a cell of this queue now. Middle
+ * relays do not check the window. */
+bool
+MarutTorBktapApp::Sendable (Ptr<MarutBktapCircuit> circ, CellDirection direction)
+{
+  Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
+  bool middle = circ->GetChannel (direction)->SpeaksCells ()
+    && circ->GetChannel (circ->GetOppositeDirection (direction))->SpeaksCells ();
+  return (middle || queue->Window () > 0) && queue->cells.Has (queue->nextTxSeq);
+}
+
 uint32_t
 MarutTorBktapApp::FlushPendingCell (Ptr<MarutBktapCircuit> circ, CellDirection direction, bool retx) {
   Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
@@ -663,48 +812,14 @@ MarutTorBktapApp::SendFeedbackCell (Ptr<MarutBktapCircuit> circ, CellDirection d
       if (flag & FWD) {
           queue->fwdq.push (ack);
       }
+      ch->AddFeedback (circ);
       if (queue->ackq.size () > 0 && queue->fwdq.size () > 0) {
-          queue->delFeedbackEvent.Cancel ();
-          PushFeedbackCell (circ, direction);
-      }
-      else {
-          queue->delFeedbackEvent = Simulator::Schedule (MilliSeconds (1), &MarutTorBktapApp::PushFeedbackCell, this, circ, direction);
-      }
-  }
-}
-
-void
-MarutTorBktapApp::PushFeedbackCell (Ptr<MarutBktapCircuit> circ, CellDirection direction) {
-  Ptr<MarutUdpChannel> ch = circ->GetChannel (direction);
-  Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
-
-  CellDirection oppdir   = circ->GetOppositeDirection (direction);
-  Ptr<MarutSeqQueue> oppqueue = circ->GetQueue (oppdir);
-
-  NS_ASSERT (ch);
-
-  while (queue->ackq.size () > 0 || queue->fwdq.size () > 0) {
-      Ptr<Packet> cell = Create<Packet> ();
-      FdbkCellHeader header;
-      header.circId = circ->GetId ();
-      if (queue->ackq.size () > 0) {
-          header.flags |= ACK;
-          while (queue->ackq.size () > 0 && header.ack < queue->ackq.front ()) {
-              header.ack = queue->ackq.front ();
-              queue->ackq.pop ();
-          }
+          ch->PushFeedback ();
+          ch->ScheduleFlush ();
       }
-      if (queue->fwdq.size () > 0) {
-          header.flags |= FWD;
-          header.fwd = queue->fwdq.front ();
-          queue->fwdq.pop ();
+      else if (ch->m_feedbackTimer.IsExpired ()) {
+          m_timers.Schedule (ch->m_feedbackTimer, MilliSeconds (1));
       }
-
-			header.diff = oppqueue->circ_diff;
-
-      cell->AddHeader (header);
-      ch->m_flushQueue.push (cell);
-      ch->ScheduleFlush ();
   }
 }
 
@@ -714,15 +829,15 @@ MarutTorBktapApp::ScheduleRto (Ptr<MarutBktapCircuit> circ, CellDirection direct
   Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
   if (force)
     {
-      queue->retxEvent.Cancel ();
+      queue->retxTimer.Cancel ();
     }
   if (queue->Inflight () <= 0)
     {
       return;
     }
-  if (queue->retxEvent.IsExpired ())
+  if (queue->retxTimer.IsExpired ())
     {
-      queue->retxEvent = Simulator::Schedule (queue->actRtt.Rto (), &MarutTorBktapApp::Rto, this, circ, direction);
+      m_timers.Schedule (queue->retxTimer, queue->actRtt.Rto ());
     }
 }
 
@@ -732,38 +847,44 @@ MarutTorBktapApp::Rto (Ptr<MarutBktapCircuit> circ, CellDirection direction)
   Ptr<MarutSeqQueue> queue = circ->GetQueue (direction);
   queue->nextTxSeq = queue->headSeq;
   FlushPendingCell (circ,direction);
+  AddReady (circ, direction);
 }
 
 Ptr<MarutBktapCircuit>
-MarutTorBktapApp::GetCircuit (uint16_t id)
+MarutTorBktapApp::GetCircuit (uint32_t id)
 {
-  return circuits[id];
+  return circuits.Get (id);
 }
 
-Ptr<MarutBktapCircuit>
-MarutTorBktapApp::GetNextCircuit ()
+Ptr<MarutUdpChannel>
+MarutTorBktapApp::LookupChannel (Ptr<Socket> socket)
 {
-  ++circit;
-  if (circit == circuits.end ())
+  sgi::hash_map<Ptr<Socket>,Ptr<MarutUdpChannel>,SocketHash>::iterator it;
+  it = m_socketChannels.find (socket);
+  if (it != m_socketChannels.end ())
     {
-      circit = circuits.begin ();
+      return it->second;
     }
-  return circit->second;
+  return NULL;
 }
 
-Ptr<MarutUdpChannel>
-MarutTorBktapApp::LookupChannel (Ptr<Socket> socket)
+// Sockets are handed out in StartApplication and do not change afterwards.
+// Relay channels share m_socket; like the old linear scan, that socket maps
+// to the first channel in address order.
+void
+MarutTorBktapApp::IndexChannels ()
 {
+  m_socketChannels.clear ();
   map<Address,Ptr<MarutUdpChannel> >::iterator it;
   for ( it = channels.begin (); it != channels.end (); it++ )
     {
       NS_ASSERT (it->second);
-      if (it->second->m_socket == socket)
+      Ptr<Socket> socket = it->second->m_socket;
+      if (socket && m_socketChannels.find (socket) == m_socketChannels.end ())
         {
-          return it->second;
+          m_socketChannels[socket] = it->second;
         }
     }
-  return NULL;
 }
 
 void
@@ -771,18 +892,22 @@ MarutTorBktapApp::DoDispose (void)
 {
   NS_LOG_FUNCTION (this);
 
-  map<uint16_t,Ptr<MarutBktapCircuit> >::iterator i;
+  CircuitTable<MarutBktapCircuit>::Iterator i;
   for (i = circuits.begin (); i != circuits.end (); ++i)
     {
-      i->second->inbound = 0;
-      i->second->outbound = 0;
-      i->second->inboundQueue = 0;
-      i->second->outboundQueue = 0;
+      (*i)->inbound = 0;
+      (*i)->outbound = 0;
+      (*i)->inboundQueue = 0;
+      (*i)->outboundQueue = 0;
 
     }
   circuits.clear ();
   baseCircuits.clear ();
   channels.clear ();
+  m_socketChannels.clear ();
+  m_starvedReads.clear ();
+  m_drainWaiters.Clear ();
+  m_timers.Clear ();
   Application::DoDispose ();
 }
 
@@ -4,6 +4,7 @@
 #include "tor-base.h"
 #include "cell-header.h"
 #include "bktap-base.h"
+#include "tor-timer-wheel.h"
 
 #include "ns3/point-to-point-net-device.h"
 
@@ -30,17 +31,19 @@ public:
   uint32_t virtHeadSeq;
   uint32_t begRttSeq;
   uint32_t dupackcnt;
-  map< uint32_t, Ptr<Packet> > cellMap;
+  CellRing cells;
 
   bool wasRetransmit;
 
   queue<uint32_t> ackq;
   queue<uint32_t> fwdq;
-  EventId delFeedbackEvent;
+  bool feedbackPending; // listed in the channel's m_feedbackCircuits
+  bool ready;           // listed in the app's m_readyQueues
+  int32_t deficit;      // bytes this queue may still write in its DRR turn
 
   SimpleRttEstimator virtRtt;
   SimpleRttEstimator actRtt;
-  EventId retxEvent;
+  TorTimer retxTimer;
 
   MarutSeqQueue ()
   {
@@ -58,21 +61,24 @@ public:
     begRttSeq = 1;
     ssthresh = pow (2,10);
     dupackcnt = 0;
+    feedbackPending = false;
+    ready = false;
+    deficit = 0;
   }
 
   // IMPORTANT: return value is now true if the cell is new, else false
   // previous behavior was: true if tailSeq increases
   bool
   Add ( Ptr<Packet> cell, uint32_t seq ) {
-    if (tailSeq < seq && cellMap.find(seq) == cellMap.end()) {
-        cellMap[seq] = cell;
-        while (cellMap.find (tailSeq + 1) != cellMap.end ()) {
+    if (tailSeq < seq && !cells.Has (seq)) {
+        cells.Insert (seq, cell);
+        while (cells.Has (tailSeq + 1)) {
             ++tailSeq;
         }
 
         if (headSeq == 0)
           {
-            headSeq = virtHeadSeq = cellMap.begin ()->first;
+            headSeq = virtHeadSeq = cells.Lowest ();
           }
 
         return true;
@@ -84,9 +90,9 @@ public:
   GetCell (uint32_t seq)
   {
     Ptr<Packet> cell;
-if (cellMap.find (seq) != cellMap.end ())
+if (cells.Has (seq))
       {
-        cell = cellMap[seq];
+        cell = cells.Get (seq);
       }
     wasRetransmit = true; //implicitely assume that it is a retransmit
     return cell;
@@ -96,9 +102,9 @@ if (cellMap.find (seq) != cellMap.end ())
   GetNextCell ()
   {
     Ptr<Packet> cell;
-    if (cellMap.find (nextTxSeq) != cellMap.end ())
+    if (cells.Has (nextTxSeq))
       {
-        cell = cellMap[nextTxSeq];
+        cell = cells.Get (nextTxSeq);
         ++nextTxSeq;
       }
 
@@ -123,9 +129,9 @@ if (cellMap.find (seq) != cellMap.end ())
  void
   DiscardUpTo (uint32_t seq)
   {
-    while (cellMap.find (seq - 1) != cellMap.end ())
+    while (cells.Has (seq - 1))
       {
-        cellMap.erase (seq - 1);
+        cells.Erase (seq - 1);
         ++headSeq;
         --seq;
       }
@@ -180,18 +186,29 @@ public:
   void SetSocket (Ptr<Socket>);
   uint8_t GetType ();
   bool SpeaksCells ();
+  uint16_t AddCircuit (Ptr<MarutBktapCircuit>);
+  Ptr<MarutBktapCircuit> GetCircuit (uint16_t);
 
   void ScheduleFlush (bool=false);
   void Flush ();
+  void AddFeedback (Ptr<MarutBktapCircuit>);
+  void PushFeedback ();
+  void QueueFeedbackBlock (vector<FdbkCellHeader>&);
   EventId m_flushEvent;
+  TorTimer m_feedbackTimer;
   queue<Ptr<Packet> > m_flushQueue;
+  // Circuits with ACK/FWD numbers for the other end, oldest first
+  vector<Ptr<MarutBktapCircuit> > m_feedbackCircuits;
   Ptr<Queue> m_devQ;
   uint32_t m_devQlimit;
+  bool m_flushBlocked;
+  DeviceQueueWaiters<MarutUdpChannel> *m_drainWaiters;
 
   Ptr<Socket> m_socket;
   Address m_remote;
   uint8_t m_conntype;
-  list<Ptr<MarutBktapCircuit> > circuits;
+  bool m_readStarved;
+  vector<Ptr<MarutBktapCircuit> > circuits; // indexed by link-local circuit id
   SimpleRttEstimator rttEstimator;
 };
 
@@ -199,11 +216,13 @@ public:
 class MarutBktapCircuit : public BaseCircuit
 {
 public:
-  MarutBktapCircuit (uint16_t);
+  MarutBktapCircuit (uint32_t);
   // ~MarutBktapCircuit();
 
   Ptr<MarutUdpChannel> inbound;
   Ptr<MarutUdpChannel> outbound;
+  uint16_t inboundId; // link-local ids
+  uint16_t outboundId;
 
   Ptr<MarutSeqQueue> inboundQueue;
   Ptr<MarutSeqQueue> outboundQueue;
@@ -211,6 +230,7 @@ public:
   CellDirection GetDirection (Ptr<MarutUdpChannel>);
   Ptr<MarutSeqQueue> GetQueue (CellDirection);
   Ptr<MarutUdpChannel> GetChannel (CellDirection direction);
+  uint16_t GetLinkId (CellDirection);
 };
 
 
@@ -228,16 +248,19 @@ public:
   void RefillWriteCallback (int64_t);
 
   Ptr<MarutUdpChannel> AddChannel (Address, int);
-  Ptr<MarutBktapCircuit> GetCircuit (uint16_t);
-  Ptr<MarutBktapCircuit> GetNextCircuit ();
+  Ptr<MarutBktapCircuit> GetCircuit (uint32_t);
   virtual void AddCircuit (int, Ipv4Address, int, Ipv4Address, int,
                            Ptr<PseudoClientSocket> clientSocket = 0);
 
   Ptr<Socket> m_socket;
 
   map<Address,Ptr<MarutUdpChannel> > channels;
-  map<uint16_t,Ptr<MarutBktapCircuit> > circuits;
-  map<uint16_t,Ptr<MarutBktapCircuit> >::iterator circit;
+  sgi::hash_map<Ptr<Socket>,Ptr<MarutUdpChannel>,SocketHash> m_socketChannels;
+  // Edge channels whose reading stopped at an empty read bucket, oldest first
+  vector<Ptr<MarutUdpChannel> > m_starvedReads;
+  CircuitTable<MarutBktapCircuit> circuits;
+  // Circuit queues with a sendable cell, in DRR order
+  deque<pair<Ptr<MarutBktapCircuit>,CellDirection> > m_readyQueues;
 
   void ReadCallback (Ptr<Socket>);
   uint32_t ReadFromEdge (Ptr<Socket>);
@@ -246,17 +269,19 @@ public:
   void ReceivedRelayCell (Ptr<MarutBktapCircuit>, CellDirection, Ptr<Packet>);
   void ReceivedAck (Ptr<MarutBktapCircuit>, CellDirection, FdbkCellHeader);
   void ReceivedFwd (Ptr<MarutBktapCircuit>, CellDirection, FdbkCellHeader);
-  void CongestionAvoidance (Ptr<MarutSeqQueue>, uint64_t, Time,uint16_t, CellDirection);
-  void WindowUpdate (Ptr<MarutSeqQueue>, Time, uint16_t, CellDirection);
+  void CongestionAvoidance (Ptr<MarutSeqQueue>, uint64_t, Time,uint32_t, CellDirection);
+  void WindowUpdate (Ptr<MarutSeqQueue>, Time, uint32_t, CellDirection);
 
 
   Ptr<MarutUdpChannel> LookupChannel (Ptr<Socket>);
+  void IndexChannels ();
 
   void SocketWriteCallback (Ptr<Socket>, uint32_t);
   void WriteCallback ();
+  void AddReady (Ptr<MarutBktapCircuit>, CellDirection);
+  bool Sendable (Ptr<MarutBktapCircuit>, CellDirection);
   uint32_t FlushPendingCell (Ptr<MarutBktapCircuit>, CellDirection,bool = false);
   void SendFeedbackCell (Ptr<MarutBktapCircuit>, CellDirection, uint8_t, uint32_t);
-  void PushFeedbackCell (Ptr<MarutBktapCircuit>, CellDirection);
   void ScheduleRto (Ptr<MarutBktapCircuit>, CellDirection, bool = false);
   void Rto (Ptr<MarutBktapCircuit>, CellDirection);
 
@@ -266,6 +291,8 @@ public:
   EventId readevent;
   Ptr<Queue> m_devQ;
   uint32_t m_devQlimit;
+  DeviceQueueWaiters<MarutUdpChannel> m_drainWaiters;
+  TorTimerWheel m_timers;
 };
 
 
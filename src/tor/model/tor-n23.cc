@@ -33,7 +33,7 @@ TorN23App::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p_i
   TorBaseApp::AddCircuit (id, n_ip, n_conntype, p_ip, p_conntype);
 
   // ensure unique id
-  NS_ASSERT (circuits[id] == 0);
+  NS_ASSERT (!circuits.Get (id));
 
   // allocate and init new circuit
   Ptr<Connection> p_conn = AddConnection (p_ip, p_conntype);
@@ -47,13 +47,13 @@ TorN23App::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p_i
   AddActiveCircuit (n_conn, circ);
 
   // add to the global list of circuits
-  circuits[id] = circ;
-  baseCircuits[id] = circ;
+  circuits.Add (id, circ);
+  baseCircuits.Add (id, circ);
 }
 
 
 
-N23Circuit::N23Circuit (uint16_t circ_id, Ptr<Connection> n_conn, Ptr<Connection> p_conn,
+N23Circuit::N23Circuit (uint32_t circ_id, Ptr<Connection> n_conn, Ptr<Connection> p_conn,
                         int windowStart, int windowIncrement) : Circuit (circ_id, n_conn, p_conn, windowStart, windowIncrement)
 {
   p_creditBalance = N2 + N3;
@@ -103,8 +103,9 @@ N23Circuit::PopCell (CellDirection direction)
   if (sendCredit && opp_conn->SpeaksCells ())
     {
       NS_LOG_LOGIC ("[Circuit " << GetId () << "] Send CREDIT cell ");
-      Ptr<Packet> creditCell = CreateCredit ();
-      GetQueue (BaseCircuit::GetOppositeDirection (direction))->push (creditCell);
+      CellDirection oppdir = BaseCircuit::GetOppositeDirection (direction);
+      Ptr<Packet> creditCell = CreateCredit (oppdir);
+      QueueCell (oppdir, creditCell);
       opp_conn->ScheduleWrite ();
     }
 
@@ -153,7 +154,7 @@ N23Circuit::PushCell (Ptr<Packet> cell, CellDirection direction)
         }
 
       IncrementStats (direction, CELL_PAYLOAD_SIZE, 0);
-      GetQueue (direction)->push (cell);
+      QueueCell (direction, cell);
     }
 }
 
@@ -190,15 +191,15 @@ N23Circuit::IncrementCredit (CellDirection direction)
 
 
 Ptr<Packet>
-N23Circuit::CreateCredit ()
+N23Circuit::CreateCredit (CellDirection direction)
 {
   CellHeader h;
-  h.SetCircId (GetId ());
+  h.SetCircId (GetLinkId (direction));
   h.SetType (CREDIT);
   h.SetStreamId (42);
   h.SetCmd (CREDIT);
   h.SetLength (0);
-  Ptr<Packet> cell = Create<Packet> (CELL_PAYLOAD_SIZE);
+  Ptr<Packet> cell = CellPool::Acquire (CELL_PAYLOAD_SIZE);
   cell->AddHeader (h);
 
   return cell;
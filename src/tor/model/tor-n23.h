@@ -13,11 +13,11 @@ namespace ns3 {
 class N23Circuit : public Circuit
 {
 public:
-  N23Circuit (uint16_t, Ptr<Connection>, Ptr<Connection>, int, int);
+  N23Circuit (uint32_t, Ptr<Connection>, Ptr<Connection>, int, int);
   // ~N23Circuit ();
   virtual Ptr<Packet> PopCell (CellDirection);
   virtual void PushCell (Ptr<Packet>, CellDirection);
-  Ptr<Packet> CreateCredit ();
+  Ptr<Packet> CreateCredit (CellDirection);
   bool IsCredit (Ptr<Packet>);
   bool IncrementCredit (CellDirection);
 
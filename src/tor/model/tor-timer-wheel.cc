@@ -0,0 +1,260 @@
+#include <limits>
+
+#include "tor-timer-wheel.h"
+
+namespace ns3 {
+
+const uint32_t TorTimerWheel::SLOT_BITS;
+const uint32_t TorTimerWheel::SLOTS;
+const uint32_t TorTimerWheel::LEVELS;
+
+TorTimer::TorTimer ()
+{
+  m_wheel = 0;
+  m_slot = 0;
+  m_prev = 0;
+  m_next = 0;
+  m_expires = 0;
+}
+
+TorTimer::~TorTimer ()
+{
+  Cancel ();
+}
+
+void
+TorTimer::Cancel ()
+{
+  if (m_wheel)
+    {
+      m_wheel->Unlink (this);
+    }
+}
+
+bool
+TorTimer::IsRunning () const
+{
+  return m_wheel != 0;
+}
+
+bool
+TorTimer::IsExpired () const
+{
+  return m_wheel == 0;
+}
+
+
+TorTimerWheel::TorTimerWheel (Time tick)
+{
+  NS_ASSERT (tick.IsStrictlyPositive ());
+  m_tick = tick;
+  m_now = 0;
+  m_count = 0;
+  m_wakeTick = 0;
+  m_advancing = false;
+  for (uint32_t l = 0; l < LEVELS; ++l)
+    {
+      for (uint32_t s = 0; s < SLOTS; ++s)
+        {
+          m_slots[l][s] = 0;
+        }
+    }
+}
+
+TorTimerWheel::~TorTimerWheel ()
+{
+  Clear ();
+}
+
+void
+TorTimerWheel::Clear ()
+{
+  for (uint32_t l = 0; l < LEVELS; ++l)
+    {
+      for (uint32_t s = 0; s < SLOTS; ++s)
+        {
+          while (m_slots[l][s])
+            {
+              Unlink (m_slots[l][s]);
+            }
+        }
+    }
+  m_wakeEvent.Cancel ();
+}
+
+uint64_t
+TorTimerWheel::GetNowTick () const
+{
+  return Simulator::Now ().GetTimeStep () / m_tick.GetTimeStep ();
+}
+
+void
+TorTimerWheel::Schedule (TorTimer &timer, Time delay)
+{
+  NS_ASSERT (timer.m_event);
+  timer.Cancel ();
+  if (m_count == 0)
+    {
+      // nothing to cascade on the way, skip the idle ticks
+      m_now = std::max (m_now, GetNowTick ());
+    }
+  uint64_t tick = m_tick.GetTimeStep ();
+  uint64_t expires = (Simulator::Now () + delay).GetTimeStep ();
+  timer.m_expires = std::max ((expires + tick - 1) / tick, m_now + 1);
+  Insert (&timer);
+  if (!m_advancing && (!m_wakeEvent.IsRunning () || timer.m_expires < m_wakeTick))
+    {
+      ScheduleWake ();
+    }
+}
+
+/* The level is the first whose slots span the distance to the expiry;
+ * timers beyond the last level wait in its farthest slot. */
+void
+TorTimerWheel::Insert (TorTimer *timer)
+{
+  uint64_t delta = timer->m_expires - m_now;
+  uint32_t level = 0;
+  while (level < LEVELS - 1 && delta >= ((uint64_t) 1 << (SLOT_BITS * (level + 1))))
+    {
+      ++level;
+    }
+  uint32_t shift = SLOT_BITS * level;
+  uint64_t block = timer->m_expires >> shift;
+  if (delta >= ((uint64_t) 1 << (SLOT_BITS * LEVELS)))
+    {
+      block = (m_now >> shift) + SLOTS - 1;
+    }
+  TorTimer *&head = m_slots[level][block & (SLOTS - 1)];
+  timer->m_prev = 0;
+  timer->m_next = head;
+  if (head)
+    {
+      head->m_prev = timer;
+    }
+  head = timer;
+  timer->m_slot = &head;
+  timer->m_wheel = this;
+  ++m_count;
+}
+
+void
+TorTimerWheel::Unlink (TorTimer *timer)
+{
+  NS_ASSERT (timer->m_wheel == this);
+  if (timer->m_prev)
+    {
+      timer->m_prev->m_next = timer->m_next;
+    }
+  else
+    {
+      *timer->m_slot = timer->m_next;
+    }
+  if (timer->m_next)
+    {
+      timer->m_next->m_prev = timer->m_prev;
+    }
+  timer->m_slot = 0;
+  timer->m_prev = 0;
+  timer->m_next = 0;
+  timer->m_wheel = 0;
+  --m_count;
+}
+
+void
+TorTimerWheel::Cascade (uint32_t level)
+{
+  uint32_t slot = (m_now >> (SLOT_BITS * level)) & (SLOTS - 1);
+  TorTimer *timer = m_slots[level][slot];
+  m_slots[level][slot] = 0;
+  while (timer)
+    {
+      TorTimer *next = timer->m_next;
+      timer->m_wheel = 0;
+      --m_count;
+      Insert (timer);
+      timer = next;
+    }
+}
+
+/* Process the ticks up to now that have slots due, skipping the others:
+ * cascade the higher levels whose slot boundary is reached, highest first,
+ * then fire the level 0 slot. Timers may be armed and cancelled from
+ * within the callbacks. */
+void
+TorTimerWheel::Advance ()
+{
+  uint64_t target = GetNowTick ();
+  m_advancing = true;
+  while (m_count > 0)
+    {
+      uint64_t next = NextTick ();
+      if (next > target)
+        {
+          break;
+        }
+      m_now = next;
+      uint32_t levels = 1;
+      while (levels < LEVELS && (m_now & (((uint64_t) 1 << (SLOT_BITS * levels)) - 1)) == 0)
+        {
+          ++levels;
+        }
+      for (uint32_t l = levels - 1; l > 0; --l)
+        {
+          Cascade (l);
+        }
+
+      TorTimer *&head = m_slots[0][m_now & (SLOTS - 1)];
+      while (head)
+        {
+          TorTimer *timer = head;
+          Unlink (timer);
+          if (timer->m_expires > m_now)
+            {
+              Insert (timer);
+              continue;
+            }
+          timer->m_event->Invoke ();
+        }
+    }
+  m_now = std::max (m_now, target);
+  m_advancing = false;
+  ScheduleWake ();
+}
+
+/* The next tick at which a slot is due: a level 0 slot fires at its tick,
+ * a higher one cascades at the first tick of its block. */
+uint64_t
+TorTimerWheel::NextTick () const
+{
+  uint64_t next = std::numeric_limits<uint64_t>::max ();
+  for (uint32_t l = 0; l < LEVELS; ++l)
+    {
+      uint32_t shift = SLOT_BITS * l;
+      for (uint32_t i = 1; i <= SLOTS; ++i)
+        {
+          uint64_t block = (m_now >> shift) + i;
+          if (m_slots[l][block & (SLOTS - 1)])
+            {
+              next = std::min (next, block << shift);
+              break;
+            }
+        }
+    }
+  return next;
+}
+
+void
+TorTimerWheel::ScheduleWake ()
+{
+  m_wakeEvent.Cancel ();
+  if (m_count == 0)
+    {
+      return;
+    }
+  m_wakeTick = NextTick ();
+  Time at = TimeStep (m_wakeTick * m_tick.GetTimeStep ());
+  m_wakeEvent = Simulator::Schedule (std::max (at - Simulator::Now (), Time (0)), &TorTimerWheel::Advance, this);
+}
+
+} //namespace ns3
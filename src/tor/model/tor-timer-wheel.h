@@ -0,0 +1,97 @@
+#ifndef __TOR_TIMER_WHEEL_H__
+#define __TOR_TIMER_WHEEL_H__
+
+#include "ns3/simulator.h"
+#include "ns3/make-event.h"
+
+namespace ns3 {
+
+class TorTimerWheel;
+
+/**
+ * A timer owned by a TorTimerWheel. The function is bound once; arming,
+ * re-arming and cancelling only relink the timer and schedule nothing.
+ * Pass objects as raw pointers, so that a timer embedded in a circuit
+ * does not keep the circuit alive.
+ */
+class TorTimer
+{
+public:
+  TorTimer ();
+  ~TorTimer ();
+
+  template <typename MEM, typename OBJ>
+  void SetFunction (MEM f, OBJ obj)
+  {
+    m_event = Ptr<EventImpl> (MakeEvent (f, obj), false);
+  }
+  template <typename MEM, typename OBJ, typename T1, typename T2>
+  void SetFunction (MEM f, OBJ obj, T1 a1, T2 a2)
+  {
+    m_event = Ptr<EventImpl> (MakeEvent (f, obj, a1, a2), false);
+  }
+
+  void Cancel ();
+  bool IsRunning () const;
+  bool IsExpired () const;
+
+private:
+  friend class TorTimerWheel;
+
+  TorTimer (const TorTimer&);
+  TorTimer& operator= (const TorTimer&);
+
+  Ptr<EventImpl> m_event;
+  TorTimerWheel *m_wheel; // while armed
+  TorTimer **m_slot;      // head of the slot list
+  TorTimer *m_prev;
+  TorTimer *m_next;
+  uint64_t m_expires;     // tick
+};
+
+
+/**
+ * Hierarchical timing wheel: LEVELS levels of 2^SLOT_BITS slots, each slot
+ * an intrusive list of timers. Timers fire at the first tick boundary at
+ * or after their expiry, so up to one tick late. A single simulator event
+ * wakes the wheel at the next tick that has timers to fire or to cascade
+ * into a lower level; ticks in between cost nothing.
+ */
+class TorTimerWheel
+{
+public:
+  TorTimerWheel (Time tick = MicroSeconds (10));
+  ~TorTimerWheel ();
+
+  /* (Re-)arm the timer to fire delay from now. */
+  void Schedule (TorTimer &timer, Time delay);
+  /* Disarm all timers and stop. */
+  void Clear ();
+
+private:
+  friend class TorTimer;
+
+  static const uint32_t SLOT_BITS = 6;
+  static const uint32_t SLOTS = 1 << SLOT_BITS;
+  static const uint32_t LEVELS = 4;
+
+  void Insert (TorTimer *timer);
+  void Unlink (TorTimer *timer);
+  void Advance ();
+  void Cascade (uint32_t level);
+  uint64_t NextTick () const;
+  void ScheduleWake ();
+  uint64_t GetNowTick () const;
+
+  Time m_tick;
+  uint64_t m_now;    // last tick processed
+  uint32_t m_count;  // armed timers
+  TorTimer *m_slots[LEVELS][SLOTS];
+  EventId m_wakeEvent;
+  uint64_t m_wakeTick;
+  bool m_advancing;  // the wake is rescheduled once Advance is done
+};
+
+} //namespace ns3
+
+#endif /* __TOR_TIMER_WHEEL_H__ */
@@ -2,6 +2,13 @@
 
 #include "ns3/log.h"
 #include "ns3/random-variable-stream.h"
+#include "ns3/boolean.h"
+#include "ns3/double.h"
+#include "ns3/uinteger.h"
+#include "ns3/string.h"
+
+#include <cmath>
+#include <limits>
 
 #include "tor.h"
 
@@ -25,15 +32,30 @@ TorApp::GetTypeId (void)
     .AddAttribute ("WindowIncrement", "End-to-end sliding window increment (in cells).",
                    IntegerValue (100),
                    MakeIntegerAccessor (&TorApp::m_windowIncrement),
-                   MakeIntegerChecker<int> ());
+                   MakeIntegerChecker<int> ())
+    .AddAttribute ("CircuitMux", "How connections pick circuits to write from: RoundRobin or Ewma.",
+                   StringValue ("RoundRobin"),
+                   MakeStringAccessor (&TorApp::m_circuitMux),
+                   MakeStringChecker ())
+    .AddAttribute ("Kist", "Write with the KIST-style global scheduler. Needs ns-3's own TCP: "
+                   "NSC sockets do not report their congestion window and are refused.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&TorApp::m_kist),
+                   MakeBooleanChecker ())
+    .AddAttribute ("KistInterval", "Minimum interval between two KIST scheduler runs.",
+                   TimeValue (Time ("2ms")),
+                   MakeTimeAccessor (&TorApp::m_kistInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("KistSockBufFactor", "Congestion windows of unsent data KIST keeps in a socket.",
+                   DoubleValue (1.0),
+                   MakeDoubleAccessor (&TorApp::m_kistFactor),
+                   MakeDoubleChecker<double> (0.0));
   return tid;
 }
 
 TorApp::TorApp (void)
 {
   listen_socket = 0;
-  m_scheduleReadHead = 0;
-  m_scheduleWriteHead = 0;
 }
 
 TorApp::~TorApp (void)
@@ -47,14 +69,19 @@ TorApp::DoDispose (void)
   NS_LOG_FUNCTION (this);
   listen_socket = 0;
 
-  map<uint16_t,Ptr<Circuit> >::iterator i;
+  CircuitTable<Circuit>::Iterator i;
   for (i = circuits.begin (); i != circuits.end (); ++i)
     {
-      i->second->DoDispose ();
+      (*i)->DoDispose ();
     }
   circuits.clear ();
   baseCircuits.clear ();
   connections.clear ();
+  m_socketConnections.clear ();
+  m_starvedReads.clear ();
+  m_starvedWrites.clear ();
+  m_kistPending.clear ();
+  m_kistEvent.Cancel ();
   Application::DoDispose ();
 }
 
@@ -66,7 +93,7 @@ TorApp::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p_ip,
   TorBaseApp::AddCircuit (id, n_ip, n_conntype, p_ip, p_conntype);
 
   // ensure unique id
-  NS_ASSERT (circuits[id] == 0);
+  NS_ASSERT (!circuits.Get (id));
 
   // allocate and init new circuit
   Ptr<Connection> p_conn = AddConnection (p_ip, p_conntype);
@@ -80,8 +107,8 @@ TorApp::AddCircuit (int id, Ipv4Address n_ip, int n_conntype, Ipv4Address p_ip,
   AddActiveCircuit (n_conn, circ);
 
   // add to the global list of circuits
-  circuits[id] = circ;
-  baseCircuits[id] = circ;
+  circuits.Add (id, circ);
+  baseCircuits.Add (id, circ);
 }
 
 Ptr<Connection>
@@ -133,13 +160,13 @@ void
 TorApp::StartApplication (void)
 {
   TorBaseApp::StartApplication ();
-  m_readbucket.SetRefilledCallback (MakeCallback (&TorApp::RefillReadCallback, this));
-  m_writebucket.SetRefilledCallback (MakeCallback (&TorApp::RefillWriteCallback, this));
+  m_readbucket.SetRefilledCallback (MakeCallback (&TorApp::RefillReadCallback, this), true);
+  m_writebucket.SetRefilledCallback (MakeCallback (&TorApp::RefillWriteCallback, this), true);
 
   // create listen socket
   if (!listen_socket)
     {
-      listen_socket = Socket::CreateSocket (GetNode (), TcpSocketFactory::GetTypeId ());
+      listen_socket = CreateSocket (TcpSocketFactory::GetTypeId ());
       listen_socket->Bind (m_local);
       listen_socket->Listen ();
     }
@@ -159,7 +186,7 @@ TorApp::StartApplication (void)
       // if m_ip smaller then connect to remote node
       if (m_ip < conn->GetRemote () && conn->SpeaksCells ())
         {
-          Ptr<Socket> socket = Socket::CreateSocket (GetNode (), TcpSocketFactory::GetTypeId ());
+          Ptr<Socket> socket = CreateSocket (TcpSocketFactory::GetTypeId ());
           socket->Bind ();
           socket->Connect (Address (InetSocketAddress (conn->GetRemote (), InetSocketAddress::ConvertFrom (m_local).GetPort ())));
           // socket->SetSendCallback (MakeCallback(&TorApp::ConnWriteCallback, this));
@@ -224,10 +251,21 @@ TorApp::StopApplication (void)
     }
 }
 
+void
+TorApp::Reconfigure (void)
+{
+  TorBaseApp::Reconfigure ();
+  CircuitTable<Circuit>::Iterator i;
+  for (i = circuits.begin (); i != circuits.end (); ++i)
+    {
+      (*i)->SetWindow (m_windowStart, m_windowIncrement);
+    }
+}
+
 Ptr<Circuit>
-TorApp::GetCircuit (uint16_t circid)
+TorApp::GetCircuit (uint32_t circid)
 {
-  return circuits[circid];
+  return circuits.Get (circid);
 }
 
 
@@ -251,9 +289,11 @@ TorApp::ConnReadCallback (Ptr<Socket> socket)
   max_read = min (max_read, socket->GetRxAvailable ());
   NS_LOG_LOGIC ("Read " << max_read << "/" << socket->GetRxAvailable () << " bytes from " << conn->GetRemote ());
 
-  if (m_readbucket.GetSize() <= 0 && m_scheduleReadHead == 0) {
-    m_scheduleReadHead = conn;
-  }
+  if (m_readbucket.GetSize () <= 0 && !conn->IsReadStarved ())
+    {
+      conn->SetReadStarved (true);
+      m_starvedReads.push_back (conn);
+    }
 
   if (max_read <= 0)
     {
@@ -303,9 +343,9 @@ TorApp::PackageRelayCell (Ptr<Connection> conn, Ptr<Packet> cell)
   Ptr<Circuit> circ = conn->GetActiveCircuits ();
   NS_ASSERT (circ);
 
-  PackageRelayCellImpl (circ->GetId (), cell);
-
   CellDirection direction = circ->GetOppositeDirection (conn);
+  PackageRelayCellImpl (circ->GetLinkId (direction), cell);
+
   AppendCellToCircuitQueue (circ, cell, direction);
   if (circ->GetPackageWindow () <= 0)
     {
@@ -331,7 +371,7 @@ TorApp::ReceiveRelayCell (Ptr<Connection> conn, Ptr<Packet> cell)
 {
   NS_ASSERT (conn);
   NS_ASSERT (cell);
-  Ptr<Circuit> circ = LookupCircuitFromCell (cell);
+  Ptr<Circuit> circ = LookupCircuitFromCell (conn, cell);
   NS_ASSERT (circ);
 
   // find target connection for relaying
@@ -339,17 +379,28 @@ TorApp::ReceiveRelayCell (Ptr<Connection> conn, Ptr<Packet> cell)
   Ptr<Connection> target_conn = circ->GetConnection (direction);
   NS_ASSERT (target_conn);
 
+  // switch to the id the circuit has on the next link
+  CellHeader h;
+  cell->PeekHeader (h);
+  if (target_conn->SpeaksCells () && h.GetCircId () != circ->GetLinkId (direction))
+    {
+      cell->RemoveHeader (h);
+      h.SetCircId (circ->GetLinkId (direction));
+      cell->AddHeader (h);
+    }
+
   AppendCellToCircuitQueue (circ, cell, direction);
 }
 
 
 Ptr<Circuit>
-TorApp::LookupCircuitFromCell (Ptr<Packet> cell)
+TorApp::LookupCircuitFromCell (Ptr<Connection> conn, Ptr<Packet> cell)
 {
+  NS_ASSERT (conn);
   NS_ASSERT (cell);
   CellHeader h;
   cell->PeekHeader (h);
-  return circuits[h.GetCircId ()];
+  return conn->GetLinkCircuit (h.GetCircId ());
 }
 
 
@@ -378,6 +429,12 @@ TorApp::ConnWriteCallback (Ptr<Socket> socket, uint32_t tx)
   Ptr<Connection> conn = LookupConn (socket);
   NS_ASSERT (conn);
 
+  if (m_kist)
+    {
+      KistAddPending (conn);
+      return;
+    }
+
   uint32_t newtx = socket->GetTxAvailable ();
 
   int written_bytes = 0;
@@ -387,9 +444,11 @@ TorApp::ConnWriteCallback (Ptr<Socket> socket, uint32_t tx)
 
   NS_LOG_LOGIC ("Write max " << max_write << " bytes to " << conn->GetRemote ());
 
-  if (m_writebucket.GetSize() <= 0 && m_scheduleWriteHead == 0) {
-    m_scheduleWriteHead = conn;
-  }
+  if (m_writebucket.GetSize () <= 0 && !conn->IsWriteStarved ())
+    {
+      conn->SetWriteStarved (true);
+      m_starvedWrites.push_back (conn);
+    }
 
   if (max_write <= 0)
     {
@@ -440,16 +499,34 @@ TorApp::HandleAccept (Ptr<Socket> s, const Address& from)
 Ptr<Connection>
 TorApp::LookupConn (Ptr<Socket> socket)
 {
-  vector<Ptr<Connection> >::iterator it;
-  for ( it = connections.begin (); it != connections.end (); it++ )
+  sgi::hash_map<Ptr<Socket>,Ptr<Connection>,SocketHash>::iterator it;
+  it = m_socketConnections.find (socket);
+  if (it != m_socketConnections.end ())
     {
-      NS_ASSERT (*it);
-      if ((*it)->GetSocket () == socket)
+      return it->second;
+    }
+  return NULL;
+}
+
+// Keeps the socket index in sync with Connection::SetSocket. A socket maps
+// to the connection it was assigned to first, as the old linear scan did.
+void
+TorApp::IndexConn (Ptr<Connection> conn, Ptr<Socket> oldSocket)
+{
+  if (oldSocket)
+    {
+      sgi::hash_map<Ptr<Socket>,Ptr<Connection>,SocketHash>::iterator it;
+      it = m_socketConnections.find (oldSocket);
+      if (it != m_socketConnections.end () && it->second == conn)
         {
-          return (*it);
+          m_socketConnections.erase (it);
         }
     }
-  return NULL;
+  Ptr<Socket> socket = conn->GetSocket ();
+  if (socket && m_socketConnections.find (socket) == m_socketConnections.end ())
+    {
+      m_socketConnections[socket] = conn;
+    }
 }
 
 
@@ -459,24 +536,14 @@ TorApp::RefillReadCallback (int64_t prev_read_bucket)
   NS_LOG_LOGIC ("read bucket was " << prev_read_bucket << ". Now " << m_readbucket.GetSize ());
   if (prev_read_bucket <= 0 && m_readbucket.GetSize () > 0)
     {
-      vector<Ptr<Connection> >::iterator it;
-      vector<Ptr<Connection> >::iterator headit;
-
-      headit = connections.begin();
-      if (m_scheduleReadHead != 0) {
-        headit = find(connections.begin(),connections.end(),m_scheduleReadHead);
-        m_scheduleReadHead = 0;
-      }
-
-      it = headit;
-      do {
-        Ptr<Connection> conn = *it;
-        NS_ASSERT(conn);
-        conn->ScheduleRead (Time ("10ns"));
-        if (++it == connections.end ()) {
-          it = connections.begin ();
+      // wake the connections starved by the bucket, in the order they ran dry
+      vector<Ptr<Connection> > starved;
+      starved.swap (m_starvedReads);
+      for (uint32_t i = 0; i < starved.size (); i++)
+        {
+          starved[i]->SetReadStarved (false);
+          starved[i]->ScheduleRead (Time ("10ns"));
         }
-      } while (it != headit);
     }
 }
 
@@ -487,24 +554,13 @@ TorApp::RefillWriteCallback (int64_t prev_write_bucket)
 
   if (prev_write_bucket <= 0 && m_writebucket.GetSize () > 0)
     {
-      vector<Ptr<Connection> >::iterator it;
-      vector<Ptr<Connection> >::iterator headit;
-
-      headit = connections.begin();
-      if (m_scheduleWriteHead != 0) {
-        headit = find(connections.begin(),connections.end(),m_scheduleWriteHead);
-        m_scheduleWriteHead = 0;
-      }
-
-      it = headit;
-      do {
-        Ptr<Connection> conn = *it;
-        NS_ASSERT(conn);
-        conn->ScheduleWrite ();
-        if (++it == connections.end ()) {
-          it = connections.begin ();
+      vector<Ptr<Connection> > starved;
+      starved.swap (m_starvedWrites);
+      for (uint32_t i = 0; i < starved.size (); i++)
+        {
+          starved[i]->SetWriteStarved (false);
+          starved[i]->ScheduleWrite ();
         }
-      } while (it != headit);
     }
 }
 
@@ -520,6 +576,131 @@ TorApp::GlobalBucketsDecrement (uint32_t num_read, uint32_t num_written)
 
 
 
+void
+TorApp::KistAddPending (Ptr<Connection> conn)
+{
+  if (!conn->IsKistPending ())
+    {
+      conn->SetKistPending (true);
+      m_kistPending.push_back (conn);
+    }
+
+  if (m_kistEvent.IsExpired ())
+    {
+      Time next = Max (m_kistLast + m_kistInterval, Simulator::Now ());
+      m_kistEvent = Simulator::Schedule (next - Simulator::Now (), &TorApp::KistSchedule, this);
+    }
+}
+
+
+struct KistEntry
+{
+  double key;
+  uint32_t order;
+  uint32_t conn; // index into the pending connections
+
+  bool operator< (const KistEntry &other) const
+  {
+    // priority_queue pops the largest; we want the lowest key first
+    if (key != other.key)
+      {
+        return key > other.key;
+      }
+    return order > other.order;
+  }
+};
+
+/** KIST: write to all pending connections at once, one cell at a time,
+ * always to the connection whose circuit mux offers the most urgent
+ * circuit. Each socket gets no more than it can put on the wire soon,
+ * judged by its congestion window and how much it already holds. */
+void
+TorApp::KistSchedule ()
+{
+  m_kistLast = Simulator::Now ();
+
+  vector<Ptr<Connection> > pending;
+  pending.swap (m_kistPending);
+  vector<uint32_t> limits (pending.size ());
+
+  priority_queue<KistEntry> heap;
+  uint32_t order = 0;
+  for (uint32_t i = 0; i < pending.size (); i++)
+    {
+      Ptr<Connection> conn = pending[i];
+      conn->SetKistPending (false);
+      limits[i] = conn->GetKistLimit (m_kistFactor);
+      if (!conn->GetActiveCircuits () || limits[i] == 0)
+        {
+          // a full socket calls us back once it drains
+          continue;
+        }
+      KistEntry e = { conn->GetCircuitMux ()->GetNextKey (PeekPointer (conn)), order++, i };
+      heap.push (e);
+    }
+
+  int64_t budget = m_writebucket.GetSize ();
+  while (!heap.empty () && budget > 0)
+    {
+      KistEntry e = heap.top ();
+      heap.pop ();
+
+      // one cell, picked by the connection's mux
+      Ptr<Connection> conn = pending[e.conn];
+      Ptr<CircuitMux> mux = conn->GetCircuitMux ();
+      uint32_t before = conn->GetOutbufSize ();
+      uint32_t size = mux->Fill (PeekPointer (conn), before + 1) - before;
+      if (size == 0)
+        {
+          continue;
+        }
+      limits[e.conn] -= min (limits[e.conn], size);
+      budget -= size;
+
+      if (limits[e.conn] > 0)
+        {
+          e.key = mux->GetNextKey (PeekPointer (conn));
+          e.order = order++;
+          heap.push (e);
+        }
+    }
+
+  uint32_t written_bytes = 0;
+  for (uint32_t i = 0; i < pending.size (); i++)
+    {
+      if (pending[i]->GetOutbufSize () > 0)
+        {
+          written_bytes += pending[i]->Flush (pending[i]->GetSocket ()->GetTxAvailable ());
+        }
+    }
+  GlobalBucketsDecrement (0, written_bytes);
+
+  // connections left behind by the empty bucket wait for the refill
+  while (!heap.empty ())
+    {
+      uint32_t i = heap.top ().conn;
+      heap.pop ();
+      if (!pending[i]->IsWriteStarved ())
+        {
+          pending[i]->SetWriteStarved (true);
+          m_starvedWrites.push_back (pending[i]);
+        }
+    }
+}
+
+
+Ptr<CircuitMux>
+TorApp::CreateCircuitMux ()
+{
+  if (m_circuitMux == "Ewma")
+    {
+      return Create<EwmaCircuitMux> ();
+    }
+  NS_ABORT_MSG_UNLESS (m_circuitMux == "RoundRobin", "Unknown CircuitMux " << m_circuitMux);
+  return Create<RoundRobinCircuitMux> ();
+}
+
+
 /** Helper function to decide how many bytes out of global_bucket
  * we're willing to use for this transaction. Yes, this is how Tor
  * implements it; no kidding. */
@@ -554,7 +735,7 @@ TorApp::RoundRobin (int base, int64_t global_bucket)
 
 
 
-Circuit::Circuit (uint16_t circ_id, Ptr<Connection> n_conn, Ptr<Connection> p_conn,
+Circuit::Circuit (uint32_t circ_id, Ptr<Connection> n_conn, Ptr<Connection> p_conn,
                   int windowStart, int windowIncrement) : BaseCircuit (circ_id)
 {
   this->p_cellQ = new queue<Ptr<Packet> >;
@@ -570,6 +751,15 @@ Circuit::Circuit (uint16_t circ_id, Ptr<Connection> n_conn, Ptr<Connection> p_co
 
   this->next_active_on_n_conn = 0;
   this->next_active_on_p_conn = 0;
+
+  m_linkId[INBOUND] = p_conn->SpeaksCells () ? p_conn->AddLinkCircuit (this) : 0;
+  m_linkId[OUTBOUND] = n_conn->SpeaksCells () ? n_conn->AddLinkCircuit (this) : 0;
+
+  for (int i = 0; i < 2; i++)
+    {
+      m_cellCount[i] = 0;
+      m_cellCountTime[i] = Simulator::Now ();
+    }
 }
 
 
@@ -587,6 +777,14 @@ Circuit::DoDispose ()
   this->next_active_on_n_conn = 0;
   this->p_conn->SetActiveCircuits (0);
   this->n_conn->SetActiveCircuits (0);
+  if (this->p_conn->SpeaksCells ())
+    {
+      this->p_conn->RemoveLinkCircuit (m_linkId[INBOUND]);
+    }
+  if (this->n_conn->SpeaksCells ())
+    {
+      this->n_conn->RemoveLinkCircuit (m_linkId[OUTBOUND]);
+    }
 }
 
 
@@ -604,6 +802,13 @@ Circuit::PopQueue (queue<Ptr<Packet> > *queue)
 }
 
 
+void
+Circuit::QueueCell (CellDirection direction, Ptr<Packet> cell)
+{
+  GetQueue (direction)->push (cell);
+  GetConnection (direction)->GetCircuitMux ()->CellQueued (this, direction);
+}
+
 Ptr<Packet>
 Circuit::PopCell (CellDirection direction)
 {
@@ -635,8 +840,9 @@ Circuit::PopCell (CellDirection direction)
             {
               IncDeliverWindow ();
               NS_LOG_LOGIC ("[Circuit " << GetId () << "] Send SENDME cell ");
-              Ptr<Packet> sendme_cell = CreateSendme ();
-              GetQueue (BaseCircuit::GetOppositeDirection (direction))->push (sendme_cell);
+              CellDirection oppdir = BaseCircuit::GetOppositeDirection (direction);
+              Ptr<Packet> sendme_cell = CreateSendme (oppdir);
+              QueueCell (oppdir, sendme_cell);
               GetOppositeConnection (direction)->ScheduleWrite ();
             }
         }
@@ -688,7 +894,7 @@ Circuit::PushCell (Ptr<Packet> cell, CellDirection direction)
         }
 
       IncrementStats (direction, CELL_PAYLOAD_SIZE, 0);
-      GetQueue (direction)->push (cell);
+      QueueCell (direction, cell);
     }
 }
 
@@ -767,6 +973,12 @@ Circuit::GetOppositeDirection (Ptr<Connection> conn)
     }
 }
 
+uint16_t
+Circuit::GetLinkId (CellDirection direction)
+{
+  return m_linkId[direction];
+}
+
 Ptr<Circuit>
 Circuit::GetNextCirc (Ptr<Connection> conn)
 {
@@ -813,15 +1025,15 @@ Circuit::IsSendme (Ptr<Packet> cell)
 }
 
 Ptr<Packet>
-Circuit::CreateSendme ()
+Circuit::CreateSendme (CellDirection direction)
 {
   CellHeader h;
-  h.SetCircId (GetId ());
+  h.SetCircId (GetLinkId (direction));
   h.SetType (RELAY);
   h.SetStreamId (42);
   h.SetCmd (RELAY_SENDME);
   h.SetLength (0);
-  Ptr<Packet> cell = Create<Packet> (CELL_PAYLOAD_SIZE);
+  Ptr<Packet> cell = CellPool::Acquire (CELL_PAYLOAD_SIZE);
   cell->AddHeader (h);
 
   return cell;
@@ -887,6 +1099,44 @@ Circuit::IncDeliverWindow ()
     }
 }
 
+/* Resize the windows of a running circuit. Both ends shift by the same
+ * amount, so cells in flight and pending sendmes stay accounted for. */
+void
+Circuit::SetWindow (int start, int increment)
+{
+  int delta = start - m_windowStart;
+  bool opened = package_window <= 0 && package_window + delta > 0;
+  m_windowStart = start;
+  m_windowIncrement = increment;
+  package_window += delta;
+  deliver_window += delta;
+
+  // as on a sendme, resume the edge that blocked on the package window
+  Ptr<Connection> edges[2] = { p_conn, n_conn };
+  for (int i = 0; i < 2 && opened; ++i)
+    {
+      if (!edges[i]->SpeaksCells () && edges[i]->IsBlocked ())
+        {
+          edges[i]->SetBlocked (false);
+          edges[i]->ScheduleRead ();
+        }
+    }
+}
+
+double
+Circuit::GetCellCount (CellDirection direction)
+{
+  double age = (Simulator::Now () - m_cellCountTime[direction]).GetSeconds ();
+  return m_cellCount[direction] * pow (0.5, age / CIRCUIT_EWMA_HALFLIFE);
+}
+
+void
+Circuit::IncCellCount (CellDirection direction)
+{
+  m_cellCount[direction] = GetCellCount (direction) + 1;
+  m_cellCountTime[direction] = Simulator::Now ();
+}
+
 uint32_t
 Circuit::SendCell (CellDirection direction)
 {
@@ -896,8 +1146,9 @@ Circuit::SendCell (CellDirection direction)
       return 0;
     }
 
+  // cells to an edge have lost their header, see PushCell
   Ptr<Connection> conn = GetConnection (direction);
-  if (conn->IsBlocked () || conn->GetSocket ()->GetTxAvailable () < CELL_NETWORK_SIZE)
+  if (conn->IsBlocked () || conn->GetSocket ()->GetTxAvailable () < cellQ->front ()->GetSize ())
     {
       return 0;
     }
@@ -917,9 +1168,15 @@ Connection::Connection (TorApp* torapp, Ipv4Address ip, int conntype)
 {
   this->torapp = torapp;
   this->remote = ip;
-  this->inbuf.size = 0;
-  this->outbuf.size = 0;
+  this->inbuf = Create<Packet> ();
+  this->outbuf = Create<Packet> ();
   this->reading_blocked = 0;
+  this->read_starved = false;
+  this->write_starved = false;
+  this->kist_pending = false;
+  this->m_cwnd = 0;
+  this->m_sndbuf = 0;
+  this->m_mux = torapp->CreateCircuitMux ();
   this->active_circuits = 0;
 
   m_socket = 0;
@@ -930,6 +1187,10 @@ Connection::Connection (TorApp* torapp, Ipv4Address ip, int conntype)
 Connection::~Connection ()
 {
   NS_LOG_FUNCTION (this);
+  if (m_socket && torapp->m_kist)
+    {
+      m_socket->TraceDisconnectWithoutContext ("CongestionWindow", MakeCallback (&Connection::CwndChanged, this));
+    }
 }
 
 Ptr<Circuit>
@@ -944,6 +1205,38 @@ Connection::SetActiveCircuits (Ptr<Circuit> circ)
   active_circuits = circ;
 }
 
+/* The link id is the circuit's position on this connection, and it is never
+ * sent with the circuit's global id. Both ends must therefore add the
+ * link's circuits in the same order. The helpers do this by creating every
+ * circuit on all of its relays, in circuit order, before the simulation
+ * starts. */
+uint16_t
+Connection::AddLinkCircuit (Ptr<Circuit> circ)
+{
+  NS_ABORT_MSG_IF (m_linkCircuits.size () > 0xffff, "More than 65536 circuits on the link to " << remote);
+  m_linkCircuits.push_back (circ);
+  return m_linkCircuits.size () - 1;
+}
+
+Ptr<Circuit>
+Connection::GetLinkCircuit (uint16_t id)
+{
+  return id < m_linkCircuits.size () ? m_linkCircuits[id] : 0;
+}
+
+void
+Connection::RemoveLinkCircuit (uint16_t id)
+{
+  NS_ASSERT (id < m_linkCircuits.size ());
+  m_linkCircuits[id] = 0;
+}
+
+Ptr<CircuitMux>
+Connection::GetCircuitMux ()
+{
+  return m_mux;
+}
+
 
 uint8_t
 Connection::GetType ()
@@ -969,6 +1262,42 @@ Connection::SetBlocked (bool b)
   reading_blocked = b;
 }
 
+bool
+Connection::IsReadStarved ()
+{
+  return read_starved;
+}
+
+void
+Connection::SetReadStarved (bool b)
+{
+  read_starved = b;
+}
+
+bool
+Connection::IsWriteStarved ()
+{
+  return write_starved;
+}
+
+void
+Connection::SetWriteStarved (bool b)
+{
+  write_starved = b;
+}
+
+bool
+Connection::IsKistPending ()
+{
+  return kist_pending;
+}
+
+void
+Connection::SetKistPending (bool b)
+{
+  kist_pending = b;
+}
+
 
 Ptr<Socket>
 Connection::GetSocket ()
@@ -979,7 +1308,22 @@ Connection::GetSocket ()
 void
 Connection::SetSocket (Ptr<Socket> socket)
 {
+  Ptr<Socket> old = m_socket;
   m_socket = socket;
+  torapp->IndexConn (this, old);
+
+  // KIST needs the congestion state of TCP sockets
+  if (torapp->m_kist && socket && socket != old)
+    {
+      UintegerValue sndbuf;
+      if (socket->GetAttributeFailSafe ("SndBufSize", sndbuf))
+        {
+          NS_ABORT_MSG_IF (socket->GetInstanceTypeId ().GetName () == "ns3::NscTcpSocketImpl",
+                           "Kist needs the congestion window, which NSC sockets do not trace");
+          m_sndbuf = sndbuf.Get ();
+          socket->TraceConnectWithoutContext ("CongestionWindow", MakeCallback (&Connection::CwndChanged, this));
+        }
+    }
 }
 
 Ipv4Address
@@ -991,6 +1335,8 @@ Connection::GetRemote ()
 
 
 
+// Cells are sliced out of the received packet as fragments, which share its
+// buffer; only a cell straddling two reads is assembled from two pieces.
 uint32_t
 Connection::Read (vector<Ptr<Packet> >* packet_list, uint32_t max_read)
 {
@@ -999,90 +1345,117 @@ Connection::Read (vector<Ptr<Packet> >* packet_list, uint32_t max_read)
       return 0;
     }
 
-  uint8_t raw_data[max_read + this->inbuf.size];
-  memcpy (raw_data, this->inbuf.data, this->inbuf.size);
-  int read_bytes = m_socket->Recv (&raw_data[this->inbuf.size], max_read, 0);
+  Ptr<Packet> data = m_socket->Recv (max_read, 0);
+  if (!data)
+    {
+      return 0;
+    }
+  data->RemoveAllPacketTags ();
+  data->RemoveAllByteTags ();
 
   uint32_t base = SpeaksCells () ? CELL_NETWORK_SIZE : CELL_PAYLOAD_SIZE;
-  uint32_t datasize = read_bytes + inbuf.size;
-  uint32_t leftover = datasize % base;
-  int num_packages = datasize / base;
+  uint32_t read_bytes = data->GetSize ();
+  uint32_t offset = 0;
+
+  // complete the leftover cell
+  if (inbuf->GetSize () > 0)
+    {
+      offset = min (base - inbuf->GetSize (), read_bytes);
+      inbuf->AddAtEnd (data->CreateFragment (0, offset));
+      if (inbuf->GetSize () < base)
+        {
+          return read_bytes;
+        }
+      packet_list->push_back (inbuf);
+      inbuf = Create<Packet> ();
+    }
 
   // slice data into packets
-  Ptr<Packet> cell;
-  for (int i = 0; i < num_packages; i++)
+  while (read_bytes - offset >= base)
     {
-      cell = Create<Packet> (&raw_data[i * base], base);
-      packet_list->push_back (cell);
+      packet_list->push_back (data->CreateFragment (offset, base));
+      offset += base;
     }
 
-  //safe leftover
-  memcpy (inbuf.data, &raw_data[datasize - leftover], leftover);
-  inbuf.size = leftover;
+  // save leftover
+  if (offset < read_bytes)
+    {
+      inbuf = data->CreateFragment (offset, read_bytes - offset);
+    }
 
   return read_bytes;
 }
 
 
+// Cells are appended to the leftover packet and handed to the socket in one
+// Send; whatever the socket does not take stays behind as a fragment.
 uint32_t
 Connection::Write (uint32_t max_write)
 {
-  uint32_t base = SpeaksCells () ? CELL_NETWORK_SIZE : CELL_PAYLOAD_SIZE;
-  uint8_t raw_data[outbuf.size + (max_write / base + 1) * base];
-  memcpy (raw_data, outbuf.data, outbuf.size);
-  uint32_t datasize = outbuf.size;
-  int written_bytes = 0;
-
-  // fill raw_data
-  bool flushed_some = false;
-  Ptr<Circuit> start_circ = GetActiveCircuits ();
-  NS_ASSERT (start_circ);
-  Ptr<Circuit> circ;
-  Ptr<Packet> cell = Ptr<Packet> (NULL);
-  CellDirection direction;
+  NS_ASSERT (GetActiveCircuits ());
+  m_mux->Fill (this, max_write);
+  return Flush (max_write);
+}
 
-  while (datasize < max_write)
+/* Move one cell of circ onto the outbuf. Returns its size, 0 if circ had none to give. */
+uint32_t
+Connection::AppendCell (Ptr<Circuit> circ)
+{
+  Ptr<Packet> cell = circ->PopCell (circ->GetDirection (this));
+  if (!cell)
     {
-      circ = GetActiveCircuits ();
-      NS_ASSERT (circ);
-
-      direction = circ->GetDirection (this);
-      cell = circ->PopCell (direction);
-
-      if (cell)
-        {
-          datasize += cell->CopyData (&raw_data[datasize], cell->GetSize ());
-          flushed_some = true;
-        }
-
-      SetActiveCircuits (circ->GetNextCirc (this));
-
-      if (GetActiveCircuits () == start_circ)
-        {
-          if (!flushed_some)
-            {
-              break;
-            }
-          flushed_some = false;
-        }
+      return 0;
     }
+  uint32_t size = cell->GetSize ();
+  outbuf->AddAtEnd (cell);
+  CellPool::Release (cell);
+  circ->IncCellCount (circ->GetDirection (this));
+  return size;
+}
+
+/* Send up to max_write bytes of the outbuf to the socket. */
+uint32_t
+Connection::Flush (uint32_t max_write)
+{
+  uint32_t datasize = outbuf->GetSize ();
+  int written_bytes = 0;
 
-  // send data
   max_write = min (max_write, datasize);
   if (max_write > 0)
     {
-      written_bytes = m_socket->Send (raw_data, max_write, 0);
+      written_bytes = m_socket->Send (outbuf->CreateFragment (0, max_write), 0);
     }
 
   /* save leftover for next time */
   written_bytes = max (written_bytes,0);
-  uint32_t leftover = datasize - written_bytes;
-  memcpy (outbuf.data, &raw_data[datasize - leftover], leftover);
-  outbuf.size = leftover;
+  outbuf = outbuf->CreateFragment (written_bytes, datasize - written_bytes);
 
   return written_bytes;
 }
 
+/* Bytes of cells KIST may add to the outbuf (the last cell may overshoot):
+ * what the socket can take, capped so that it holds no more than
+ * (1 + factor) congestion windows. */
+uint32_t
+Connection::GetKistLimit (double factor)
+{
+  int64_t tx = m_socket->GetTxAvailable ();
+  int64_t limit = tx;
+  if (m_cwnd > 0)
+    {
+      int64_t queued = (int64_t) m_sndbuf - tx;
+      limit = min (limit, (int64_t) ((1 + factor) * m_cwnd) - queued);
+    }
+  limit -= outbuf->GetSize ();
+  return limit < 0 ? 0 : limit;
+}
+
+void
+Connection::CwndChanged (uint32_t oldCwnd, uint32_t newCwnd)
+{
+  m_cwnd = newCwnd;
+}
+
 
 void
 Connection::ScheduleWrite (Time delay)
@@ -1106,13 +1479,138 @@ Connection::ScheduleRead (Time delay)
 uint32_t
 Connection::GetOutbufSize ()
 {
-  return outbuf.size;
+  return outbuf->GetSize ();
 }
 
 uint32_t
 Connection::GetInbufSize ()
 {
-  return inbuf.size;
+  return inbuf->GetSize ();
+}
+
+
+
+CircuitMux::~CircuitMux ()
+{
+}
+
+void
+CircuitMux::CellQueued (Ptr<Circuit> circ, CellDirection direction)
+{
+}
+
+// all equal: KIST takes turns between the connections
+double
+CircuitMux::GetNextKey (Connection* conn)
+{
+  return 0;
+}
+
+
+uint32_t
+RoundRobinCircuitMux::Fill (Connection* conn, uint32_t max_write)
+{
+  uint32_t datasize = conn->GetOutbufSize ();
+  bool flushed_some = false;
+  Ptr<Circuit> start_circ = conn->GetActiveCircuits ();
+  Ptr<Circuit> circ;
+
+  while (datasize < max_write)
+    {
+      circ = conn->GetActiveCircuits ();
+      NS_ASSERT (circ);
+
+      uint32_t size = conn->AppendCell (circ);
+      if (size > 0)
+        {
+          datasize += size;
+          flushed_some = true;
+        }
+
+      conn->SetActiveCircuits (circ->GetNextCirc (conn));
+
+      if (conn->GetActiveCircuits () == start_circ)
+        {
+          if (!flushed_some)
+            {
+              break;
+            }
+          flushed_some = false;
+        }
+    }
+
+  return datasize;
+}
+
+
+EwmaCircuitMux::EwmaCircuitMux ()
+{
+  m_order = 0;
+}
+
+bool
+EwmaCircuitMux::Entry::operator< (const Entry &other) const
+{
+  // the heap keeps the largest on top; we want the lowest key
+  if (key != other.key)
+    {
+      return key > other.key;
+    }
+  return order > other.order;
+}
+
+// The cell counts of all circuits decay by the same factor, so their order
+// does not change over time. The key scales every count to a common time
+// origin (in log space) and stays valid until the circuit is written again.
+void
+EwmaCircuitMux::Push (Ptr<Circuit> circ, CellDirection direction)
+{
+  Entry e;
+  e.key = log2 (circ->GetCellCount (direction)) + Simulator::Now ().GetSeconds () / CIRCUIT_EWMA_HALFLIFE;
+  e.order = m_order++;
+  e.circ = circ;
+  m_heap.push_back (e);
+  push_heap (m_heap.begin (), m_heap.end ());
+}
+
+void
+EwmaCircuitMux::CellQueued (Ptr<Circuit> circ, CellDirection direction)
+{
+  if (m_queued.insert (circ).second)
+    {
+      Push (circ, direction);
+    }
+}
+
+uint32_t
+EwmaCircuitMux::Fill (Connection* conn, uint32_t max_write)
+{
+  uint32_t datasize = conn->GetOutbufSize ();
+  while (datasize < max_write && !m_heap.empty ())
+    {
+      pop_heap (m_heap.begin (), m_heap.end ());
+      Ptr<Circuit> circ = m_heap.back ().circ;
+      m_heap.pop_back ();
+
+      datasize += conn->AppendCell (circ);
+
+      CellDirection direction = circ->GetDirection (conn);
+      if (circ->GetQueueSize (direction) > 0)
+        {
+          Push (circ, direction);
+        }
+      else
+        {
+          m_queued.erase (circ);
+        }
+    }
+  return datasize;
+}
+
+double
+EwmaCircuitMux::GetNextKey (Connection* conn)
+{
+  return m_heap.empty () ? numeric_limits<double>::infinity () : m_heap.front ().key;
 }
 
 } //namespace ns3
@@ -1,6 +1,8 @@
 #ifndef __TOR_H__
 #define __TOR_H__
 
+#include <set>
+
 #include "tor-base.h"
 #include "cell-header.h"
 
@@ -14,21 +16,18 @@ namespace ns3 {
 #define CELL_PAYLOAD_SIZE 498
 #define CELL_NETWORK_SIZE 512
 
-struct buf_t
-{
-  uint32_t size; // How many bytes is this buffer holding right now?
-  uint8_t data[CELL_NETWORK_SIZE]; //Left-over chunk, or NULL for none.
-};
+#define CIRCUIT_EWMA_HALFLIFE 30 // seconds
 
 class Circuit;
 class Connection;
+class CircuitMux;
 class TorApp;
 
 
 class Circuit : public BaseCircuit
 {
 public:
-  Circuit (uint16_t, Ptr<Connection>, Ptr<Connection>, int, int);
+  Circuit (uint32_t, Ptr<Connection>, Ptr<Connection>, int, int);
   ~Circuit ();
   void DoDispose ();
 
@@ -43,6 +42,7 @@ public:
   Ptr<Connection> GetOppositeConnection (Ptr<Connection>);
   CellDirection GetDirection (Ptr<Connection>);
   CellDirection GetOppositeDirection (Ptr<Connection>);
+  uint16_t GetLinkId (CellDirection);
 
   Ptr<Circuit> GetNextCirc (Ptr<Connection>);
   void SetNextCirc (Ptr<Connection>, Ptr<Circuit>);
@@ -51,11 +51,16 @@ public:
   void IncPackageWindow ();
   uint32_t GetDeliverWindow ();
   void IncDeliverWindow ();
+  void SetWindow (int start, int increment);
+
+  double GetCellCount (CellDirection);
+  void IncCellCount (CellDirection);
 
 protected:
   Ptr<Packet> PopQueue (queue<Ptr<Packet> >*);
+  void QueueCell (CellDirection, Ptr<Packet>);
   bool IsSendme (Ptr<Packet>);
-  Ptr<Packet> CreateSendme ();
+  Ptr<Packet> CreateSendme (CellDirection);
 
   queue<Ptr<Packet> > *p_cellQ;
   queue<Ptr<Packet> > *n_cellQ;
@@ -66,6 +71,7 @@ protected:
 
   Ptr<Connection> p_conn;   /* The OR connection that is previous in this circuit. */
   Ptr<Connection> n_conn;   /* The OR connection that is next in this circuit. */
+  uint16_t m_linkId[2];     /* Id of the circuit on the connection in each direction. */
 
   /** How many relay data cells can we package (read from edge streams)
    * on this circuit before we receive a circuit-level sendme cell asking
@@ -79,6 +85,10 @@ protected:
 
   int m_windowStart;
   int m_windowIncrement;
+
+  // Exponentially weighted count of cells written per direction, for scheduling priority
+  double m_cellCount[2];
+  Time m_cellCountTime[2];
 };
 
 
@@ -92,14 +102,27 @@ public:
 
   Ptr<Circuit> GetActiveCircuits ();
   void SetActiveCircuits (Ptr<Circuit>);
+  Ptr<CircuitMux> GetCircuitMux ();
+  uint16_t AddLinkCircuit (Ptr<Circuit>);
+  Ptr<Circuit> GetLinkCircuit (uint16_t);
+  void RemoveLinkCircuit (uint16_t);
   uint8_t GetType ();
   bool SpeaksCells ();
   uint32_t Read (vector<Ptr<Packet> >*, uint32_t);
   uint32_t Write (uint32_t);
+  uint32_t AppendCell (Ptr<Circuit>);
+  uint32_t Flush (uint32_t);
+  uint32_t GetKistLimit (double);
   void ScheduleWrite (Time = Seconds (0));
   void ScheduleRead (Time = Seconds (0));
   bool IsBlocked ();
   void SetBlocked (bool);
+  bool IsReadStarved ();
+  void SetReadStarved (bool);
+  bool IsWriteStarved ();
+  void SetWriteStarved (bool);
+  bool IsKistPending ();
+  void SetKistPending (bool);
   Ptr<Socket> GetSocket ();
   void SetSocket (Ptr<Socket>);
   Ipv4Address GetRemote ();
@@ -107,18 +130,29 @@ public:
   uint32_t GetInbufSize ();
 
 private:
+  void CwndChanged (uint32_t, uint32_t);
+
   TorApp* torapp;
   Ipv4Address remote;
   Ptr<Socket> m_socket;
 
-  buf_t inbuf; /**< Buffer holding left over data read over this connection. */
-  buf_t outbuf; /**< Buffer holding left over data to write over this connection. */
+  Ptr<Packet> inbuf; /**< Partial cell left over from the last read over this connection. */
+  Ptr<Packet> outbuf; /**< Data left over to write over this connection. */
 
   uint8_t m_conntype;
   bool reading_blocked;
+  bool read_starved; /**< Waiting in the app's list for a read bucket refill. */
+  bool write_starved;
+  bool kist_pending;
+
+  uint32_t m_cwnd; /**< Congestion window of the socket, 0 if unknown. */
+  uint32_t m_sndbuf;
 
   // Linked ring of circuits
   Ptr<Circuit> active_circuits;
+  Ptr<CircuitMux> m_mux;
+
+  vector<Ptr<Circuit> > m_linkCircuits; /**< Circuits by link-local id, see AddLinkCircuit. */
 
   EventId read_event;
   EventId write_event;
@@ -128,6 +162,57 @@ private:
 
 
 
+/** Decides which circuits a connection writes its cells from. */
+class CircuitMux : public SimpleRefCount<CircuitMux>
+{
+public:
+  virtual ~CircuitMux ();
+  /* circ queued a cell for the connection, which it reaches in direction. */
+  virtual void CellQueued (Ptr<Circuit> circ, CellDirection direction);
+  /* Move cells onto the outbuf of conn until it holds max_write bytes or
+   * no circuit has any left. Returns the outbuf size. */
+  virtual uint32_t Fill (Connection* conn, uint32_t max_write) = 0;
+  /* Priority of the circuit Fill serves next, lowest first. KIST compares
+   * it across connections. */
+  virtual double GetNextKey (Connection* conn);
+};
+
+/** Tor's original policy: one cell per circuit, walking the connection's ring. */
+class RoundRobinCircuitMux : public CircuitMux
+{
+public:
+  virtual uint32_t Fill (Connection*, uint32_t);
+};
+
+/** Like Tor's circuitmux_ewma: serves the circuit with the lowest
+ * exponentially weighted count of cells written, out of a heap that holds
+ * only the circuits with queued cells. */
+class EwmaCircuitMux : public CircuitMux
+{
+public:
+  EwmaCircuitMux ();
+  virtual void CellQueued (Ptr<Circuit>, CellDirection);
+  virtual uint32_t Fill (Connection*, uint32_t);
+  virtual double GetNextKey (Connection*);
+
+private:
+  struct Entry
+  {
+    double key;
+    uint64_t order;
+    Ptr<Circuit> circ;
+    bool operator< (const Entry &other) const;
+  };
+  void Push (Ptr<Circuit>, CellDirection);
+
+  vector<Entry> m_heap;
+  set<Ptr<Circuit> > m_queued;
+  uint64_t m_order;
+};
+
+
+
+
 class TorApp : public TorBaseApp
 {
 public:
@@ -139,8 +224,9 @@ public:
 
   virtual void StartApplication (void);
   virtual void StopApplication (void);
+  virtual void Reconfigure (void);
 
-  Ptr<Circuit> GetCircuit (uint16_t);
+  Ptr<Circuit> GetCircuit (uint32_t);
 
   virtual Ptr<Connection> AddConnection (Ipv4Address, int);
   void AddActiveCircuit (Ptr<Connection>, Ptr<Circuit>);
@@ -154,21 +240,35 @@ public:
   void PackageRelayCellImpl (uint16_t, Ptr<Packet>);
   void ReceiveRelayCell (Ptr<Connection> conn, Ptr<Packet> cell);
   void AppendCellToCircuitQueue (Ptr<Circuit> circ, Ptr<Packet> cell, CellDirection direction);
-  Ptr<Circuit> LookupCircuitFromCell (Ptr<Packet>);
+  Ptr<Circuit> LookupCircuitFromCell (Ptr<Connection>, Ptr<Packet>);
   void RefillReadCallback (int64_t);
   void RefillWriteCallback (int64_t);
   void GlobalBucketsDecrement (uint32_t num_read, uint32_t num_written);
   uint32_t RoundRobin (int base, int64_t bucket);
+  void KistAddPending (Ptr<Connection>);
+  void KistSchedule ();
+  virtual Ptr<CircuitMux> CreateCircuitMux ();
   Ptr<Connection> LookupConn (Ptr<Socket>);
+  void IndexConn (Ptr<Connection>, Ptr<Socket>);
 
   Ptr<Socket> listen_socket;
   vector<Ptr<Connection> > connections;
-  map<uint16_t,Ptr<Circuit> > circuits;
+  sgi::hash_map<Ptr<Socket>,Ptr<Connection>,SocketHash> m_socketConnections;
+  CircuitTable<Circuit> circuits;
   int m_windowStart;
   int m_windowIncrement;
 
-  Ptr<Connection> m_scheduleReadHead;
-  Ptr<Connection> m_scheduleWriteHead;
+  string m_circuitMux;
+  bool m_kist;
+  Time m_kistInterval;
+  double m_kistFactor;
+  Time m_kistLast;
+  EventId m_kistEvent;
+  vector<Ptr<Connection> > m_kistPending;
+
+  // Connections that found the bucket empty, in the order they ran dry
+  vector<Ptr<Connection> > m_starvedReads;
+  vector<Ptr<Connection> > m_starvedWrites;
 
 protected:
   virtual void DoDispose (void);
@@ -0,0 +1,133 @@
+#include <map>
+
+#include "ns3/test.h"
+#include "ns3/bktap-base.h"
+
+using namespace ns3;
+
+/* Drives a CellRing the way a sequence queue does: cells arrive ahead of
+ * the others with holes, late below the lowest one, and leave from the
+ * front as they are acked or anywhere as holes fill. Sequence numbers start
+ * just below the 32-bit wrap and the span grows past the initial array. A
+ * std::map keyed by the distance from the first number is the reference. */
+class CellRingMapTestCase : public TestCase
+{
+public:
+  CellRingMapTestCase ();
+  virtual void DoRun (void);
+private:
+  void Compare (const CellRing &ring, std::map<int32_t, Ptr<Packet> > &ref, uint32_t origin);
+};
+
+CellRingMapTestCase::CellRingMapTestCase ()
+  : TestCase ("Check CellRing against std::map across wrap-around and growth")
+{
+}
+void
+CellRingMapTestCase::Compare (const CellRing &ring, std::map<int32_t, Ptr<Packet> > &ref, uint32_t origin)
+{
+  NS_TEST_ASSERT_MSG_EQ (ring.Size (), ref.size (), "Sizes differ");
+  if (ref.empty ())
+    {
+      return;
+    }
+  int32_t low = ref.begin ()->first;
+  int32_t high = ref.rbegin ()->first;
+  NS_TEST_ASSERT_MSG_EQ (ring.Lowest (), origin + low, "Lowest sequence number");
+  for (int32_t k = low - 3; k <= high + 3; ++k)
+    {
+      std::map<int32_t, Ptr<Packet> >::iterator it = ref.find (k);
+      NS_TEST_ASSERT_MSG_EQ (ring.Has (origin + k), (it != ref.end ()), "Has " << k);
+      NS_TEST_ASSERT_MSG_EQ (ring.Get (origin + k), (it != ref.end () ? it->second : Ptr<Packet> ()), "Get " << k);
+    }
+}
+void
+CellRingMapTestCase::DoRun (void)
+{
+  CellRing ring;
+  std::map<int32_t, Ptr<Packet> > ref;
+  const uint32_t origin = 0xffffff00;
+  int32_t next = 0;
+  uint32_t seed = 7;
+  uint32_t maxSpan = 0;
+  for (uint32_t n = 0; n < 20000; ++n)
+    {
+      seed = seed * 1103515245 + 12345;
+      uint32_t r = seed >> 8;
+      int32_t k;
+      switch (r % 10)
+        {
+        case 0: case 1: case 2: case 3: case 4: case 5:
+          k = next + r / 10 % 8;
+          next = k + 1;
+          ring.Insert (origin + k, Create<Packet> (1));
+          ref[k] = ring.Get (origin + k);
+          break;
+        case 6:
+          k = (ref.empty () ? next : ref.begin ()->first) - 1 - r / 10 % 4;
+          ring.Insert (origin + k, Create<Packet> (1));
+          ref[k] = ring.Get (origin + k);
+          break;
+        case 7: case 8:
+          if (!ref.empty ())
+            {
+              ring.Erase (origin + ref.begin ()->first);
+              ref.erase (ref.begin ());
+            }
+          break;
+        default:
+          if (!ref.empty ())
+            {
+              int32_t low = ref.begin ()->first;
+              k = low + r / 10 % (ref.rbegin ()->first - low + 1);
+              ring.Erase (origin + k);
+              ref.erase (k);
+            }
+          break;
+        }
+      // keep the span in the hundreds, the array grows a few times
+      while (ref.size () > 400)
+        {
+          ring.Erase (origin + ref.begin ()->first);
+          ref.erase (ref.begin ());
+        }
+      if (!ref.empty ())
+        {
+          maxSpan = std::max (maxSpan, (uint32_t) (ref.rbegin ()->first - ref.begin ()->first + 1));
+        }
+      if (n % 97 == 0)
+        {
+          Compare (ring, ref, origin);
+        }
+      else
+        {
+          NS_TEST_ASSERT_MSG_EQ (ring.Size (), ref.size (), "Sizes differ after step " << n);
+        }
+    }
+  Compare (ring, ref, origin);
+  NS_TEST_EXPECT_MSG_GT (maxSpan, 256u, "The ring should have grown past its initial size");
+  NS_TEST_EXPECT_MSG_GT ((uint32_t) next, (uint32_t) 0x100, "Sequence numbers should have wrapped");
+
+  // an erased cell goes back to the pool once the ring held its last reference
+  while (!ref.empty ())
+    {
+      ring.Erase (origin + ref.begin ()->first);
+      ref.erase (ref.begin ());
+    }
+  Ptr<Packet> cell = CellPool::Acquire (10);
+  Packet *raw = PeekPointer (cell);
+  ring.Insert (origin, cell);
+  cell = 0;
+  ring.Erase (origin);
+  NS_TEST_EXPECT_MSG_EQ (PeekPointer (CellPool::Acquire (10)), raw, "Erase releases the cell");
+}
+
+static class CellRingTestSuite : public TestSuite
+{
+public:
+  CellRingTestSuite ()
+    : TestSuite ("tor-cell-ring", UNIT)
+  {
+    AddTestCase (new CellRingMapTestCase (), TestCase::QUICK);
+  }
+} g_cellRingTestSuite;
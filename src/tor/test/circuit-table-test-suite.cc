@@ -0,0 +1,104 @@
+#include <map>
+
+#include "ns3/test.h"
+#include "ns3/tor-base.h"
+
+using namespace ns3;
+
+class TableEntry : public SimpleRefCount<TableEntry>
+{
+public:
+  TableEntry (uint32_t id) : id (id)
+  {
+  }
+  uint32_t id;
+};
+
+/* Adds ids of several shapes, replaces some of them and compares the
+ * table against a std::map at every capacity doubling. Iterating sorts the
+ * entries, so the replacements after a check also cover the slot indices
+ * refreshed by the sort. */
+class CircuitTableMapTestCase : public TestCase
+{
+public:
+  CircuitTableMapTestCase ();
+  virtual void DoRun (void);
+private:
+  void Compare (CircuitTable<TableEntry> &table, std::map<uint32_t, Ptr<TableEntry> > &ref);
+};
+
+CircuitTableMapTestCase::CircuitTableMapTestCase ()
+  : TestCase ("Check CircuitTable against std::map across rehashes")
+{
+}
+void
+CircuitTableMapTestCase::Compare (CircuitTable<TableEntry> &table, std::map<uint32_t, Ptr<TableEntry> > &ref)
+{
+  NS_TEST_ASSERT_MSG_EQ (table.size (), ref.size (), "Sizes differ");
+  std::map<uint32_t, Ptr<TableEntry> >::iterator it = ref.begin ();
+  for (CircuitTable<TableEntry>::Iterator i = table.begin (); i != table.end (); ++i, ++it)
+    {
+      NS_TEST_ASSERT_MSG_EQ (*i, it->second, "Iteration is not in id order");
+      NS_TEST_ASSERT_MSG_EQ (table.Get (it->first), it->second, "Lookup of " << it->first);
+    }
+  for (uint32_t id = 1; id < 1000; id += 7)
+    {
+      NS_TEST_ASSERT_MSG_EQ ((table[id * 40503] == 0), (ref.find (id * 40503) == ref.end ()), "Lookup of " << id * 40503);
+    }
+  NS_TEST_ASSERT_MSG_EQ ((table.Get (0xffffffff) == 0), true, "The reserved id is never found");
+}
+void
+CircuitTableMapTestCase::DoRun (void)
+{
+  CircuitTable<TableEntry> table;
+  std::map<uint32_t, Ptr<TableEntry> > ref;
+  uint32_t seed = 1;
+  for (uint32_t n = 0; n < 6000; ++n)
+    {
+      uint32_t id;
+      switch (n % 4)
+        {
+        case 0:
+          id = n / 4;   // dense, as in most scenarios
+          break;
+        case 1:
+          id = (n / 4) << 16;   // equal modulo every capacity
+          break;
+        case 2:
+          seed = seed * 1103515245 + 12345;
+          id = seed;
+          break;
+        default:
+          // replace an id that is already there
+          id = ref.empty () ? 0 : (n / 4) * 7 / 4;
+          break;
+        }
+      if (id == 0xffffffff)
+        {
+          continue;
+        }
+      Ptr<TableEntry> entry = Create<TableEntry> (id);
+      table.Add (id, entry);
+      ref[id] = entry;
+      if ((ref.size () & (ref.size () - 1)) == 0 || n % 997 == 0)
+        {
+          Compare (table, ref);
+        }
+    }
+  Compare (table, ref);
+
+  table.clear ();
+  NS_TEST_EXPECT_MSG_EQ (table.size (), 0u, "Cleared");
+  NS_TEST_EXPECT_MSG_EQ ((table.begin () == table.end ()), true, "Cleared");
+  NS_TEST_EXPECT_MSG_EQ ((table.Get (1 << 16) == 0), true, "Cleared");
+}
+
+static class CircuitTableTestSuite : public TestSuite
+{
+public:
+  CircuitTableTestSuite ()
+    : TestSuite ("tor-circuit-table", UNIT)
+  {
+    AddTestCase (new CircuitTableMapTestCase (), TestCase::QUICK);
+  }
+} g_circuitTableTestSuite;
@@ -0,0 +1,168 @@
+#include <map>
+
+#include "ns3/test.h"
+#include "ns3/bktap-base.h"
+
+using namespace ns3;
+
+/* Sets, marks and clears entries of a SentSeqRing in a window that moves up
+ * across the 32-bit wrap, with occasional jumps far enough ahead that the
+ * ring must drop its oldest entries. The reference is a std::map of the
+ * entries with any state, keyed by the distance from the first number; it
+ * drops and ignores entries the way the ring is documented to. */
+class SentSeqRingMapTestCase : public TestCase
+{
+public:
+  SentSeqRingMapTestCase ();
+  virtual void DoRun (void);
+private:
+  struct Entry
+  {
+    Entry () : sent (false), retx (false)
+    {
+    }
+    bool sent;
+    bool retx;
+    Time at;
+  };
+  typedef std::map<int64_t, Entry> Ref;
+
+  Entry* Touch (Ref &ref, int64_t k);
+  void Compare (const SentSeqRing &ring, Ref &ref, int64_t from, int64_t to);
+
+  uint32_t m_origin;
+};
+
+SentSeqRingMapTestCase::SentSeqRingMapTestCase ()
+  : TestCase ("Check SentSeqRing against std::map across wrap-around and overflow"),
+    m_origin (0xfffff000)
+{
+}
+SentSeqRingMapTestCase::Entry*
+SentSeqRingMapTestCase::Touch (Ref &ref, int64_t k)
+{
+  const int64_t span = SentSeqRing::MAX_SPAN;
+  if (!ref.empty () && k < ref.begin ()->first && ref.rbegin ()->first - k + 1 > span)
+    {
+      return 0;
+    }
+  while (!ref.empty () && k - ref.begin ()->first >= span)
+    {
+      ref.erase (ref.begin ());
+    }
+  return &ref[k];
+}
+void
+SentSeqRingMapTestCase::Compare (const SentSeqRing &ring, Ref &ref, int64_t from, int64_t to)
+{
+  int64_t last = -1;
+  for (Ref::iterator it = ref.begin (); it != ref.end (); ++it)
+    {
+      if (it->second.sent)
+        {
+          last = it->first;
+        }
+    }
+  NS_TEST_ASSERT_MSG_EQ (ring.Empty (), (last < 0), "Empty");
+  if (last >= 0)
+    {
+      NS_TEST_ASSERT_MSG_EQ (ring.LastSent (), (uint32_t) (m_origin + last), "LastSent");
+    }
+  for (int64_t k = from; k <= to; ++k)
+    {
+      uint32_t seq = m_origin + k;
+      Ref::iterator it = ref.find (k);
+      bool sent = it != ref.end () && it->second.sent;
+      bool retx = it != ref.end () && it->second.retx;
+      NS_TEST_ASSERT_MSG_EQ (ring.HasSent (seq), sent, "HasSent " << k);
+      NS_TEST_ASSERT_MSG_EQ (ring.IsRetx (seq), retx, "IsRetx " << k);
+      if (sent)
+        {
+          NS_TEST_ASSERT_MSG_EQ (ring.GetSent (seq), it->second.at, "GetSent " << k);
+        }
+    }
+}
+void
+SentSeqRingMapTestCase::DoRun (void)
+{
+  SentSeqRing ring;
+  Ref ref;
+  int64_t next = 0;
+  uint32_t seed = 3;
+  for (uint32_t n = 0; n < 30000; ++n)
+    {
+      seed = seed * 1103515245 + 12345;
+      uint32_t r = seed >> 8;
+      int64_t low = ref.empty () ? next : ref.begin ()->first;
+      int64_t k;
+      Entry *e;
+      switch (r % 16)
+        {
+        case 0: case 1: case 2: case 3: case 4: case 5:
+          k = next++;
+          ring.SetSent (m_origin + k, NanoSeconds (n));
+          if ((e = Touch (ref, k)))
+            {
+              e->sent = true;
+              e->at = NanoSeconds (n);
+            }
+          break;
+        case 6:
+          // retransmission of an older one, or a late one below the lowest
+          k = low + (int64_t) (r / 16 % (next - low + 8)) - 4;
+          ring.SetSent (m_origin + k, NanoSeconds (n));
+          ring.SetRetx (m_origin + k);
+          if ((e = Touch (ref, k)))
+            {
+              e->sent = true;
+              e->retx = true;
+              e->at = NanoSeconds (n);
+            }
+          break;
+        case 7:
+          // far ahead, so the oldest entries are dropped
+          if (r / 16 % 50 == 0)
+            {
+              next += SentSeqRing::MAX_SPAN - 100 + r / 16 % 300;
+            }
+          break;
+        default:
+          k = low + (int64_t) (r / 16 % (next - low + 1));
+          ring.Clear (m_origin + k);
+          ref.erase (k);
+          break;
+        }
+      if (n % 101 == 0)
+        {
+          int64_t lo = ref.empty () ? next : ref.begin ()->first;
+          Compare (ring, ref, lo - 5, next + 5);
+        }
+    }
+  NS_TEST_EXPECT_MSG_GT (next, (int64_t) 0x1000, "Sequence numbers should have wrapped");
+
+  // the whole window at once: only the newest MAX_SPAN entries stay
+  SentSeqRing full;
+  Ref fullRef;
+  for (int64_t k = 0; k < SentSeqRing::MAX_SPAN + 10; ++k)
+    {
+      full.SetSent (m_origin + k, NanoSeconds (k));
+      Entry *f = Touch (fullRef, k);
+      f->sent = true;
+      f->at = NanoSeconds (k);
+    }
+  NS_TEST_EXPECT_MSG_EQ (fullRef.size (), (uint32_t) SentSeqRing::MAX_SPAN, "Reference keeps MAX_SPAN entries");
+  Compare (full, fullRef, 0, 20);
+  Compare (full, fullRef, SentSeqRing::MAX_SPAN - 10, SentSeqRing::MAX_SPAN + 20);
+  full.SetSent (m_origin, Seconds (1));
+  NS_TEST_EXPECT_MSG_EQ (full.HasSent (m_origin), false, "Too old to be kept");
+}
+
+static class SentSeqRingTestSuite : public TestSuite
+{
+public:
+  SentSeqRingTestSuite ()
+    : TestSuite ("tor-sent-seq-ring", UNIT)
+  {
+    AddTestCase (new SentSeqRingMapTestCase (), TestCase::QUICK);
+  }
+} g_sentSeqRingTestSuite;
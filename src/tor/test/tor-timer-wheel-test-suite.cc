@@ -0,0 +1,189 @@
+#include "ns3/test.h"
+#include "ns3/simulator.h"
+#include "ns3/tor-timer-wheel.h"
+
+using namespace ns3;
+
+class TorTimerWheelStateTestCase : public TestCase
+{
+public:
+  TorTimerWheelStateTestCase ();
+  virtual void DoRun (void);
+private:
+  void Fired (void);
+  std::vector<Time> m_fired;
+};
+
+TorTimerWheelStateTestCase::TorTimerWheelStateTestCase ()
+  : TestCase ("Check arming, re-arming and cancelling a single timer")
+{
+}
+void
+TorTimerWheelStateTestCase::Fired (void)
+{
+  m_fired.push_back (Simulator::Now ());
+}
+void
+TorTimerWheelStateTestCase::DoRun (void)
+{
+  TorTimerWheel wheel (MicroSeconds (10));
+  TorTimer timer;
+  timer.SetFunction (&TorTimerWheelStateTestCase::Fired, this);
+  NS_TEST_EXPECT_MSG_EQ (timer.IsExpired (), true, "A new timer is not armed");
+
+  wheel.Schedule (timer, MilliSeconds (1));
+  NS_TEST_EXPECT_MSG_EQ (timer.IsRunning (), true, "The timer is armed");
+  timer.Cancel ();
+  NS_TEST_EXPECT_MSG_EQ (timer.IsExpired (), true, "The timer is cancelled");
+  Simulator::Run ();
+  NS_TEST_EXPECT_MSG_EQ (m_fired.size (), 0u, "A cancelled timer must not fire");
+
+  // re-arming earlier and later than the pending expiry
+  Time start = Simulator::Now ();
+  wheel.Schedule (timer, MilliSeconds (2));
+  wheel.Schedule (timer, MilliSeconds (1));
+  Simulator::Run ();
+  NS_TEST_EXPECT_MSG_EQ (m_fired.size (), 1u, "A re-armed timer fires once");
+  NS_TEST_EXPECT_MSG_EQ (m_fired.back (), start + MilliSeconds (1), "Re-armed to an earlier expiry");
+
+  start = Simulator::Now ();
+  wheel.Schedule (timer, MilliSeconds (1));
+  wheel.Schedule (timer, MilliSeconds (3));
+  Simulator::Run ();
+  NS_TEST_EXPECT_MSG_EQ (m_fired.size (), 2u, "A re-armed timer fires once");
+  NS_TEST_EXPECT_MSG_EQ (m_fired.back (), start + MilliSeconds (3), "Re-armed to a later expiry");
+  NS_TEST_EXPECT_MSG_EQ (timer.IsExpired (), true, "A fired timer is not armed");
+
+  // fires at the next tick boundary
+  start = Simulator::Now ();
+  wheel.Schedule (timer, NanoSeconds (1));
+  Simulator::Run ();
+  NS_TEST_EXPECT_MSG_EQ (m_fired.back (), start + MicroSeconds (10), "Up to one tick late");
+
+  Simulator::Destroy ();
+}
+
+/* Timers armed at delays on every level of the wheel and past its last
+ * one, each shadowed by a simulator event scheduled with the same delay.
+ * A timer must fire exactly when its event does, rounded up to the tick.
+ * Some callbacks re-arm their own timer, others cancel or re-arm a timer
+ * that is still pending far ahead. */
+class TorTimerWheelOrderTestCase : public TestCase
+{
+public:
+  TorTimerWheelOrderTestCase ();
+  virtual void DoRun (void);
+private:
+  enum
+  {
+    N = 400, VICTIMS = 40
+  };
+  void Arm (uint32_t i, Time delay, Time rearm);
+  void Fired (uint32_t i, Time rearm);
+  void Reference (uint32_t i);
+
+  TorTimerWheel *m_wheel;
+  TorTimer *m_timers;
+  EventId m_ref[N];
+  std::vector<std::vector<Time> > m_fired;
+  std::vector<std::vector<Time> > m_expected;
+};
+
+TorTimerWheelOrderTestCase::TorTimerWheelOrderTestCase ()
+  : TestCase ("Check timer wheel expiries against simulator events")
+{
+}
+void
+TorTimerWheelOrderTestCase::Arm (uint32_t i, Time delay, Time rearm)
+{
+  m_timers[i].SetFunction (&TorTimerWheelOrderTestCase::Fired, this, i, rearm);
+  m_wheel->Schedule (m_timers[i], delay);
+  m_ref[i].Cancel ();
+  m_ref[i] = Simulator::Schedule (delay, &TorTimerWheelOrderTestCase::Reference, this, i);
+}
+void
+TorTimerWheelOrderTestCase::Fired (uint32_t i, Time rearm)
+{
+  m_fired[i].push_back (Simulator::Now ());
+  if (rearm.IsStrictlyPositive () && m_fired[i].size () == 1)
+    {
+      Arm (i, rearm, rearm);
+    }
+  if (i < N - VICTIMS && i % 9 == 0 && m_fired[i].size () == 1)
+    {
+      uint32_t victim = N - VICTIMS + i / 9;
+      if (i % 2)
+        {
+          m_timers[victim].Cancel ();
+          m_ref[victim].Cancel ();
+        }
+      else
+        {
+          Arm (victim, MilliSeconds (5), Time (0));
+        }
+    }
+}
+void
+TorTimerWheelOrderTestCase::Reference (uint32_t i)
+{
+  int64_t tick = MicroSeconds (10).GetTimeStep ();
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  m_expected[i].push_back (TimeStep ((now + tick - 1) / tick * tick));
+}
+void
+TorTimerWheelOrderTestCase::DoRun (void)
+{
+  TorTimerWheel wheel (MicroSeconds (10));
+  TorTimer timers[N];
+  m_wheel = &wheel;
+  m_timers = timers;
+  m_fired.assign (N, std::vector<Time> ());
+  m_expected.assign (N, std::vector<Time> ());
+
+  // delays up to 640 us, 41 ms, 2.6 s and 167 s fill the four levels
+  const uint64_t ranges[] = { 640000ULL, 40960000ULL, 2621440000ULL, 167772160000ULL, 400000000000ULL };
+  uint32_t seed = 12345;
+  for (uint32_t i = 0; i < N - VICTIMS; ++i)
+    {
+      seed = seed * 1103515245 + 12345;
+      uint64_t range = ranges[(seed >> 16) % 5];
+      seed = seed * 1103515245 + 12345;
+      Time delay = NanoSeconds (1 + ((uint64_t) seed * 2654435761ULL) % range);
+      Time rearm = i % 7 == 0 ? NanoSeconds (1 + seed % 50000000) : Time (0);
+      Time start = NanoSeconds ((i % 5) * 3333333);
+      Simulator::Schedule (start, &TorTimerWheelOrderTestCase::Arm, this, i, delay, rearm);
+    }
+  // far beyond the last level; cancelled or brought forward from callbacks
+  for (uint32_t i = N - VICTIMS; i < N; ++i)
+    {
+      Arm (i, Seconds (1000) + MilliSeconds (i), Time (0));
+    }
+  Simulator::Run ();
+
+  uint32_t fired = 0;
+  for (uint32_t i = 0; i < N; ++i)
+    {
+      NS_TEST_EXPECT_MSG_EQ (m_fired[i].size (), m_expected[i].size (), "Timer " << i << " fired a different number of times");
+      for (uint32_t k = 0; k < m_fired[i].size () && k < m_expected[i].size (); ++k)
+        {
+          NS_TEST_EXPECT_MSG_EQ (m_fired[i][k], m_expected[i][k], "Timer " << i << " fired at the wrong time");
+        }
+      fired += m_fired[i].size ();
+    }
+  // each re-arming timer fires twice, each cancelled victim never
+  NS_TEST_EXPECT_MSG_EQ (fired, N - VICTIMS + (N - VICTIMS + 6) / 7 + VICTIMS - 20, "Unexpected number of expiries");
+
+  wheel.Clear ();
+  Simulator::Destroy ();
+}
+
+static class TorTimerWheelTestSuite : public TestSuite
+{
+public:
+  TorTimerWheelTestSuite ()
+    : TestSuite ("tor-timer-wheel", UNIT)
+  {
+    AddTestCase (new TorTimerWheelStateTestCase (), TestCase::QUICK);
+    AddTestCase (new TorTimerWheelOrderTestCase (), TestCase::QUICK);
+  }
+} g_torTimerWheelTestSuite;
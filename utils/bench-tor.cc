@@ -0,0 +1,294 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+
+/*
+ * Runs fixed, seeded Tor scenarios once per flavor and reports the cost of
+ * the simulation: events per second, wall-clock seconds per simulated
+ * second, peak RSS, heap bytes allocated per cell delivered to a client,
+ * the cell packets CellPool had to allocate and those it recycled, and a
+ * checksum of all TTLB samples, which changes whenever the simulated
+ * behaviour does. A run that delivers no cell fails.
+ *
+ * Each run is forked off, so that peak RSS and the global state of the
+ * simulator belong to that run alone.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ns3/core-module.h"
+#include "ns3/tor-module.h"
+
+using namespace ns3;
+using namespace std;
+
+/* Heap bytes requested through operator new, in the whole process. */
+static uint64_t g_heapBytes = 0;
+
+void *
+operator new (size_t size)
+{
+  g_heapBytes += size;
+  void *p = malloc (size ? size : 1);
+  if (!p)
+    {
+      throw bad_alloc ();
+    }
+  return p;
+}
+
+void
+operator delete (void *p) throw ()
+{
+  free (p);
+}
+
+void
+operator delete (void *p, size_t) throw ()
+{
+  free (p);
+}
+
+static const char *g_flavors[][2] = {
+  { "vanilla", "ns3::TorApp" },
+  { "pctcp", "ns3::TorPctcpApp" },
+  { "bktap", "ns3::TorBktapApp" },
+  { "e2e", "ns3::TorE2eApp" },
+  { "marut", "ns3::MarutTorBktapApp" },
+  { "n23", "ns3::TorN23App" },
+  { "fair", "ns3::TorFairApp" },
+};
+
+struct BenchConfig
+{
+  uint32_t circuits;
+  Time time;
+  string file;
+  bool link;
+};
+
+static uint64_t g_ttlbs;
+static uint64_t g_checksum;
+static uint64_t g_cells;
+
+/* FNV-1a over circuit id and TTLB in nanoseconds, in completion order. */
+static void
+Checksum (uint64_t v)
+{
+  for (int i = 0; i < 8; ++i)
+    {
+      g_checksum ^= (v >> (8 * i)) & 0xff;
+      g_checksum *= 1099511628211ULL;
+    }
+}
+
+static void
+RecordRx (Ptr<const Packet>)
+{
+  ++g_cells;
+}
+
+static void
+RecordTtlb (int id, string, Time t)
+{
+  Checksum (id);
+  Checksum (t.GetNanoSeconds ());
+  ++g_ttlbs;
+}
+
+/* Web-like clients (320 KiB, think time 1-2 s) on circuits that share a
+ * single middle relay, four circuits per entry and exit. */
+static ApplicationContainer
+SetupStar (TorStarHelper *th, const BenchConfig &config, string type, vector<Ptr<PseudoClientSocket> > &sockets)
+{
+  th->SetTorAppType (type);
+  th->DisableProxies (true);
+  th->EnableNscStack (false);
+  th->EnableLinkEmulation (config.link);
+
+  Ptr<ConstantRandomVariable> request = CreateObject<ConstantRandomVariable> ();
+  request->SetAttribute ("Constant", DoubleValue (320 * 1024));
+  Ptr<UniformRandomVariable> think = CreateObject<UniformRandomVariable> ();
+  think->SetAttribute ("Min", DoubleValue (1.0));
+  think->SetAttribute ("Max", DoubleValue (2.0));
+  Ptr<UniformRandomVariable> start = CreateObject<UniformRandomVariable> ();
+  start->SetAttribute ("Min", DoubleValue (0.1));
+  start->SetAttribute ("Max", DoubleValue (2.0));
+
+  for (uint32_t i = 0; i < config.circuits; ++i)
+    {
+      Ptr<PseudoClientSocket> socket = CreateObject<PseudoClientSocket> (request, think, Seconds (start->GetValue ()));
+      socket->SetCircuit (i, "web");
+      ostringstream entry, exit;
+      entry << "entry" << i / 4;
+      exit << "exit" << i / 4;
+      th->AddCircuit (i, entry.str (), "middle", exit.str (), socket);
+      sockets.push_back (socket);
+    }
+  th->SetRelayAttribute ("middle", "BandwidthRate", DataRateValue (DataRate ("20Mb/s")));
+  th->SetRelayAttribute ("middle", "BandwidthBurst", DataRateValue (DataRate ("20Mb/s")));
+  th->BuildTopology ();
+  return th->GetTorAppsContainer ();
+}
+
+/* Circuits and relays of the given consensus file, as in the dumbbell example. */
+static ApplicationContainer
+SetupDumbbell (TorDumbbellHelper *th, const BenchConfig &config, string type, vector<Ptr<PseudoClientSocket> > &sockets)
+{
+  th->SetTorAppType (type);
+  th->DisableProxies (true);
+  th->EnableNscStack (false);
+  th->EnableLinkEmulation (config.link);
+
+  Ptr<UniformRandomVariable> start = CreateObject<UniformRandomVariable> ();
+  start->SetAttribute ("Min", DoubleValue (0.1));
+  start->SetAttribute ("Max", DoubleValue (2.0));
+  th->SetStartTimeStream (start);
+  th->ParseFile (config.file, config.circuits, 0.1);
+  th->BuildTopology ();
+
+  vector<int>::iterator id;
+  for (id = th->circuitIds.begin (); id != th->circuitIds.end (); ++id)
+    {
+      sockets.push_back (th->GetClientSocket (*id));
+    }
+  return th->GetTorAppsContainer ();
+}
+
+/* Run the simulation that is set up and print its line. Returns whether
+ * any cell reached a client. */
+static bool
+Measure (const BenchConfig &config, string scenario, string flavor,
+         ApplicationContainer relays, vector<Ptr<PseudoClientSocket> > &sockets)
+{
+  for (uint32_t i = 0; i < sockets.size (); ++i)
+    {
+      sockets[i]->TraceConnectWithoutContext ("Ttlb", MakeCallback (&RecordTtlb));
+      sockets[i]->TraceConnectWithoutContext ("Rx", MakeCallback (&RecordRx));
+    }
+  relays.Start (Seconds (0));
+  relays.Stop (config.time);
+  Simulator::Stop (config.time);
+
+  g_ttlbs = 0;
+  g_checksum = 14695981039346656037ULL;
+  g_cells = 0;
+  uint64_t heap = g_heapBytes;
+  uint64_t allocated = CellPool::GetAllocated ();
+  uint64_t recycled = CellPool::GetRecycled ();
+  // uids are handed out in order, so they count the events scheduled
+  uint64_t firstUid = Simulator::ScheduleNow (&Checksum, (uint64_t) 0).GetUid ();
+
+  SystemWallClockMs clock;
+  clock.Start ();
+  Simulator::Run ();
+  double wall = clock.End () / 1000.0;
+
+  uint64_t events = Simulator::ScheduleNow (&Checksum, (uint64_t) 0).GetUid () - firstUid;
+  heap = g_heapBytes - heap;
+  allocated = CellPool::GetAllocated () - allocated;
+  recycled = CellPool::GetRecycled () - recycled;
+
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+
+  printf ("%-9s %-8s %10llu %12.0f %10.4f %10ld %10.1f %10llu %10llu %6llu %016llx\n",
+          scenario.c_str (), flavor.c_str (), (unsigned long long) events,
+          wall > 0 ? events / wall : 0, wall / config.time.GetSeconds (),
+          usage.ru_maxrss, g_cells ? (double) heap / g_cells : 0,
+          (unsigned long long) allocated, (unsigned long long) recycled,
+          (unsigned long long) g_ttlbs, (unsigned long long) g_checksum);
+  fflush (stdout);
+  return g_cells > 0;
+}
+
+static bool
+Run (const BenchConfig &config, string scenario, string flavor, string type)
+{
+  SeedManager::SetSeed (42);
+  SeedManager::SetRun (1);
+  Config::SetDefault ("ns3::TorApp::WindowStart", IntegerValue (500));
+  Config::SetDefault ("ns3::TorApp::WindowIncrement", IntegerValue (50));
+
+  // only the helper in use is created, it draws random variables
+  vector<Ptr<PseudoClientSocket> > sockets;
+  bool delivered;
+  if (scenario == "star")
+    {
+      TorStarHelper th;
+      delivered = Measure (config, scenario, flavor, SetupStar (&th, config, type, sockets), sockets);
+    }
+  else
+    {
+      TorDumbbellHelper th;
+      delivered = Measure (config, scenario, flavor, SetupDumbbell (&th, config, type, sockets), sockets);
+    }
+  Simulator::Destroy ();
+  return delivered;
+}
+
+int
+main (int argc, char *argv[])
+{
+  BenchConfig config;
+  config.circuits = 20;
+  config.time = Seconds (20);
+  config.file = "circuits-5000c50r-20150804.dat";
+  config.link = false;
+  string scenarios = "star,dumbbell";
+  string flavors = "vanilla,pctcp,bktap,e2e,marut,n23,fair";
+
+  CommandLine cmd;
+  cmd.AddValue ("scenarios", "comma-separated, out of star and dumbbell", scenarios);
+  cmd.AddValue ("flavors", "comma-separated Tor flavors", flavors);
+  cmd.AddValue ("circuits", "circuits per scenario", config.circuits);
+  cmd.AddValue ("time", "simulated time per run", config.time);
+  cmd.AddValue ("file", "circuit file of the dumbbell scenario", config.file);
+  cmd.AddValue ("link", "emulate the links between relays (TorLinkChannel)", config.link);
+  cmd.Parse (argc, argv);
+
+  printf ("# scenario flavor events events/s wall/sim-s peak-rss(KiB) heap-bytes/cell pool-allocated pool-recycled ttlbs ttlb-checksum\n");
+  fflush (stdout);
+
+  int failed = 0;
+  stringstream ss (scenarios);
+  string scenario;
+  while (getline (ss, scenario, ','))
+    {
+      NS_ABORT_MSG_UNLESS (scenario == "star" || scenario == "dumbbell", "Unknown scenario " << scenario);
+      stringstream fs (flavors);
+      string flavor;
+      while (getline (fs, flavor, ','))
+        {
+          string type;
+          for (uint32_t i = 0; i < sizeof (g_flavors) / sizeof (g_flavors[0]); ++i)
+            {
+              if (flavor == g_flavors[i][0])
+                {
+                  type = g_flavors[i][1];
+                }
+            }
+          NS_ABORT_MSG_IF (type.empty (), "Unknown flavor " << flavor);
+
+          pid_t pid = fork ();
+          NS_ABORT_MSG_IF (pid < 0, "fork failed");
+          if (pid == 0)
+            {
+              _exit (Run (config, scenario, flavor, type) ? 0 : 1);
+            }
+          int status;
+          waitpid (pid, &status, 0);
+          if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+            {
+              fprintf (stderr, "%s %s failed\n", scenario.c_str (), flavor.c_str ());
+              ++failed;
+            }
+        }
+    }
+  return failed ? 1 : 0;
+}
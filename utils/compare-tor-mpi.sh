@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Checks that tor-dumbbell-example gives the same results on one rank as on
+# several. It runs the example sequentially and then under mpirun for each
+# rank count, and compares the TTLB files. The runs are not bit-identical:
+# random streams are assigned per rank, and events at the same time run in
+# a different order. So the check requires that
+#   - the same circuits complete a download,
+#   - the first TTLB of every circuit is within TOLERANCE (relative),
+#   - the number of TTLBs is within TOLERANCE.
+#
+# Needs ns-3 configured with --enable-mpi, and the example built. Run it from
+# the top directory:
+#
+#   utils/compare-tor-mpi.sh [ranks ...]          (default: 2 4)
+#
+# Environment: TIME (simulated time, default 30s), TOLERANCE (default 0.05),
+# MPIRUN (default "mpirun"; e.g. "mpirun --oversubscribe").
+
+TIME=${TIME:-30s}
+TOLERANCE=${TOLERANCE:-0.05}
+MPIRUN=${MPIRUN:-mpirun}
+RANKS=${*:-2 4}
+ARGS="--nsc=false --time=$TIME"
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+ln -s "$PWD/circuits-10000c100r-20150804.dat" "$DIR/"
+
+./waf --cwd="$DIR" --run "tor-dumbbell-example $ARGS --ttlbs=$DIR/ttlbs-1.txt" > "$DIR/run-1.log" 2>&1 \
+  || { cat "$DIR/run-1.log"; exit 1; }
+
+failed=0
+for n in $RANKS; do
+  ./waf --cwd="$DIR" --command-template="$MPIRUN -np $n %s $ARGS --ranks=$n --ttlbs=$DIR/ttlbs-$n.txt" \
+        --run tor-dumbbell-example > "$DIR/run-$n.log" 2>&1 \
+    || { cat "$DIR/run-$n.log"; exit 1; }
+
+  # one "circuit seconds" line per download, in completion order per circuit
+  awk -v tol="$TOLERANCE" -v ranks="$n" '
+    function abs (x) { return x < 0 ? -x : x }
+    FNR == NR { if (!($1 in a)) a[$1] = $2; na++; next }
+    { if (!($1 in b)) b[$1] = $2; nb++ }
+    END {
+      bad = 0; worst = 0
+      for (i in a)
+        {
+          if (!(i in b)) { print "circuit " i ": no download on " ranks " ranks"; bad = 1; continue }
+          d = abs (b[i] - a[i]) / a[i]
+          if (d > worst) worst = d
+          if (d > tol) { print "circuit " i ": first TTLB " a[i] "s vs " b[i] "s"; bad = 1 }
+        }
+      for (i in b)
+        if (!(i in a)) { print "circuit " i ": no download on 1 rank"; bad = 1 }
+      if (abs (nb - na) > tol * na) { print "TTLBs: " na " vs " nb; bad = 1 }
+      printf "%s ranks: %d vs %d TTLBs, first TTLBs differ by up to %.1f%%: %s\n",
+             ranks, na, nb, 100 * worst, bad ? "FAIL" : "ok"
+      exit bad
+    }' "$DIR/ttlbs-1.txt" "$DIR/ttlbs-$n.txt" || failed=1
+done
+exit $failed